@@ -0,0 +1,1296 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <time.h>
+#include <getopt.h>
+
+#include "geckocamera.h"
+#include "geckocamera-codec.h"
+#include "geckocamera-latency.h"
+#include "geckocamera-pool.h"
+#include "geckocamera-scale.h"
+#include "geckocamera-simulcast.h"
+
+using namespace std;
+using namespace gecko::camera;
+using namespace gecko::codec;
+
+#ifndef GECKOCAMERA_VERSION
+#define GECKOCAMERA_VERSION "unknown"
+#endif
+
+// Count every C++ allocation in the process, including the library and the
+// plugins, to find allocations on the frame path.
+static atomic<uint64_t> allocationCount(0);
+
+void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static uint64_t monotonicUs()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t cpuTimeUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static CodecType codecTypeFromName(const string &name)
+{
+    if (name == "vp8") {
+        return VideoCodecVP8;
+    } else if (name == "vp9") {
+        return VideoCodecVP9;
+    } else if (name == "h264") {
+        return VideoCodecH264;
+    }
+    return VideoCodecUnknown;
+}
+
+enum DecodeMode {
+    DecodeNone,
+    DecodeBlocking,
+    DecodeNonBlocking
+};
+
+static bool decodeModeFromName(const string &name, DecodeMode &mode)
+{
+    if (name == "blocking") {
+        mode = DecodeBlocking;
+    } else if (name == "nonblocking") {
+        mode = DecodeNonBlocking;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool dropPolicyFromName(const string &name, FrameDropPolicy &policy)
+{
+    if (name == "oldest") {
+        policy = DropOldest;
+    } else if (name == "newest") {
+        policy = DropNewest;
+    } else if (name == "block") {
+        policy = BlockProducer;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+class Percentiles
+{
+public:
+    explicit Percentiles(vector<uint64_t> samples)
+        : m_samples(move(samples))
+    {
+        sort(m_samples.begin(), m_samples.end());
+    }
+
+    uint64_t at(double p) const
+    {
+        if (m_samples.empty()) {
+            return 0;
+        }
+        size_t i = min(m_samples.size() - 1, (size_t)(p * m_samples.size()));
+        return m_samples[i];
+    }
+
+    string json() const
+    {
+        ostringstream os;
+        os << "{ \"p50\": " << at(0.5)
+           << ", \"p99\": " << at(0.99)
+           << ", \"p99.9\": " << at(0.999)
+           << ", \"max\": " << (m_samples.empty() ? 0 : m_samples.back()) << " }";
+        return os.str();
+    }
+
+private:
+    vector<uint64_t> m_samples;
+};
+
+// Collects the results of CameraManager::queryAllCapabilities().
+class CapabilityCollector : public CapabilityListener
+{
+public:
+    void onCameraCapabilities(const string &cameraId, bool success,
+                              const vector<CameraCapability> &caps)
+    {
+        scoped_lock lock(m_mutex);
+        cameras++;
+        if (!success) {
+            failed++;
+        }
+    }
+
+    void onCapabilitiesComplete()
+    {
+        scoped_lock lock(m_mutex);
+        m_complete = true;
+        m_cond.notify_one();
+    }
+
+    void wait()
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_complete; });
+    }
+
+    unsigned int cameras = 0;
+    unsigned int failed = 0;
+
+private:
+    mutex m_mutex;
+    condition_variable m_cond;
+    bool m_complete = false;
+};
+
+// Stands in for a second consumer such as a preview or a recorder.
+class ExtraListener : public CameraListener
+{
+public:
+    void onCameraFrame(shared_ptr<GraphicBuffer> buffer)
+    {
+        (void)buffer;
+        frames.fetch_add(1, memory_order_relaxed);
+    }
+
+    void onCameraError(string errorDescription)
+    {
+        (void)errorDescription;
+    }
+
+    atomic<unsigned int> frames{0};
+};
+
+// Records what the capture arbitration did to a camera
+class ArbitrationListener : public ExtraListener
+{
+public:
+    void onCaptureStateChanged(CaptureState state, const CameraCapability &cap)
+    {
+        (void)cap;
+        lastState = state;
+        changes.fetch_add(1, memory_order_relaxed);
+    }
+
+    const char *stateName() const
+    {
+        if (!changes) {
+            return "none";
+        }
+        switch (lastState.load()) {
+        case CaptureStarted:
+            return "started";
+        case CaptureDowngraded:
+            return "downgraded";
+        case CaptureQueued:
+            return "queued";
+        case CapturePreempted:
+            return "preempted";
+        }
+        return "unknown";
+    }
+
+    atomic<CaptureState> lastState{CaptureStarted};
+    atomic<unsigned int> changes{0};
+};
+
+class GeckoCameraBench
+    : CameraListener
+    , VideoEncoderListener
+    , SimulcastEncoderListener
+    , VideoDecoderListener
+{
+public:
+    GeckoCameraBench(CodecType codecType, unsigned int durationSeconds)
+        : codecType(codecType)
+        , durationSeconds(durationSeconds)
+    {
+        uint64_t startUs = monotonicUs();
+        cameraManager = gecko_camera_manager();
+        cameraManagerUs = monotonicUs() - startUs;
+        startUs = monotonicUs();
+        codecManager = gecko_codec_manager();
+        codecManagerUs = monotonicUs() - startUs;
+    }
+
+    void setFrameDelivery(unsigned int queueDepth, FrameDropPolicy policy)
+    {
+        deliveryQueueDepth = queueDepth;
+        deliveryPolicy = policy;
+    }
+
+    // Fan the frames out to more listeners, each with a queue like the
+    // main listener's.
+    void setExtraListeners(unsigned int count)
+    {
+        extraListeners.clear();
+        for (unsigned int i = 0; i < count; i++) {
+            extraListeners.push_back(make_unique<ExtraListener>());
+        }
+    }
+
+    // Decode the encoded frames again, queued either from the encoder
+    // thread with decode() or from the main thread with tryDecode().
+    void setDecodeMode(DecodeMode mode)
+    {
+        decodeMode = mode;
+    }
+
+    // Encode at the capture size divided by this, scaling the frames on
+    // the way to the encoder.
+    void setEncodeScale(unsigned int divisor)
+    {
+        encodeScale = divisor;
+    }
+
+    // Encode that many layers, each half the size of the previous one.
+    void setSimulcastLayers(unsigned int layers)
+    {
+        simulcastLayers = layers;
+    }
+
+    // Switch the encoder between two bitrates every second.
+    void setRateSwitching(bool enabled)
+    {
+        rateSwitching = enabled;
+    }
+
+    // Key frame interval and intra refresh given to the encoder
+    void setKeyFrames(int intervalMs, int intraRefreshFrames)
+    {
+        keyFrameIntervalMs = intervalMs;
+        this->intraRefreshFrames = intraRefreshFrames;
+    }
+
+    // Capture at this frame rate, only in the modes whose range has it.
+    void setFrameRate(unsigned int fps)
+    {
+        frameRate = fps;
+    }
+
+    // Fail the run if the frame path allocates more than this.
+    void setAllocationLimit(double allocationsPerFrame)
+    {
+        allocationLimit = allocationsPerFrame;
+    }
+
+    // Switch between the first two cameras of the provider that many
+    // times, keeping up to standby cameras connected.
+    void setCameraSwitching(unsigned int switches, unsigned int standby)
+    {
+        switchCount = switches;
+        standbyCount = standby;
+    }
+
+    void setArbitration(bool enabled)
+    {
+        arbitration = enabled;
+    }
+
+    int run(const string &provider, int modeNumber, ostream &out)
+    {
+        CameraInfo info;
+        bool found = false;
+
+        // Time to fill a camera picker
+        uint64_t startUs = monotonicUs();
+        CapabilityCollector collector;
+        cameraManager->queryAllCapabilities(&collector);
+        collector.wait();
+        uint64_t capabilitiesUs = monotonicUs() - startUs;
+
+        for (int i = 0; i < cameraManager->getNumberOfCameras(); i++) {
+            if (cameraManager->getCameraInfo(i, info) && info.provider == provider) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            cerr << "No camera from provider " << provider << "\n";
+            return -1;
+        }
+
+        vector<CameraCapability> caps;
+        if (!cameraManager->queryCapabilities(info.id, caps) || caps.empty()) {
+            cerr << "Cannot query capabilities of " << info.id << "\n";
+            return -1;
+        }
+
+        out << "{\n"
+            << "  \"version\": \"" << GECKOCAMERA_VERSION << "\",\n"
+            << "  \"camera\": \"" << info.id << "\",\n"
+            << "  \"durationSeconds\": " << durationSeconds << ",\n"
+            << "  \"modes\": [";
+
+        bool first = true;
+        for (unsigned int i = 0; i < caps.size(); i++) {
+            if (modeNumber >= 0 && (unsigned int)modeNumber != i) {
+                continue;
+            }
+            CameraCapability cap = caps[i];
+            if (frameRate) {
+                if (frameRate > cap.fps || frameRate < (cap.minFps ? cap.minFps : cap.fps)) {
+                    continue;
+                }
+                cap.fps = frameRate;
+            }
+            string result;
+            if (!runMode(info.id, cap, result)) {
+                return -1;
+            }
+            out << (first ? "\n" : ",\n") << result;
+            first = false;
+        }
+        out << "\n  ],\n";
+        if (switchCount) {
+            string result;
+            if (!runSwitching(provider, result)) {
+                return -1;
+            }
+            out << result;
+        }
+        if (arbitration) {
+            string result;
+            if (!runArbitration(provider, result)) {
+                return -1;
+            }
+            out << result;
+        }
+        out << "  \"startup\": {\n"
+            << "    \"cameraManagerUs\": " << cameraManagerUs << ",\n"
+            << "    \"codecManagerUs\": " << codecManagerUs << ",\n"
+            << "    \"capabilities\": { \"us\": " << capabilitiesUs
+            << ", \"cameras\": " << collector.cameras
+            << ", \"failed\": " << collector.failed << " },\n"
+            << "    \"plugins\": [";
+        first = true;
+        for (const PluginLoadStats &plugin : pluginLoadStats()) {
+            out << (first ? "\n" : ",\n")
+                << "      { \"path\": \"" << plugin.path << "\""
+                << ", \"manifestCached\": " << (plugin.manifestCached ? "true" : "false")
+                << ", \"loaded\": " << (plugin.loaded ? "true" : "false")
+                << ", \"loadUs\": " << plugin.loadUs
+                << ", \"cameraInitUs\": " << plugin.cameraInitUs
+                << ", \"codecInitUs\": " << plugin.codecInitUs << " }";
+            first = false;
+        }
+        out << (first ? "]\n" : "\n    ]\n") << "  }\n}\n";
+        return allocationLimitExceeded ? 1 : 0;
+    }
+
+private:
+    bool runSwitching(const string &provider, string &result)
+    {
+        vector<string> cameraIds;
+        for (int i = 0; i < cameraManager->getNumberOfCameras() && cameraIds.size() < 2; i++) {
+            CameraInfo info;
+            if (cameraManager->getCameraInfo(i, info) && info.provider == provider) {
+                cameraIds.push_back(info.id);
+            }
+        }
+        vector<CameraCapability> caps;
+        if (cameraIds.size() < 2 || !cameraManager->queryCapabilities(cameraIds[0], caps)
+                || caps.empty()) {
+            cerr << "Switching needs two cameras from provider " << provider << "\n";
+            return false;
+        }
+        // The smallest mode, to measure the switch rather than the frames
+        const CameraCapability &cap = caps.back();
+        bool standby = cameraManager->setStandbyCameras(standbyCount);
+
+        cerr << "Switching " << switchCount << " times at " << cap.width << "x"
+             << cap.height << "@" << cap.fps << "\n";
+
+        ExtraListener listener;
+        shared_ptr<Camera> camera;
+        if (!cameraManager->openCamera(cameraIds[0], camera)) {
+            cerr << "Cannot open camera " << cameraIds[0] << "\n";
+            return false;
+        }
+        camera->setListener(&listener);
+        if (!camera->startCapture(cap)) {
+            cerr << "Cannot start capture\n";
+            return false;
+        }
+
+        vector<uint64_t> startLatency;
+        vector<uint64_t> firstFrameLatency;
+        unsigned int noFrame = 0;
+        for (unsigned int i = 0; i < switchCount; i++) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            if (!cameraManager->switchCamera(camera, cameraIds[(i + 1) % 2], cap)) {
+                cerr << "Cannot switch to " << cameraIds[(i + 1) % 2] << "\n";
+                return false;
+            }
+            CameraSwitchStats stats;
+            auto deadline = chrono::steady_clock::now() + chrono::seconds(2);
+            while (camera->getSwitchStats(stats) && !stats.firstFrameUs
+                    && chrono::steady_clock::now() < deadline) {
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+            startLatency.push_back(stats.startUs);
+            if (stats.firstFrameUs) {
+                firstFrameLatency.push_back(stats.firstFrameUs);
+            } else {
+                noFrame++;
+            }
+        }
+        camera->stopCapture();
+        camera->setListener(nullptr);
+        camera.reset();
+        cameraManager->setStandbyCameras(0);
+
+        ostringstream os;
+        os << "  \"switching\": {\n"
+           << "    \"switches\": " << switchCount << ",\n"
+           << "    \"standby\": " << (standby ? standbyCount : 0) << ",\n"
+           << "    \"startUs\": " << Percentiles(startLatency).json() << ",\n"
+           << "    \"firstFrameUs\": " << Percentiles(firstFrameLatency).json() << ",\n"
+           << "    \"noFrame\": " << noFrame << "\n"
+           << "  },\n";
+        result = os.str();
+        return true;
+    }
+
+    // A low priority camera captures, then a high priority one starts in
+    // the same mode and stops again. Run with the limits of the plugin
+    // set, e.g. GECKO_CAMERA_DUMMY_MAX_PIXELS for the dummy cameras.
+    bool runArbitration(const string &provider, string &result)
+    {
+        vector<string> cameraIds;
+        for (int i = 0; i < cameraManager->getNumberOfCameras() && cameraIds.size() < 2; i++) {
+            CameraInfo info;
+            if (cameraManager->getCameraInfo(i, info) && info.provider == provider) {
+                cameraIds.push_back(info.id);
+            }
+        }
+        vector<CameraCapability> caps;
+        if (cameraIds.size() < 2 || !cameraManager->queryCapabilities(cameraIds[0], caps)
+                || caps.empty()) {
+            cerr << "Arbitration needs two cameras from provider " << provider << "\n";
+            return false;
+        }
+        const CameraCapability &cap = caps.front();
+        cerr << "Arbitrating two cameras at " << cap.width << "x" << cap.height << "\n";
+
+        ArbitrationListener lowListener;
+        ArbitrationListener highListener;
+        shared_ptr<Camera> low;
+        shared_ptr<Camera> high;
+        if (!cameraManager->openCamera(cameraIds[0], low)
+                || !cameraManager->openCamera(cameraIds[1], high)) {
+            cerr << "Cannot open the cameras\n";
+            return false;
+        }
+        low->setCapturePriority(CapturePriorityLow);
+        high->setCapturePriority(CapturePriorityHigh);
+        low->setListener(&lowListener);
+        high->setListener(&highListener);
+
+        auto phase = [&](const char *name, bool withHigh) {
+            lowListener.frames = 0;
+            highListener.frames = 0;
+            this_thread::sleep_for(chrono::milliseconds(500));
+            ostringstream os;
+            os << "    \"" << name << "\": { \"low\": \"" << lowListener.stateName()
+               << "\", \"lowFrames\": " << lowListener.frames;
+            if (withHigh) {
+                os << ", \"high\": \"" << highListener.stateName()
+                   << "\", \"highFrames\": " << highListener.frames;
+            }
+            os << " }";
+            return os.str();
+        };
+
+        bool ok = low->startCapture(cap);
+        string alone = phase("alone", false);
+        ok = ok && high->startCapture(cap);
+        string together = phase("together", true);
+        high->stopCapture();
+        string resumed = phase("resumed", false);
+        low->stopCapture();
+        low->setListener(nullptr);
+        high->setListener(nullptr);
+        if (!ok) {
+            cerr << "Cannot start capture\n";
+            return false;
+        }
+
+        ostringstream os;
+        os << "  \"arbitration\": {\n"
+           << "    \"mode\": \"" << cap.width << "x" << cap.height << "\",\n"
+           << alone << ",\n" << together << ",\n" << resumed << "\n"
+           << "  },\n";
+        result = os.str();
+        return true;
+    }
+
+    bool runMode(const string &cameraId, const CameraCapability &cap, string &result)
+    {
+        shared_ptr<Camera> camera;
+        if (!cameraManager->openCamera(cameraId, camera)) {
+            cerr << "Cannot open camera " << cameraId << "\n";
+            return false;
+        }
+
+        cerr << "Running " << cap.width << "x" << cap.height << "@" << cap.fps << "\n";
+
+        initEncoder(cap);
+        initDecoder(cap);
+
+        // Reserve enough space so that recording doesn't allocate.
+        size_t expected = (size_t)cap.fps * durationSeconds * 2 + 16;
+        deliveryLatency.clear();
+        deliveryLatency.reserve(expected);
+        callbackDuration.clear();
+        callbackDuration.reserve(expected);
+        frameCount = 0;
+        droppedCount = 0;
+        encodedCount = 0;
+        keyFrameCount = 0;
+        encodeErrors = 0;
+        rateUpdates[RateUpdateInPlace] = 0;
+        rateUpdates[RateUpdateRestarted] = 0;
+        rateUpdates[RateUpdateFailed] = 0;
+        rateUpdateMaxUs = 0;
+        decodeQueued = 0;
+        decodedCount = 0;
+        decodeWouldBlock = 0;
+        decodeCredits = 0;
+        decodeErrors = 0;
+        pendingHead = pendingCount = 0;
+        lastTimestampUs = 0;
+        framePeriodUs = 1000000 / cap.fps;
+
+        camera->setListener(this);
+        camera->setFrameDelivery(deliveryQueueDepth, deliveryPolicy);
+        for (auto &listener : extraListeners) {
+            listener->frames = 0;
+            if (!camera->addListener(listener.get(), deliveryQueueDepth, deliveryPolicy)) {
+                cerr << "Cannot add listener\n";
+                return false;
+            }
+        }
+        if (!camera->startCapture(cap)) {
+            cerr << "Cannot start capture\n";
+            return false;
+        }
+
+        // Skip the first frames, they include the startup costs.
+        waitUntil(chrono::steady_clock::now() + chrono::milliseconds(500));
+        latencyReset();
+        recording = true;
+        uint64_t startUs = monotonicUs();
+        uint64_t startCpuUs = cpuTimeUs();
+        uint64_t startAllocations = allocationCount.load();
+        GraphicBufferMapStats startMapping = graphicBufferMapStats();
+
+        waitUntil(chrono::steady_clock::now() + chrono::seconds(durationSeconds));
+
+        recording = false;
+        uint64_t elapsedUs = monotonicUs() - startUs;
+        uint64_t cpuUs = cpuTimeUs() - startCpuUs;
+        uint64_t allocations = allocationCount.load() - startAllocations;
+        GraphicBufferMapStats mapping = graphicBufferMapStats();
+
+        camera->stopCapture();
+        camera->setListener(nullptr);
+
+        FrameDeliveryStats delivery;
+        camera->getFrameDeliveryStats(delivery);
+        vector<FrameDeliveryStats> extraDelivery(extraListeners.size());
+        for (unsigned int i = 0; i < extraListeners.size(); i++) {
+            camera->getFrameDeliveryStats(extraListeners[i].get(), extraDelivery[i]);
+            camera->removeListener(extraListeners[i].get());
+        }
+
+        VideoEncoderStats stats;
+        bool haveStats = videoEncoder && videoEncoder->getStats(stats);
+        videoEncoder.reset();
+        vector<SimulcastLayerStats> layers;
+        if (simulcastEncoder) {
+            layers = simulcastEncoder->getStats();
+            simulcastEncoder.reset();
+        }
+        if (videoDecoder) {
+            videoDecoder->stop();
+            videoDecoder.reset();
+        }
+        releasePendingFrames();
+
+        unsigned int frames = frameCount;
+        if (allocationLimit >= 0 && frames
+                && (double)allocations / frames > allocationLimit) {
+            cerr << "Too many allocations per frame: "
+                 << (double)allocations / frames << " > " << allocationLimit << "\n";
+            allocationLimitExceeded = true;
+        }
+        ostringstream os;
+        os << "    {\n"
+           << "      \"width\": " << cap.width << ",\n"
+           << "      \"height\": " << cap.height << ",\n"
+           << "      \"fps\": " << cap.fps << ",\n"
+           << "      \"minFps\": " << cap.minFps << ",\n"
+           << "      \"frames\": " << frames << ",\n"
+           << "      \"deliveredFps\": " << (frames * 1e6 / elapsedUs) << ",\n"
+           << "      \"framesDropped\": " << droppedCount << ",\n"
+           << "      \"deliveryLatencyUs\": " << Percentiles(deliveryLatency).json() << ",\n"
+           << "      \"callbackDurationUs\": " << Percentiles(callbackDuration).json() << ",\n"
+           << "      \"cpuUsPerFrame\": " << (frames ? (double)cpuUs / frames : 0) << ",\n"
+           << "      \"allocationsPerFrame\": "
+           << (frames ? (double)allocations / frames : 0) << ",\n"
+           << "      \"delivery\": { \"queueDepth\": " << delivery.queueDepth
+           << ", \"delivered\": " << delivery.delivered
+           << ", \"dropped\": " << delivery.dropped
+           << ", \"maxQueued\": " << delivery.maxQueued << " },\n"
+           << "      \"listeners\": [";
+        for (unsigned int i = 0; i < extraDelivery.size(); i++) {
+            os << (i ? ", " : "")
+               << "{ \"delivered\": " << extraDelivery[i].delivered
+               << ", \"dropped\": " << extraDelivery[i].dropped
+               << ", \"maxQueued\": " << extraDelivery[i].maxQueued << " }";
+        }
+        os << "],\n";
+        os << "      \"mapping\": { \"calls\": " << mapping.mapCalls - startMapping.mapCalls
+           << ", \"locksSaved\": " << mapping.locksSaved - startMapping.locksSaved << " },\n"
+           << "      \"stages\": [";
+        bool first = true;
+        for (const LatencySummary &s : latencyQuery()) {
+            os << (first ? "\n" : ",\n")
+               << "        { \"stream\": \"" << s.stream << "\""
+               << ", \"stage\": \"" << latencyStageName(s.stage) << "\""
+               << ", \"count\": " << s.count
+               << ", \"p50\": " << s.p50Us
+               << ", \"p99\": " << s.p99Us
+               << ", \"p99.9\": " << s.p999Us
+               << ", \"max\": " << s.maxUs << " }";
+            first = false;
+        }
+        os << (first ? "],\n" : "\n      ],\n")
+           << "      \"encoder\": ";
+        if (encoderAvailable) {
+            os << "{ \"size\": \"" << encodeWidth << "x" << encodeHeight << "\""
+               << ", \"framesEncoded\": " << encodedCount
+               << ", \"keyFrames\": " << keyFrameCount
+               << ", \"errors\": " << encodeErrors;
+            if (haveStats) {
+                os << ", \"zeroCopy\": " << stats.framesZeroCopy
+                   << ", \"bufferPoolHits\": " << stats.bufferPoolHits
+                   << ", \"bufferPoolMisses\": " << stats.bufferPoolMisses
+                   << ", \"held\": " << stats.encodedFramesHeld;
+            }
+            if (rateSwitching) {
+                os << ", \"rates\": { \"inPlace\": " << rateUpdates[RateUpdateInPlace]
+                   << ", \"restarted\": " << rateUpdates[RateUpdateRestarted]
+                   << ", \"failed\": " << rateUpdates[RateUpdateFailed]
+                   << ", \"maxUs\": " << rateUpdateMaxUs << " }";
+            }
+            if (!layers.empty()) {
+                os << ", \"layers\": [";
+                for (unsigned int i = 0; i < layers.size(); i++) {
+                    os << (i ? ", " : "")
+                       << "{ \"size\": \"" << layers[i].width << "x" << layers[i].height << "\""
+                       << ", \"active\": " << (layers[i].active ? "true" : "false")
+                       << ", \"framesEncoded\": " << layers[i].framesEncoded
+                       << ", \"bytes\": " << layers[i].bytesEncoded
+                       << ", \"dropped\": " << layers[i].framesDropped
+                       << ", \"skipped\": " << layers[i].framesSkipped << " }";
+                }
+                os << "]";
+            }
+            os << " },\n";
+        } else {
+            os << "null,\n";
+        }
+        os << "      \"decoder\": ";
+        if (decoderAvailable) {
+            os << "{ \"mode\": \""
+               << (decodeMode == DecodeBlocking ? "blocking" : "nonblocking") << "\""
+               << ", \"framesQueued\": " << decodeQueued
+               << ", \"framesDecoded\": " << decodedCount
+               << ", \"wouldBlock\": " << decodeWouldBlock
+               << ", \"inputCredits\": " << decodeCredits
+               << ", \"errors\": " << decodeErrors << " }\n";
+        } else {
+            os << "null\n";
+        }
+        os << "    }";
+        result = os.str();
+        return true;
+    }
+
+    void initEncoder(const CameraCapability &cap)
+    {
+        encoderAvailable = false;
+        videoEncoder.reset();
+        simulcastEncoder.reset();
+        if (codecType == VideoCodecUnknown) {
+            return;
+        }
+        encodeWidth = (cap.width / encodeScale) & ~1;
+        encodeHeight = (cap.height / encodeScale) & ~1;
+        if (simulcastLayers) {
+            initSimulcast(cap);
+            return;
+        }
+        if (codecManager->videoEncoderAvailable(codecType) &&
+                codecManager->createVideoEncoder(codecType, videoEncoder)) {
+            VideoEncoderMetadata meta;
+
+            if (encodeScale > 1) {
+                videoEncoder = make_shared<ScalingVideoEncoder>(videoEncoder);
+            }
+            meta.codecType = codecType;
+            meta.width = encodeWidth;
+            meta.height = encodeHeight;
+            meta.stride = encodeWidth;
+            meta.sliceHeight = encodeHeight;
+            meta.bitrate = 2000000;
+            meta.framerate = cap.fps;
+            meta.keyFrameIntervalMs = keyFrameIntervalMs;
+            meta.intraRefreshFrames = intraRefreshFrames;
+
+            if (videoEncoder->init(meta)) {
+                videoEncoder->setListener(this);
+                encoderAvailable = true;
+                return;
+            }
+        }
+        cerr << "Video encoder not available\n";
+        videoEncoder.reset();
+    }
+
+    void initSimulcast(const CameraCapability &cap)
+    {
+        vector<SimulcastLayer> layers;
+        for (unsigned int i = 0; i < simulcastLayers; i++) {
+            SimulcastLayer layer;
+            layer.width = max(2u, (encodeWidth >> i) & ~1);
+            layer.height = max(2u, (encodeHeight >> i) & ~1);
+            layer.bitrate = 2000000 >> (2 * i);
+            layer.framerate = cap.fps;
+            layer.keyFrameIntervalMs = keyFrameIntervalMs;
+            layer.intraRefreshFrames = intraRefreshFrames;
+            layers.push_back(layer);
+        }
+        simulcastEncoder = make_unique<SimulcastEncoder>(codecManager);
+        simulcastEncoder->setListener(this);
+        if (simulcastEncoder->init(codecType, layers)) {
+            encoderAvailable = true;
+            return;
+        }
+        cerr << "Video encoder not available\n";
+        simulcastEncoder.reset();
+    }
+
+    void initDecoder(const CameraCapability &cap)
+    {
+        decoderAvailable = false;
+        videoDecoder.reset();
+        if (!encoderAvailable || decodeMode == DecodeNone) {
+            return;
+        }
+        if (codecManager->videoDecoderAvailable(codecType) &&
+                codecManager->createVideoDecoder(codecType, videoDecoder)) {
+            VideoDecoderMetadata meta;
+
+            meta.codecType = codecType;
+            meta.width = encodeWidth;
+            meta.height = encodeHeight;
+            meta.framerate = cap.fps;
+            meta.codecSpecific = nullptr;
+            meta.codecSpecificSize = 0;
+
+            if (videoDecoder->init(meta)) {
+                videoDecoder->setListener(this);
+                decoderAvailable = true;
+                return;
+            }
+        }
+        cerr << "Video decoder not available\n";
+        videoDecoder.reset();
+    }
+
+    void waitUntil(chrono::steady_clock::time_point deadline)
+    {
+        if (decoderAvailable && decodeMode == DecodeNonBlocking) {
+            decodeLoop(deadline);
+        } else {
+            this_thread::sleep_until(deadline);
+        }
+    }
+
+    // One thread serving the decoder without ever blocking on it.
+    void decodeLoop(chrono::steady_clock::time_point deadline)
+    {
+        unique_lock<mutex> lock(pendingLock);
+        while (pendingCond.wait_until(lock, deadline, [this] { return pendingReady; })) {
+            pendingReady = false;
+            while (pendingCount) {
+                shared_ptr<const EncodedFrame> &frame = pending[pendingHead];
+                void *ref = encodedFrameRefs->hold(frame);
+                DecodeResult result = videoDecoder->tryDecode(
+                    frame->data, frame->size, frame->timestampUs, frame->frameType,
+                    &EncodedFrameRefs::release, ref);
+                if (result == DecodeWouldBlock) {
+                    EncodedFrameRefs::release(ref);
+                    decodeWouldBlock++;
+                    break;
+                }
+                if (result == DecodeOk) {
+                    decodeQueued++;
+                } else {
+                    EncodedFrameRefs::release(ref);
+                    decodeErrors++;
+                }
+                frame.reset();
+                pendingHead = (pendingHead + 1) % MAX_PENDING;
+                pendingCount--;
+            }
+        }
+    }
+
+    void releasePendingFrames()
+    {
+        scoped_lock lock(pendingLock);
+        while (pendingCount) {
+            pending[pendingHead].reset();
+            pendingHead = (pendingHead + 1) % MAX_PENDING;
+            pendingCount--;
+        }
+    }
+
+    // Camera
+    void onCameraFrame(shared_ptr<GraphicBuffer> buffer)
+    {
+        uint64_t startUs = monotonicUs();
+
+        shared_ptr<const YCbCrFrame> frame = buffer->mapYCbCr();
+        if (frame && encoderAvailable) {
+            bool queued = simulcastEncoder
+                          ? simulcastEncoder->encode(frame, false)
+                          : videoEncoder->encode(frame, false);
+            if (!queued) {
+                encodeErrors++;
+            }
+            if (rateSwitching && recording && frameCount
+                    && !(frameCount % (1000000 / framePeriodUs))) {
+                switchRates();
+            }
+        }
+
+        if (recording) {
+            if (lastTimestampUs && buffer->timestampUs > lastTimestampUs) {
+                uint64_t gap = buffer->timestampUs - lastTimestampUs;
+                // Count missing frames from timestamp gaps
+                droppedCount += (gap + framePeriodUs / 2) / framePeriodUs - 1;
+            }
+            deliveryLatency.push_back(startUs - buffer->timestampUs);
+            callbackDuration.push_back(monotonicUs() - startUs);
+            frameCount++;
+        }
+        lastTimestampUs = buffer->timestampUs;
+    }
+
+    void onCameraError(string errorDescription)
+    {
+        cerr << "Camera error: " << errorDescription << "\n";
+    }
+
+    void switchRates()
+    {
+        int bitrate = (frameCount / (1000000 / framePeriodUs)) % 2 ? 1000000 : 2000000;
+        int framerate = 1000000 / framePeriodUs;
+        uint64_t startUs = monotonicUs();
+        RateUpdate result = simulcastEncoder
+                            ? simulcastEncoder->setLayerRates(0, bitrate, 0)
+                            : videoEncoder->setRates(bitrate, framerate);
+        rateUpdateMaxUs = max(rateUpdateMaxUs, monotonicUs() - startUs);
+        rateUpdates[result]++;
+    }
+
+    // Encoder
+    void onEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs, FrameType type)
+    {
+        if (recording) {
+            encodedCount++;
+            if (type == KeyFrame) {
+                keyFrameCount++;
+            }
+        }
+    }
+
+    // Frames to decode are taken by reference rather than copied.
+    bool wantsEncodedFrameRefs()
+    {
+        return decodeMode != DecodeNone;
+    }
+
+    void onEncodedFrameRef(shared_ptr<const EncodedFrame> frame)
+    {
+        onEncodedFrame(nullptr, frame->size, frame->timestampUs, frame->frameType);
+        if (!decoderAvailable) {
+            return;
+        }
+
+        if (decodeMode == DecodeBlocking) {
+            void *ref = encodedFrameRefs->hold(frame);
+            if (videoDecoder->decode(frame->data, frame->size, frame->timestampUs,
+                                     frame->frameType, &EncodedFrameRefs::release, ref)) {
+                decodeQueued++;
+            } else {
+                EncodedFrameRefs::release(ref);
+                decodeErrors++;
+            }
+        } else {
+            scoped_lock lock(pendingLock);
+            if (pendingCount == MAX_PENDING) {
+                decodeErrors++;
+                return;
+            }
+            pending[(pendingHead + pendingCount) % MAX_PENDING] = move(frame);
+            pendingCount++;
+            pendingReady = true;
+            pendingCond.notify_one();
+        }
+    }
+
+    void onEncoderError(string errorDescription)
+    {
+        cerr << "Video encoder error: " << errorDescription << "\n";
+        encodeErrors++;
+    }
+
+    // Simulcast, the first layer is decoded like a single stream.
+    void onEncodedFrame(unsigned int layer, uint8_t *data, size_t size,
+                        uint64_t timestampUs, FrameType type)
+    {
+        if (!layer) {
+            onEncodedFrame(data, size, timestampUs, type);
+        }
+    }
+
+    void onEncodedFrameRef(unsigned int layer, shared_ptr<const EncodedFrame> frame)
+    {
+        if (!layer) {
+            onEncodedFrameRef(move(frame));
+        }
+    }
+
+    void onEncoderError(unsigned int layer, string errorDescription)
+    {
+        cerr << "Layer " << layer << ": ";
+        onEncoderError(errorDescription);
+    }
+
+    // Decoder
+    void onDecodedYCbCrFrame(const YCbCrFrame *frame)
+    {
+        if (recording) {
+            decodedCount++;
+        }
+    }
+
+    void onDecodedGraphicBuffer(shared_ptr<GraphicBuffer> buffer)
+    {
+        if (recording) {
+            decodedCount++;
+        }
+    }
+
+    void onDecoderError(string errorDescription)
+    {
+        cerr << "Video decoder error: " << errorDescription << "\n";
+        decodeErrors++;
+    }
+
+    void onDecoderEOS()
+    {
+    }
+
+    void onDecoderInputCredit()
+    {
+        decodeCredits++;
+        scoped_lock lock(pendingLock);
+        pendingReady = true;
+        pendingCond.notify_one();
+    }
+
+    static const unsigned int MAX_PENDING = 16;
+
+    typedef RefPool<const EncodedFrame> EncodedFrameRefs;
+
+    CameraManager *cameraManager = nullptr;
+    CodecManager *codecManager = nullptr;
+    uint64_t cameraManagerUs = 0;
+    uint64_t codecManagerUs = 0;
+    double allocationLimit = -1;
+    bool allocationLimitExceeded = false;
+    unsigned int frameRate = 0;
+    unsigned int switchCount = 0;
+    unsigned int standbyCount = 0;
+    bool arbitration = false;
+    CodecType codecType;
+    unsigned int durationSeconds;
+    shared_ptr<VideoEncoder> videoEncoder;
+    unique_ptr<SimulcastEncoder> simulcastEncoder;
+    unsigned int simulcastLayers = 0;
+    bool rateSwitching = false;
+    int keyFrameIntervalMs = 1000;
+    int intraRefreshFrames = 0;
+    // Indexed by RateUpdate, only touched on the camera thread
+    unsigned int rateUpdates[3];
+    uint64_t rateUpdateMaxUs = 0;
+    bool encoderAvailable = false;
+    unsigned int encodeScale = 1;
+    unsigned int encodeWidth = 0;
+    unsigned int encodeHeight = 0;
+    shared_ptr<VideoDecoder> videoDecoder;
+    bool decoderAvailable = false;
+    DecodeMode decodeMode = DecodeNone;
+    shared_ptr<EncodedFrameRefs> encodedFrameRefs = EncodedFrameRefs::create();
+
+    mutex pendingLock;
+    condition_variable pendingCond;
+    shared_ptr<const EncodedFrame> pending[MAX_PENDING];
+    unsigned int pendingHead = 0;
+    unsigned int pendingCount = 0;
+    bool pendingReady = false;
+
+    atomic<bool> recording = false;
+    vector<uint64_t> deliveryLatency;
+    vector<uint64_t> callbackDuration;
+    atomic<unsigned int> frameCount = 0;
+    atomic<unsigned int> encodedCount = 0;
+    atomic<unsigned int> keyFrameCount = 0;
+    atomic<unsigned int> encodeErrors = 0;
+    atomic<unsigned int> decodeQueued = 0;
+    atomic<unsigned int> decodedCount = 0;
+    atomic<unsigned int> decodeWouldBlock = 0;
+    atomic<unsigned int> decodeCredits = 0;
+    atomic<unsigned int> decodeErrors = 0;
+    uint64_t droppedCount = 0;
+    uint64_t lastTimestampUs = 0;
+    uint64_t framePeriodUs = 0;
+    unsigned int deliveryQueueDepth = 0;
+    FrameDropPolicy deliveryPolicy = DropOldest;
+    vector<unique_ptr<ExtraListener>> extraListeners;
+};
+
+static void usage(const char *name)
+{
+    cerr << "Usage: " << name << " [-p provider] [-m mode] [-t seconds] [-f fps]"
+         << " [-e codec] [-s divisor]\n"
+         << "    [-S layers] [-r] [-k ms] [-I frames] [-D mode] [-q depth] [-d policy]\n"
+         << "    [-l count] [-x switches] [-w count] [-C] [-T] [-a limit] [-o file]\n"
+         << "    -p  camera provider, default is dummy\n"
+         << "    -m  run only the given mode, default is all modes\n"
+         << "    -t  duration of each mode in seconds, default is 5\n"
+         << "    -f  capture at this frame rate, in the modes supporting it\n"
+         << "    -e  encode with vp8, vp9 or h264, default is no encoding\n"
+         << "    -s  encode at the capture size divided by this\n"
+         << "    -S  encode that many simulcast layers, each half the size\n"
+         << "    -r  switch the encoder bitrate every second\n"
+         << "    -k  key frame interval in milliseconds, default is 1000\n"
+         << "    -I  refresh the picture over that many frames instead of key frames\n"
+         << "    -D  decode the encoded frames, blocking or nonblocking\n"
+         << "    -q  deliver frames from a queue of the given depth\n"
+         << "    -d  drop policy of the queue: oldest, newest or block\n"
+         << "    -l  deliver the frames to more listeners\n"
+         << "    -x  switch between two cameras that many times after the modes\n"
+         << "    -w  keep that many cameras in standby while switching\n"
+         << "    -C  capture from two cameras of different priority after the modes\n"
+         << "    -T  trace the latency of each frame stage, adds its own overhead\n"
+         << "    -a  exit with an error if there are more heap allocations per frame\n"
+         << "    -o  write the JSON report to a file instead of stdout\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    string provider = "dummy";
+    int modeNumber = -1;
+    unsigned int durationSeconds = 5;
+    CodecType codecType = VideoCodecUnknown;
+    string outputFile;
+    unsigned int queueDepth = 0;
+    FrameDropPolicy dropPolicy = DropOldest;
+    DecodeMode decodeMode = DecodeNone;
+    double allocationLimit = -1;
+    unsigned int extraListeners = 0;
+    unsigned int encodeScale = 1;
+    unsigned int simulcastLayers = 0;
+    bool rateSwitching = false;
+    int keyFrameIntervalMs = 1000;
+    int intraRefreshFrames = 0;
+    unsigned int frameRate = 0;
+    unsigned int switches = 0;
+    unsigned int standby = 0;
+    bool arbitration = false;
+    bool tracing = false;
+
+    while ((opt = getopt(argc, argv, "p:m:t:f:e:s:S:rk:I:D:q:d:l:x:w:CTa:o:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            provider = optarg;
+            break;
+        case 'm':
+            modeNumber = atoi(optarg);
+            break;
+        case 't':
+            durationSeconds = atoi(optarg);
+            break;
+        case 'f':
+            frameRate = atoi(optarg);
+            break;
+        case 'e':
+            codecType = codecTypeFromName(optarg);
+            if (codecType == VideoCodecUnknown) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 's':
+            encodeScale = atoi(optarg);
+            if (encodeScale < 1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'S':
+            simulcastLayers = atoi(optarg);
+            break;
+        case 'r':
+            rateSwitching = true;
+            break;
+        case 'k':
+            keyFrameIntervalMs = atoi(optarg);
+            break;
+        case 'I':
+            intraRefreshFrames = atoi(optarg);
+            break;
+        case 'D':
+            if (!decodeModeFromName(optarg, decodeMode)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'q':
+            queueDepth = atoi(optarg);
+            break;
+        case 'd':
+            if (!dropPolicyFromName(optarg, dropPolicy)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'l':
+            extraListeners = atoi(optarg);
+            if (extraListeners > Camera::MAX_LISTENERS) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'x':
+            switches = atoi(optarg);
+            break;
+        case 'w':
+            standby = atoi(optarg);
+            break;
+        case 'C':
+            arbitration = true;
+            break;
+        case 'T':
+            tracing = true;
+            break;
+        case 'a':
+            allocationLimit = atof(optarg);
+            break;
+        case 'o':
+            outputFile = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // Off by default, so that the numbers don't include the tracing.
+    if (tracing) {
+        latencySetEnabled(true);
+    }
+
+    GeckoCameraBench bench(codecType, durationSeconds);
+    bench.setFrameDelivery(queueDepth, dropPolicy);
+    bench.setExtraListeners(extraListeners);
+    bench.setEncodeScale(encodeScale);
+    bench.setSimulcastLayers(simulcastLayers);
+    bench.setRateSwitching(rateSwitching);
+    bench.setKeyFrames(keyFrameIntervalMs, intraRefreshFrames);
+    bench.setDecodeMode(decodeMode);
+    bench.setAllocationLimit(allocationLimit);
+    bench.setFrameRate(frameRate);
+    bench.setCameraSwitching(switches, standby);
+    bench.setArbitration(arbitration);
+    if (!outputFile.empty()) {
+        ofstream out(outputFile);
+        return bench.run(provider, modeNumber, out);
+    }
+    return bench.run(provider, modeNumber, cout);
+}
+
+/* vim: set ts=4 et sw=4 tw=80: */
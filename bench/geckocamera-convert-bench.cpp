@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <getopt.h>
+
+#include "geckocamera-convert.h"
+
+using namespace std;
+using namespace gecko::camera;
+
+struct Size {
+    unsigned int width;
+    unsigned int height;
+};
+
+struct Conversion {
+    const char *name;
+    function<YCbCrFrame(uint8_t *, Size)> src;
+    function<YCbCrFrame(uint8_t *, Size)> dst;
+};
+
+static unsigned int alignedStride(unsigned int width)
+{
+    return (width + 63) & ~63;
+}
+
+static const vector<Conversion> conversions = {
+    { "i420-to-nv12",
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeNV12Layout(b, s.width, s.height); } },
+    { "i420-to-nv21",
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeNV21Layout(b, s.width, s.height); } },
+    { "nv12-to-i420",
+      [](uint8_t *b, Size s) { return makeNV12Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); } },
+    { "nv21-to-i420",
+      [](uint8_t *b, Size s) { return makeNV21Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); } },
+    { "nv12-to-nv21",
+      [](uint8_t *b, Size s) { return makeNV12Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeNV21Layout(b, s.width, s.height); } },
+    { "i420-repack",
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) {
+          return makeI420Layout(b, s.width, s.height, alignedStride(s.width),
+                                (s.height + 15) & ~15);
+      } },
+    { "i420-to-nv12-repack",
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) {
+          return makeNV12Layout(b, s.width, s.height, alignedStride(s.width),
+                                (s.height + 15) & ~15);
+      } },
+};
+
+static size_t bufferSize(Size s)
+{
+    return yuv420BufferSize(s.width, s.height, alignedStride(s.width), (s.height + 15) & ~15);
+}
+
+static void fill(vector<uint8_t> &buffer, unsigned int seed)
+{
+    for (size_t i = 0; i < buffer.size(); i++) {
+        buffer[i] = (uint8_t)((i * 2654435761u + seed) >> 7);
+    }
+}
+
+static bool verify(const Conversion &conv, Size size, ConvertImplementation impl)
+{
+    vector<uint8_t> src(bufferSize(size));
+    vector<uint8_t> expected(bufferSize(size));
+    vector<uint8_t> result(bufferSize(size));
+    fill(src, size.width);
+    fill(expected, 0);
+    fill(result, 0);
+
+    convertSetImplementation(ConvertImplScalar);
+    convertYCbCrFrame(conv.src(src.data(), size), conv.dst(expected.data(), size));
+    convertSetImplementation(impl);
+    convertYCbCrFrame(conv.src(src.data(), size), conv.dst(result.data(), size));
+
+    return expected == result;
+}
+
+static double measure(const Conversion &conv, Size size, unsigned int iterations)
+{
+    vector<uint8_t> src(bufferSize(size));
+    vector<uint8_t> dst(bufferSize(size));
+    fill(src, 1);
+
+    const YCbCrFrame srcFrame = conv.src(src.data(), size);
+    const YCbCrFrame dstFrame = conv.dst(dst.data(), size);
+
+    // Warm up caches and page in the destination.
+    convertYCbCrFrame(srcFrame, dstFrame);
+
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < iterations; i++) {
+        convertYCbCrFrame(srcFrame, dstFrame);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    // Count the frame once, i.e. the throughput as seen by the pipeline.
+    double bytes = (double)yuv420BufferSize(size.width, size.height) * iterations;
+    return bytes / elapsed.count() / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    unsigned int iterations = 200;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            break;
+        }
+    }
+
+    const vector<ConvertImplementation> impls = {
+        ConvertImplScalar, ConvertImplSSE2, ConvertImplAVX2, ConvertImplNEON
+    };
+    const vector<Size> sizes = {
+        { 320, 240 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 }
+    };
+    // Odd sizes exercise the scalar tails of the vector kernels.
+    const vector<Size> checkSizes = {
+        { 2, 2 }, { 33, 17 }, { 97, 31 }, { 1278, 719 }, { 1280, 720 }
+    };
+
+    int failures = 0;
+    for (ConvertImplementation impl : impls) {
+        if (!convertSetImplementation(impl)) {
+            continue;
+        }
+        for (const Conversion &conv : conversions) {
+            for (Size size : checkSizes) {
+                if (!verify(conv, size, impl)) {
+                    cerr << "MISMATCH " << convertImplementationName(impl) << " "
+                         << conv.name << " " << size.width << "x" << size.height << "\n";
+                    failures++;
+                }
+            }
+        }
+    }
+
+    cout << "impl\tconversion\tsize\tGB/s\n";
+    for (ConvertImplementation impl : impls) {
+        if (!convertSetImplementation(impl)) {
+            continue;
+        }
+        for (const Conversion &conv : conversions) {
+            for (Size size : sizes) {
+                double gbps = measure(conv, size, iterations);
+                cout << convertImplementationName(impl) << "\t" << conv.name << "\t"
+                     << size.width << "x" << size.height << "\t" << gbps << "\n";
+            }
+        }
+    }
+
+    return failures ? 1 : 0;
+}
+
+/* vim: set ts=4 et sw=4 tw=80: */
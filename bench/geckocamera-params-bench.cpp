@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+#include <new>
+#include <getopt.h>
+
+#include "droid-params.h"
+
+using namespace std;
+using namespace gecko::camera;
+
+static atomic<uint64_t> allocationCount(0);
+
+void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// Something like what a HAL1 camera reports, a few KB with long value
+// lists, padded with vendor keys.
+static string halParameters()
+{
+    string params =
+        "antibanding=auto;antibanding-values=off,60hz,50hz,auto;"
+        "auto-exposure-lock=false;auto-exposure-lock-supported=true;"
+        "auto-whitebalance-lock=false;auto-whitebalance-lock-supported=true;"
+        "effect=none;effect-values=none,mono,negative,solarize,sepia,posterize,"
+        "whiteboard,blackboard,aqua,emboss,sketch,neon;"
+        "exposure-compensation=0;exposure-compensation-step=0.166667;"
+        "flash-mode=off;flash-mode-values=off,auto,on,torch;"
+        "focal-length=4.67;focus-areas=(0,0,0,0,0);"
+        "focus-distances=1.200000,1.500000,1.800000;focus-mode=auto;"
+        "focus-mode-values=auto,infinity,macro,continuous-video,continuous-picture,fixed;"
+        "horizontal-view-angle=62.9;jpeg-quality=85;jpeg-thumbnail-height=384;"
+        "jpeg-thumbnail-quality=90;jpeg-thumbnail-size-values=512x288,480x288,"
+        "432x288,512x384,352x288,320x240,176x144,0x0;jpeg-thumbnail-width=512;"
+        "max-exposure-compensation=12;max-num-focus-areas=1;max-num-metering-areas=5;"
+        "max-zoom=99;min-exposure-compensation=-12;picture-format=jpeg;"
+        "picture-format-values=jpeg,raw;picture-size=4160x3120;"
+        "picture-size-values=4160x3120,4000x3000,4160x2340,4000x2250,3264x2448,"
+        "3200x2400,2592x1944,2048x1536,1920x1080,1600x1200,1280x768,1280x720,"
+        "1024x768,800x600,800x480,720x480,640x480,352x288,320x240;"
+        "preferred-preview-size-for-video=1920x1080;preview-format=yuv420sp;"
+        "preview-format-values=yuv420sp,yuv420sp-adreno,yuv420p,yuv420p,nv12;"
+        "preview-fps-range=7500,30000;preview-fps-range-values=(7500,30000),"
+        "(8000,30000),(30000,30000),(60000,60000),(90000,90000),(120000,120000);"
+        "preview-frame-rate=30;preview-frame-rate-values=7,8,15,20,24,30,60,90,120;"
+        "preview-size=1920x1080;preview-size-values=1920x1080,1440x1080,1280x960,"
+        "1280x768,1280x720,1024x768,800x600,864x480,800x480,720x480,640x480,"
+        "480x360,480x320,352x288,320x240,240x160,176x144;"
+        "scene-mode=auto;scene-mode-values=auto,asd,action,portrait,landscape,"
+        "night,night-portrait,theatre,beach,snow,sunset,steadyphoto,fireworks,"
+        "sports,party,candlelight,backlight,flowers,AR,hdr;"
+        "smooth-zoom-supported=false;vertical-view-angle=49.2;"
+        "video-frame-format=yuv420sp;video-hfr=off;video-hfr-values=off,60,90,120;"
+        "video-size=1920x1080;video-size-values=3840x2160,1920x1080,1280x720,"
+        "864x480,800x480,720x480,640x480,480x320,352x288,320x240,176x144;"
+        "video-snapshot-supported=true;video-stabilization=false;"
+        "video-stabilization-supported=true;whitebalance=auto;"
+        "whitebalance-values=auto,incandescent,fluorescent,warm-fluorescent,"
+        "daylight,cloudy-daylight,twilight,shade,manual-cct;zoom=0;"
+        "zoom-ratios=100,102,104,107,109,112,114,117,120,123,125,128,131,135,138,"
+        "141,144,148,151,155,158,162,166,170,174,178,182,186,190,195,200,204,209,"
+        "214,219,224,229,235,240,246,251,257,263,270,276,282,289,296,303,310,317,"
+        "324,332,340,348,356,364,373,381,390,400;zoom-supported=true;";
+    for (int i = 0; i < 40; i++) {
+        params += "x-vendor-key-" + to_string(i) + "=value-" + to_string(i * 7) + ";";
+    }
+    return params;
+}
+
+// What the plugin did before DroidParameterStore, for comparison
+class MapParameters
+{
+public:
+    void parse(const string &inp)
+    {
+        size_t pos = 0, nextPos;
+        params.clear();
+        while ((nextPos = inp.find(";", pos)) != string::npos) {
+            string token = inp.substr(pos, nextPos - pos);
+            size_t eqsPos = token.find("=");
+            params.insert_or_assign(token.substr(0, eqsPos), token.substr(eqsPos + 1));
+            pos = nextPos + 1;
+        }
+    }
+    void set(const string &key, const string &value)
+    {
+        if (params.find(key) != params.end()) {
+            params[key] = value;
+        }
+    }
+    string toString() const
+    {
+        ostringstream buffer;
+        for (auto const& [key, val] : params) {
+            buffer << key << "=" << val << ";";
+        }
+        return buffer.str();
+    }
+
+private:
+    map<string, string> params;
+};
+
+struct Result {
+    double nsPerOp;
+    double allocationsPerOp;
+};
+
+static Result measure(unsigned int iterations, const function<void(unsigned int)> &op)
+{
+    // Warm up the storage.
+    op(0);
+    op(1);
+
+    uint64_t startAllocations = allocationCount.load();
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < iterations; i++) {
+        op(i);
+    }
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    return Result{elapsed.count() / iterations,
+                  (double)(allocationCount.load() - startAllocations) / iterations};
+}
+
+static void report(const char *impl, const char *op, Result result)
+{
+    cout << impl << "\t" << op << "\t" << result.nsPerOp << "\t"
+         << result.allocationsPerOp << "\n";
+}
+
+static bool verify(const string &params)
+{
+    DroidParameterStore store;
+    store.parse(params.c_str());
+    if (store.get("video-size") != "1920x1080" || store.contains("no-such-key")
+            || store.set("no-such-key", "1")) {
+        return false;
+    }
+
+    store.set("video-size", "1920x1080");
+    if (store.changed()) {
+        return false;
+    }
+
+    store.set("video-size", "1280x720");
+    store.set("preview-fps-range", "30000,30000");
+    if (!store.changed() || store.changedKeys()
+            != "preview-fps-range=30000,30000;video-size=1280x720") {
+        return false;
+    }
+    store.markApplied();
+    if (store.changed()) {
+        return false;
+    }
+
+    // The serialized string parses to the same parameters.
+    string serialized;
+    store.serialize(serialized);
+    DroidParameterStore copy;
+    copy.parse(serialized.c_str());
+    if (copy.size() != store.size() || copy.get("video-size") != "1280x720"
+            || copy.get("zoom-ratios") != store.get("zoom-ratios")) {
+        return false;
+    }
+
+    // The last of duplicate keys wins, like with the HAL.
+    copy.parse("a=1;b=2;a=3;c=;=4");
+    return copy.size() == 3 && copy.get("a") == "3" && copy.contains("c")
+           && copy.get("c").empty();
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    unsigned int iterations = 20000;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            break;
+        }
+    }
+
+    const string params = halParameters();
+    if (!verify(params)) {
+        cerr << "DroidParameterStore gives wrong results\n";
+        return 1;
+    }
+
+    static const char *sizes[] = { "1920x1080", "1280x720" };
+    static const char *ranges[] = { "30000,30000", "7500,30000" };
+
+    cout << params.size() << " bytes of parameters\n";
+    cout << "impl\top\tns/op\tallocs/op\n";
+
+    DroidParameterStore store;
+    string out;
+    report("store", "parse", measure(iterations, [&](unsigned int) {
+        store.parse(params.c_str());
+    }));
+    // A mid-stream change: set a few keys and produce the string for the
+    // HAL.
+    report("store", "set+apply", measure(iterations, [&](unsigned int i) {
+        store.set("video-size", sizes[i & 1]);
+        store.set("preview-fps-range", ranges[i & 1]);
+        store.set("focus-mode", "continuous-video");
+        if (store.changed()) {
+            store.serialize(out);
+            store.markApplied();
+        }
+    }));
+    // Nothing changed, so nothing is sent.
+    report("store", "unchanged", measure(iterations, [&](unsigned int) {
+        store.set("video-size", sizes[0]);
+        store.set("preview-fps-range", ranges[0]);
+        store.set("focus-mode", "continuous-video");
+        if (store.changed()) {
+            store.serialize(out);
+            store.markApplied();
+        }
+    }));
+
+    MapParameters map;
+    report("map", "parse", measure(iterations, [&](unsigned int) {
+        map.parse(params);
+    }));
+    report("map", "set+apply", measure(iterations, [&](unsigned int i) {
+        map.set("video-size", sizes[i & 1]);
+        map.set("preview-fps-range", ranges[i & 1]);
+        map.set("focus-mode", "continuous-video");
+        out = map.toString();
+    }));
+
+    return 0;
+}
+
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <getopt.h>
+
+#include "geckocamera-convert.h"
+#include "geckocamera-scale.h"
+
+using namespace std;
+using namespace gecko::camera;
+
+struct Size {
+    unsigned int width;
+    unsigned int height;
+};
+
+struct Ratio {
+    Size src;
+    Size dst;
+};
+
+struct Layouts {
+    const char *name;
+    function<YCbCrFrame(uint8_t *, Size)> src;
+    function<YCbCrFrame(uint8_t *, Size)> dst;
+};
+
+static const vector<Layouts> layouts = {
+    { "i420-to-i420",
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); } },
+    { "nv12-to-nv12",
+      [](uint8_t *b, Size s) { return makeNV12Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeNV12Layout(b, s.width, s.height); } },
+    { "nv21-to-i420",
+      [](uint8_t *b, Size s) { return makeNV21Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); } },
+    { "i420-to-nv12",
+      [](uint8_t *b, Size s) { return makeI420Layout(b, s.width, s.height); },
+      [](uint8_t *b, Size s) { return makeNV12Layout(b, s.width, s.height); } },
+};
+
+static const char *filterName(ScaleFilter filter)
+{
+    return filter == ScaleFilterBox ? "box" : "bilinear";
+}
+
+static void fill(vector<uint8_t> &buffer, unsigned int seed)
+{
+    for (size_t i = 0; i < buffer.size(); i++) {
+        buffer[i] = (uint8_t)((i * 2654435761u + seed) >> 7);
+    }
+}
+
+static bool verify(const Layouts &layout, Ratio ratio, ScaleFilter filter,
+                   ConvertImplementation impl)
+{
+    vector<uint8_t> src(yuv420BufferSize(ratio.src.width, ratio.src.height));
+    vector<uint8_t> expected(yuv420BufferSize(ratio.dst.width, ratio.dst.height));
+    vector<uint8_t> result(expected.size());
+    fill(src, ratio.src.width);
+
+    convertSetImplementation(ConvertImplScalar);
+    scaleYCbCrFrame(layout.src(src.data(), ratio.src),
+                    layout.dst(expected.data(), ratio.dst), filter);
+    convertSetImplementation(impl);
+    scaleYCbCrFrame(layout.src(src.data(), ratio.src),
+                    layout.dst(result.data(), ratio.dst), filter);
+
+    return expected == result;
+}
+
+static double measure(const Layouts &layout, Ratio ratio, ScaleFilter filter,
+                      unsigned int iterations)
+{
+    vector<uint8_t> src(yuv420BufferSize(ratio.src.width, ratio.src.height));
+    fill(src, 1);
+    const YCbCrFrame srcFrame = layout.src(src.data(), ratio.src);
+    FrameScaler scaler(ratio.dst.width, ratio.dst.height,
+                       layout.dst(src.data(), ratio.dst).chromaStep == 2
+                       ? ScaleToNV12 : ScaleToI420,
+                       filter);
+
+    // Warm up the pools and caches.
+    scaler.scale(srcFrame);
+
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < iterations; i++) {
+        scaler.scale(srcFrame);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() * 1e3 / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    unsigned int iterations = 200;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            break;
+        }
+    }
+
+    const vector<ConvertImplementation> impls = {
+        ConvertImplScalar, ConvertImplSSE2, ConvertImplAVX2, ConvertImplNEON
+    };
+    const vector<ScaleFilter> filters = { ScaleFilterBox, ScaleFilterBilinear };
+    const vector<Ratio> ratios = {
+        { { 640, 480 }, { 320, 240 } },
+        { { 1280, 720 }, { 640, 360 } },
+        { { 1280, 720 }, { 480, 270 } },
+        { { 1920, 1080 }, { 1280, 720 } },
+        { { 1920, 1080 }, { 640, 360 } },
+        { { 3840, 2160 }, { 1920, 1080 } },
+    };
+    // Odd sizes exercise the scalar tails and uneven boxes.
+    const vector<Ratio> checkRatios = {
+        { { 33, 17 }, { 16, 8 } },
+        { { 97, 31 }, { 45, 29 } },
+        { { 1278, 719 }, { 639, 359 } },
+        { { 1280, 720 }, { 480, 270 } },
+        { { 320, 240 }, { 640, 480 } },
+    };
+
+    int failures = 0;
+    for (ConvertImplementation impl : impls) {
+        if (!convertSetImplementation(impl)) {
+            continue;
+        }
+        for (const Layouts &layout : layouts) {
+            for (ScaleFilter filter : filters) {
+                for (Ratio ratio : checkRatios) {
+                    if (!verify(layout, ratio, filter, impl)) {
+                        cerr << "MISMATCH " << convertImplementationName(impl) << " "
+                             << layout.name << " " << filterName(filter) << " "
+                             << ratio.src.width << "x" << ratio.src.height << "->"
+                             << ratio.dst.width << "x" << ratio.dst.height << "\n";
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+
+    cout << "impl\tlayout\tfilter\tscale\tms/frame\n";
+    for (ConvertImplementation impl : impls) {
+        if (!convertSetImplementation(impl)) {
+            continue;
+        }
+        for (const Layouts &layout : layouts) {
+            for (ScaleFilter filter : filters) {
+                for (Ratio ratio : ratios) {
+                    double ms = measure(layout, ratio, filter, iterations);
+                    cout << convertImplementationName(impl) << "\t" << layout.name << "\t"
+                         << filterName(filter) << "\t"
+                         << ratio.src.width << "x" << ratio.src.height << "->"
+                         << ratio.dst.width << "x" << ratio.dst.height << "\t"
+                         << ms << "\n";
+                }
+            }
+        }
+    }
+
+    return failures ? 1 : 0;
+}
+
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -20,6 +20,9 @@
 #include <memory>
 #include <cstring>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <getopt.h>
 
 #include "geckocamera.h"
@@ -35,12 +38,12 @@ class GeckoCameraExample
     , VideoDecoderListener
 {
 public:
-    GeckoCameraExample()
+    GeckoCameraExample(bool nonBlockingDecode)
         : cameraManager(gecko_camera_manager())
         , codecManager(gecko_codec_manager())
         , encoderAvailable(false)
         , decoderAvailable(false)
-        , frameNumber(0)
+        , nonBlockingDecode(nonBlockingDecode)
     {
     }
 
@@ -70,7 +73,8 @@ public:
             if (cameraManager->queryCapabilities(info.id, caps) && modeNumber < caps.size()) {
                 cout << "Camera " << info.id << " caps:\n";
                 for (const CameraCapability &cap : caps) {
-                    cout << "    " << cap.width << "x" << cap.height << ":" << cap.fps << "\n";
+                    cout << "    " << cap.width << "x" << cap.height << ":" << cap.minFps
+                         << "-" << cap.fps << "\n";
                 }
 
                 shared_ptr<Camera> camera;
@@ -85,8 +89,15 @@ public:
                     cout << "Video decoder " << (decoderAvailable ? "available" : "not available") << "\n";
 
                     if (camera->startCapture(cap)) {
-                        this_thread::sleep_for(chrono::seconds(durationSeconds));
+                        auto deadline = chrono::steady_clock::now()
+                                        + chrono::seconds(durationSeconds);
+                        if (decoderAvailable && nonBlockingDecode) {
+                            decodeLoop(deadline);
+                        } else {
+                            this_thread::sleep_until(deadline);
+                        }
                         camera->stopCapture();
+                        releasePendingFrames();
                         return 0;
                     } else {
                         cerr << "Cannot start capture\n";
@@ -102,36 +113,27 @@ public:
     }
 
 private:
-    class EncodedFrame
-    {
-    public:
-        EncodedFrame(uint8_t *encoded, size_t size, uint64_t timestampUs, FrameType type)
-            : size(size)
-            , timestampUs(timestampUs)
-            , type(type)
-        {
-            data = static_cast<uint8_t *>(malloc(size));
-            memcpy(data, encoded, size);
-            cout << "Create encoded frame " << this << "\n";
-        }
+    typedef RefPool<const EncodedFrame> EncodedFrameRefs;
 
-        ~EncodedFrame()
-        {
-            free(data);
+    // Hands a reference to the encoder output to the decoder, which
+    // releases it once it has consumed the data.
+    DecodeResult decodeFrame(shared_ptr<const EncodedFrame> frame, bool blocking)
+    {
+        void *ref = encodedFrameRefs->hold(frame);
+        DecodeResult result;
+        if (blocking) {
+            result = videoDecoder->decode(frame->data, frame->size, frame->timestampUs,
+                                          frame->frameType, &EncodedFrameRefs::release, ref)
+                     ? DecodeOk : DecodeError;
+        } else {
+            result = videoDecoder->tryDecode(frame->data, frame->size, frame->timestampUs,
+                                             frame->frameType, &EncodedFrameRefs::release, ref);
         }
-
-        static void release(void *data)
-        {
-            EncodedFrame *frame = static_cast<EncodedFrame *>(data);
-            cout << "Release encoded frame " << frame << "\n";
-            delete frame;
+        if (result != DecodeOk) {
+            EncodedFrameRefs::release(ref);
         }
-
-        uint8_t *data;
-        size_t size;
-        uint64_t timestampUs;
-        FrameType type;
-    };
+        return result;
+    }
 
     bool initEncoder(CameraCapability cap)
     {
@@ -146,6 +148,10 @@ private:
             meta.sliceHeight = cap.height;
             meta.bitrate = 2000000;
             meta.framerate = 30;
+            // Spread the refresh over a second instead of sending large
+            // key frames, a receiver can still ask for one.
+            meta.keyFrameIntervalMs = 10000;
+            meta.intraRefreshFrames = 30;
 
             cout << "Initializing encoder"
                  << " size " << meta.width << "x" << meta.height
@@ -187,6 +193,33 @@ private:
         return false;
     }
 
+    // With non-blocking decoding this thread queues the encoded frames to the
+    // decoder, the same way a single thread can serve many decoders.
+    void decodeLoop(chrono::steady_clock::time_point deadline)
+    {
+        unique_lock<mutex> lock(pendingLock);
+        while (pendingCond.wait_until(lock, deadline, [this] { return pendingReady; })) {
+            pendingReady = false;
+            while (!pendingFrames.empty()) {
+                DecodeResult result = decodeFrame(pendingFrames.front(), false);
+                if (result == DecodeWouldBlock) {
+                    cout << "Decoder is full, " << pendingFrames.size() << " frames pending\n";
+                    break;
+                }
+                if (result == DecodeError) {
+                    cout << "Cannot decode frame " << pendingFrames.front()->timestampUs << "\n";
+                }
+                pendingFrames.pop_front();
+            }
+        }
+    }
+
+    void releasePendingFrames()
+    {
+        scoped_lock lock(pendingLock);
+        pendingFrames.clear();
+    }
+
     // Camera
     void onCameraFrame(shared_ptr<GraphicBuffer> buffer)
     {
@@ -197,8 +230,7 @@ private:
                  << "\n";
 
             if (encoderAvailable) {
-                bool sync = !(frameNumber++ % 30);
-                videoEncoder->encode(frame, sync);
+                videoEncoder->encode(frame, false);
             }
         }
     }
@@ -209,21 +241,37 @@ private:
     }
 
     // Encoder
-    void onEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs, FrameType type)
+    bool wantsEncodedFrameRefs()
+    {
+        // Keep the encoder output around instead of copying it.
+        return true;
+    }
+
+    void onEncodedFrameRef(shared_ptr<const EncodedFrame> frame)
     {
-        cout << "Encoded frame size " << size
-             << " timestampUs " << timestampUs
-             << (type == KeyFrame ? " sync" : "")
+        cout << "Encoded frame size " << frame->size
+             << " timestampUs " << frame->timestampUs
+             << (frame->frameType == KeyFrame ? " sync" : "")
              << "\n";
 
         if (decoderAvailable) {
-            EncodedFrame *frame = new EncodedFrame(data, size, timestampUs, type);
-            // May block if the input queue is full. Not handled here for simplicity.
-            videoDecoder->decode(frame->data, frame->size, frame->timestampUs,
-                                 frame->type, &EncodedFrame::release, frame);
+            if (nonBlockingDecode) {
+                scoped_lock lock(pendingLock);
+                pendingFrames.push_back(move(frame));
+                pendingReady = true;
+                pendingCond.notify_one();
+            } else {
+                // Blocks the encoder if the decoder input queue is full.
+                decodeFrame(move(frame), true);
+            }
         }
     }
 
+    void onEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs, FrameType type)
+    {
+        // Not called, see wantsEncodedFrameRefs().
+    }
+
     void onEncoderError(string errorDescription)
     {
         cout << "Video encoder error: " << errorDescription << "\n";
@@ -263,13 +311,26 @@ private:
         cout << "Video decoder EOS\n";
     }
 
+    void onDecoderInputCredit()
+    {
+        scoped_lock lock(pendingLock);
+        pendingReady = true;
+        pendingCond.notify_one();
+    }
+
     CameraManager *cameraManager = nullptr;
     CodecManager *codecManager = nullptr;
     shared_ptr<VideoEncoder> videoEncoder;
     bool encoderAvailable;
     shared_ptr<VideoDecoder> videoDecoder;
     bool decoderAvailable;
-    unsigned int frameNumber;
+    bool nonBlockingDecode;
+
+    mutex pendingLock;
+    condition_variable pendingCond;
+    deque<shared_ptr<const EncodedFrame>> pendingFrames;
+    shared_ptr<EncodedFrameRefs> encodedFrameRefs = EncodedFrameRefs::create();
+    bool pendingReady = false;
 };
 
 int main(int argc, char *argv[])
@@ -279,8 +340,9 @@ int main(int argc, char *argv[])
     // Do not use maximum resolution
     unsigned int modeNumber = 1;
     unsigned int durationSeconds = 10;
+    bool nonBlockingDecode = false;
 
-    while ((opt = getopt(argc, argv, "c:m:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "c:m:t:n")) != -1) {
         switch (opt) {
         case 'c':
             cameraNumber = atoi(optarg);
@@ -291,12 +353,15 @@ int main(int argc, char *argv[])
         case 't':
             durationSeconds = atoi(optarg);
             break;
+        case 'n':
+            nonBlockingDecode = true;
+            break;
         default:
             break;
         }
     }
 
-    GeckoCameraExample app;
+    GeckoCameraExample app(nonBlockingDecode);
     return app.run(cameraNumber, modeNumber, durationSeconds);
 }
 
@@ -0,0 +1,382 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+
+#include "geckocamera-arbiter.h"
+
+#define LOG_TOPIC "arbiter"
+#include "geckocamera-utils.h"
+
+namespace gecko {
+namespace camera {
+
+using namespace std;
+
+static uint64_t pixels(const CameraCapability &cap)
+{
+    return (uint64_t)cap.width * cap.height;
+}
+
+static bool sameMode(const CameraCapability &a, const CameraCapability &b)
+{
+    return a.width == b.width && a.height == b.height && a.fps == b.fps
+           && a.minFps == b.minFps;
+}
+
+void CaptureArbiter::setLimits(const CaptureLimits &limits)
+{
+    scoped_lock lock(m_mutex);
+    m_limits = limits;
+}
+
+CaptureLimits CaptureArbiter::limits()
+{
+    scoped_lock lock(m_mutex);
+    return m_limits;
+}
+
+// A mode at the requested frame rate, if it has that rate.
+static CameraCapability atRequestedRate(const CameraCapability &mode,
+                                        const CameraCapability &requested,
+                                        bool &hasRate)
+{
+    CameraCapability cap = mode;
+    unsigned int minFps = mode.minFps ? mode.minFps : mode.fps;
+    hasRate = requested.fps <= mode.fps && requested.fps >= minFps;
+    if (hasRate) {
+        cap.fps = requested.fps;
+        cap.minFps = requested.minFps ? max(requested.minFps, minFps) : 0;
+    }
+    return cap;
+}
+
+// The requested mode if it fits next to the active ones, else if smaller
+// is set the largest smaller mode which fits, at the requested frame rate
+// if it has it.
+bool CaptureArbiter::pickMode(const Request &request, const vector<Request> &active,
+                              CameraCapability &cap, bool smaller) const
+{
+    if (m_limits.maxCameras && active.size() >= m_limits.maxCameras) {
+        return false;
+    }
+    uint64_t used = 0;
+    for (const Request &other : active) {
+        used += pixels(other.granted);
+    }
+    auto fits = [&](const CameraCapability &mode) {
+        return !m_limits.maxPixels || used + pixels(mode) <= m_limits.maxPixels;
+    };
+
+    const CameraCapability &requested = request.requested;
+    if (fits(requested)) {
+        cap = requested;
+        return true;
+    }
+    if (!smaller) {
+        return false;
+    }
+
+    bool found = false;
+    bool foundRate = false;
+    for (const CameraCapability &mode : request.modes) {
+        if (pixels(mode) >= pixels(requested) || !fits(mode)) {
+            continue;
+        }
+        bool hasRate;
+        CameraCapability candidate = atRequestedRate(mode, requested, hasRate);
+        if (!found || pixels(candidate) > pixels(cap)
+                || (pixels(candidate) == pixels(cap) && hasRate && !foundRate)) {
+            cap = candidate;
+            found = true;
+            foundRate = hasRate;
+        }
+    }
+    return found;
+}
+
+// Moves active cameras of lower priority to smaller modes, the lowest
+// priority and the latest first, until the request fits as it is. Each
+// goes to the largest mode freeing enough, or else its smallest one.
+bool CaptureArbiter::makeRoom(const Request &request, vector<Request> &active) const
+{
+    if (!m_limits.maxPixels
+            || (m_limits.maxCameras && active.size() >= m_limits.maxCameras)) {
+        return false;
+    }
+    uint64_t used = pixels(request.requested);
+    for (const Request &other : active) {
+        used += pixels(other.granted);
+    }
+    if (used <= m_limits.maxPixels) {
+        return true;
+    }
+    uint64_t deficit = used - m_limits.maxPixels;
+
+    vector<Request> trial = active;
+    vector<Request *> order;
+    for (Request &other : trial) {
+        if (other.priority < request.priority) {
+            order.push_back(&other);
+        }
+    }
+    sort(order.begin(), order.end(), [](const Request *a, const Request *b) {
+        return a->priority < b->priority
+               || (a->priority == b->priority && a->sequence > b->sequence);
+    });
+
+    for (Request *other : order) {
+        uint64_t current = pixels(other->granted);
+        const CameraCapability *enough = nullptr;
+        const CameraCapability *smallest = nullptr;
+        for (const CameraCapability &mode : other->modes) {
+            uint64_t size = pixels(mode);
+            if (size >= current) {
+                continue;
+            }
+            if (current - size >= deficit && (!enough || size > pixels(*enough))) {
+                enough = &mode;
+            }
+            if (!smallest || size < pixels(*smallest)) {
+                smallest = &mode;
+            }
+        }
+        const CameraCapability *mode = enough ? enough : smallest;
+        if (!mode) {
+            continue;
+        }
+        bool hasRate;
+        other->granted = atRequestedRate(*mode, other->requested, hasRate);
+        deficit -= min(deficit, current - pixels(other->granted));
+        if (!deficit) {
+            active = move(trial);
+            return true;
+        }
+    }
+    return false;
+}
+
+// static
+bool CaptureArbiter::remove(vector<Request> &requests, Client *client, Request *removed)
+{
+    auto it = find_if(requests.begin(), requests.end(), [client](const Request &request) {
+        return request.key == client;
+    });
+    if (it == requests.end()) {
+        return false;
+    }
+    if (removed) {
+        *removed = move(*it);
+    }
+    requests.erase(it);
+    return true;
+}
+
+CaptureArbiter::Decision CaptureArbiter::request(shared_ptr<Client> client,
+                                                 CapturePriority priority,
+                                                 CameraCapability &cap,
+                                                 const vector<CameraCapability> &modes)
+{
+    vector<shared_ptr<Client>> preempted;
+    Changes changed;
+    Decision decision;
+    {
+        scoped_lock lock(m_mutex);
+        remove(m_active, client.get(), nullptr);
+        remove(m_queued, client.get(), nullptr);
+        Request request{client.get(), client, priority, cap, cap, modes, m_sequence++};
+
+        vector<Request> active = m_active;
+        vector<Request> victims;
+        CameraCapability granted = cap;
+        bool fits = pickMode(request, active, granted, false)
+                    || makeRoom(request, active)
+                    || pickMode(request, active, granted, true);
+        // Preempt the lowest priority first, and the latest of those.
+        while (!fits) {
+            auto victim = active.end();
+            for (auto it = active.begin(); it != active.end(); ++it) {
+                if (it->priority < priority
+                        && (victim == active.end() || it->priority < victim->priority
+                            || (it->priority == victim->priority
+                                && it->sequence > victim->sequence))) {
+                    victim = it;
+                }
+            }
+            if (victim == active.end()) {
+                break;
+            }
+            victims.push_back(move(*victim));
+            active.erase(victim);
+            fits = pickMode(request, active, granted, true);
+        }
+
+        if (!fits) {
+            LOGI("Queued " << cap.width << "x" << cap.height << " with "
+                 << m_active.size() << " cameras capturing");
+            m_queued.push_back(move(request));
+            decision = Queued;
+        } else {
+            decision = sameMode(granted, cap) ? Granted : Downgraded;
+            if (decision == Downgraded) {
+                LOGI("Downgraded " << cap.width << "x" << cap.height << " to "
+                     << granted.width << "x" << granted.height);
+            }
+            for (const Request &other : active) {
+                auto it = find_if(m_active.begin(), m_active.end(), [&](const Request &old) {
+                    return old.key == other.key;
+                });
+                shared_ptr<Client> otherClient = other.client.lock();
+                if (otherClient && it != m_active.end() && !sameMode(it->granted, other.granted)) {
+                    changed.emplace_back(move(otherClient), other.granted);
+                }
+            }
+            cap = granted;
+            request.granted = granted;
+            active.push_back(move(request));
+            m_active = move(active);
+            for (Request &victim : victims) {
+                shared_ptr<Client> victimClient = victim.client.lock();
+                if (victimClient) {
+                    preempted.push_back(move(victimClient));
+                }
+                m_queued.push_back(move(victim));
+            }
+        }
+    }
+
+    for (auto &[otherClient, otherCap] : changed) {
+        LOGI("Moving " << otherClient.get() << " to " << otherCap.width << "x" << otherCap.height);
+        otherClient->captureChanged(otherCap);
+    }
+    for (auto &victim : preempted) {
+        LOGI("Preempting " << victim.get());
+        victim->capturePreempted();
+    }
+    return decision;
+}
+
+bool CaptureArbiter::update(Client *client, const CameraCapability &cap)
+{
+    scoped_lock lock(m_mutex);
+    vector<Request> others = m_active;
+    Request request;
+    if (!remove(others, client, &request)) {
+        return false;
+    }
+    request.requested = cap;
+    CameraCapability granted;
+    if (!pickMode(request, others, granted, false)) {
+        return false;
+    }
+    for (Request &active : m_active) {
+        if (active.key == client) {
+            active.requested = cap;
+            active.granted = cap;
+        }
+    }
+    return true;
+}
+
+void CaptureArbiter::release(Client *client)
+{
+    Changes granted;
+    Changes changed;
+    {
+        scoped_lock lock(m_mutex);
+        if (!remove(m_active, client, nullptr)) {
+            remove(m_queued, client, nullptr);
+            return;
+        }
+        reallocate(granted, changed);
+    }
+
+    for (auto &[otherClient, cap] : changed) {
+        otherClient->captureChanged(cap);
+    }
+    for (auto &[queuedClient, cap] : granted) {
+        queuedClient->captureGranted(cap);
+    }
+}
+
+void CaptureArbiter::requeue(Client *client)
+{
+    scoped_lock lock(m_mutex);
+    Request request;
+    if (remove(m_active, client, &request)) {
+        m_queued.push_back(move(request));
+    }
+}
+
+// Called with m_mutex held. Hands out the room there is to downgraded
+// and queued requests alike, the highest priority and the oldest first,
+// so that a queued request never takes what a downgraded camera of higher
+// priority needs.
+void CaptureArbiter::reallocate(Changes &granted, Changes &changed)
+{
+    struct Candidate {
+        bool queued;
+        Client *key;
+        CapturePriority priority;
+        uint64_t sequence;
+    };
+    vector<Candidate> candidates;
+    for (const Request &request : m_active) {
+        if (!sameMode(request.granted, request.requested)) {
+            candidates.push_back({false, request.key, request.priority, request.sequence});
+        }
+    }
+    for (const Request &request : m_queued) {
+        candidates.push_back({true, request.key, request.priority, request.sequence});
+    }
+    sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        return a.priority > b.priority || (a.priority == b.priority && a.sequence < b.sequence);
+    });
+
+    for (const Candidate &candidate : candidates) {
+        CameraCapability cap;
+        if (candidate.queued) {
+            auto it = find_if(m_queued.begin(), m_queued.end(), [&](const Request &request) {
+                return request.key == candidate.key;
+            });
+            shared_ptr<Client> client = it->client.lock();
+            if (client && pickMode(*it, m_active, cap, true)) {
+                it->granted = cap;
+                granted.emplace_back(move(client), cap);
+                m_active.push_back(move(*it));
+                m_queued.erase(it);
+            }
+            continue;
+        }
+
+        Request request;
+        remove(m_active, candidate.key, &request);
+        shared_ptr<Client> client = request.client.lock();
+        if (client && pickMode(request, m_active, cap, true)
+                && pixels(cap) > pixels(request.granted)) {
+            request.granted = cap;
+            changed.emplace_back(move(client), cap);
+        }
+        m_active.push_back(move(request));
+    }
+}
+
+} // namespace camera
+} // namespace gecko
+
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GECKOCAMERA_ARBITER__
+#define __GECKOCAMERA_ARBITER__
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "geckocamera.h"
+
+namespace gecko {
+namespace camera {
+
+// What the HAL of a plugin can stream at the same time, zero is no limit.
+struct CaptureLimits {
+    unsigned int maxCameras = 0;
+    // Sum of width * height over the capturing cameras
+    uint64_t maxPixels = 0;
+};
+
+// Decides which cameras of a plugin capture when the HAL can't stream all
+// of them at once. A request is granted as asked if it fits or cameras of
+// lower priority can move to smaller modes to make it fit, else in a
+// smaller mode of its own, else after preempting cameras of lower
+// priority. Otherwise it is queued until enough cameras stop. Preempted
+// cameras are queued as well, and downgraded ones get their mode back
+// when there is room again.
+class CaptureArbiter
+{
+public:
+    class Client
+    {
+    public:
+        virtual ~Client() = default;
+        // Called without the arbiter lock, from the thread whose request
+        // or release caused it.
+        // Stop capturing, the request is queued again.
+        virtual void capturePreempted() = 0;
+        // Start capturing a queued request, in cap.
+        virtual void captureGranted(const CameraCapability &cap) = 0;
+        // Keep capturing, in cap.
+        virtual void captureChanged(const CameraCapability &cap) = 0;
+    };
+
+    enum Decision {
+        Granted,
+        Downgraded,
+        Queued
+    };
+
+    void setLimits(const CaptureLimits &limits);
+    CaptureLimits limits();
+
+    // Replaces an earlier request of the client. modes are the
+    // capabilities of the camera, to pick a smaller one from. cap is set
+    // to the granted mode.
+    Decision request(std::shared_ptr<Client> client, CapturePriority priority,
+                     CameraCapability &cap, const std::vector<CameraCapability> &modes);
+    // A capturing client changes its mode. Returns false if it doesn't fit
+    // without preempting or downgrading.
+    bool update(Client *client, const CameraCapability &cap);
+    // The client stopped capturing or gave up waiting. Queued requests
+    // which fit now are granted.
+    void release(Client *client);
+    // The client lost the camera to something the arbiter doesn't know
+    // about and is queued until another camera stops.
+    void requeue(Client *client);
+
+private:
+    struct Request {
+        Client *key;
+        std::weak_ptr<Client> client;
+        CapturePriority priority;
+        CameraCapability requested;
+        CameraCapability granted;
+        std::vector<CameraCapability> modes;
+        // Order of the requests, older ones go first
+        uint64_t sequence;
+    };
+
+    typedef std::vector<std::pair<std::shared_ptr<Client>, CameraCapability>> Changes;
+
+    bool pickMode(const Request &request, const std::vector<Request> &active,
+                  CameraCapability &cap, bool smaller) const;
+    bool makeRoom(const Request &request, std::vector<Request> &active) const;
+    static bool remove(std::vector<Request> &requests, Client *client, Request *removed);
+    void reallocate(Changes &granted, Changes &changed);
+
+    std::mutex m_mutex;
+    CaptureLimits m_limits;
+    std::vector<Request> m_active;
+    std::vector<Request> m_queued;
+    uint64_t m_sequence = 0;
+};
+
+} // namespace camera
+} // namespace gecko
+
+#endif // __GECKOCAMERA_ARBITER__
+/* vim: set ts=4 et sw=4 tw=80: */
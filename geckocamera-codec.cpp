@@ -17,6 +17,7 @@
  */
 
 #include <dlfcn.h>
+#include <cstring>
 #include <map>
 #include <filesystem>
 #include <mutex>
@@ -48,23 +49,29 @@ public:
     bool createVideoDecoder(CodecType codecType, shared_ptr<VideoDecoder> &decoder) override;
 
 private:
+    struct CodecPlugin {
+        Plugin plugin;
+        bool loaded;
+        shared_ptr<CodecManager> manager;
+    };
+
+    vector<shared_ptr<CodecManager>> pluginsFor(CodecType codecType, bool encoder);
     shared_ptr<CodecManager> loadPlugin(Plugin &plugin);
 
     mutex m_mutex;
     bool m_initialized = false;
-    map<const string, shared_ptr<CodecManager>> m_plugins;
-    map<const string, shared_ptr<CodecManager>> m_mimeTypeMap;
+    vector<CodecPlugin> m_plugins;
 };
 
 bool RootCodecManager::init()
 {
     scoped_lock lock(m_mutex);
     if (!m_initialized) {
+        // Only read the manifests, the plugins are loaded on the first
+        // request for a codec they provide.
         for (auto plugin : PluginManager::get()->listPlugins()) {
-            auto manager = loadPlugin(plugin);
-            if (manager && manager->init()) {
-                LOGI("Initialized codec plugin at " << plugin.path);
-                m_plugins.emplace(plugin.path, manager);
+            if (plugin.manifest.videoEncoders || plugin.manifest.videoDecoders) {
+                m_plugins.push_back(CodecPlugin{plugin, false, nullptr});
             }
         }
         m_initialized = true;
@@ -72,10 +79,42 @@ bool RootCodecManager::init()
     return true;
 }
 
+// Called with m_mutex held
+vector<shared_ptr<CodecManager>> RootCodecManager::pluginsFor(CodecType codecType, bool encoder)
+{
+    vector<shared_ptr<CodecManager>> managers;
+    for (CodecPlugin &entry : m_plugins) {
+        const PluginManifest &manifest = entry.plugin.manifest;
+        uint32_t mask = encoder ? manifest.videoEncoders : manifest.videoDecoders;
+        if (!(mask & codecMask(codecType))) {
+            continue;
+        }
+        if (!entry.loaded) {
+            entry.loaded = true;
+            // The library load is timed on its own, whatever the factory
+            // of the manager does counts as init.
+            PluginManager::get()->load(entry.plugin.path);
+            uint64_t startUs = PluginManager::nowUs();
+            auto manager = loadPlugin(entry.plugin);
+            if (manager && manager->init()) {
+                uint64_t initUs = PluginManager::nowUs() - startUs;
+                PluginManager::get()->recordInit(entry.plugin.path, PluginInitCodec, initUs);
+                LOGI("Initialized codec plugin at " << entry.plugin.path << " in " << initUs << "us");
+                entry.manager = manager;
+            }
+        }
+        if (entry.manager) {
+            managers.push_back(entry.manager);
+        }
+    }
+    return managers;
+}
+
 shared_ptr<CodecManager> RootCodecManager::loadPlugin(Plugin &plugin)
 {
-    if (plugin.handle) {
-        CodecManager* (*_manager)() = (CodecManager * (*)())dlsym(plugin.handle, "gecko_codec_plugin_manager");
+    void *handle = PluginManager::get()->load(plugin.path);
+    if (handle) {
+        CodecManager* (*_manager)() = (CodecManager * (*)())dlsym(handle, "gecko_codec_plugin_manager");
         if (_manager) {
             CodecManager *manager = _manager();
             if (manager) {
@@ -91,7 +130,7 @@ shared_ptr<CodecManager> RootCodecManager::loadPlugin(Plugin &plugin)
 bool RootCodecManager::videoEncoderAvailable(CodecType codecType)
 {
     scoped_lock lock(m_mutex);
-    for (auto const& [path, plugin] : m_plugins) {
+    for (auto const& plugin : pluginsFor(codecType, true)) {
         if (plugin->videoEncoderAvailable(codecType))
             return true;
     }
@@ -101,19 +140,242 @@ bool RootCodecManager::videoEncoderAvailable(CodecType codecType)
 bool RootCodecManager::videoDecoderAvailable(CodecType codecType)
 {
     scoped_lock lock(m_mutex);
-    for (auto const& [path, plugin] : m_plugins) {
+    for (auto const& plugin : pluginsFor(codecType, false)) {
         if (plugin->videoDecoderAvailable(codecType))
             return true;
     }
     return false;
 }
 
+namespace {
+
+// Creating a hardware codec can succeed while its init() fails, e.g. when
+// all instances are busy. These try the codecs of the following plugins
+// then, in the plugin order.
+class FallbackVideoEncoder : public VideoEncoder, VideoEncoderListener
+{
+public:
+    FallbackVideoEncoder(CodecType codecType, shared_ptr<VideoEncoder> encoder,
+                         vector<shared_ptr<CodecManager>> fallbacks)
+        : m_codecType(codecType)
+        , m_encoder(move(encoder))
+        , m_fallbacks(move(fallbacks))
+    {
+    }
+
+    bool init(VideoEncoderMetadata metadata) override
+    {
+        while (m_encoder) {
+            // Ask whether to pass references, now that our listener is known.
+            m_encoder->setListener(this);
+            if (m_encoder->init(metadata)) {
+                return true;
+            }
+            m_encoder.reset();
+            while (!m_encoder && !m_fallbacks.empty()) {
+                shared_ptr<CodecManager> next = move(m_fallbacks.front());
+                m_fallbacks.erase(m_fallbacks.begin());
+                if (next->createVideoEncoder(m_codecType, m_encoder)) {
+                    LOGI("Falling back to the next encoder plugin");
+                }
+            }
+        }
+        return false;
+    }
+
+    bool encode(shared_ptr<const YCbCrFrame> frame, bool forceSync) override
+    {
+        return m_encoder && m_encoder->encode(move(frame), forceSync);
+    }
+
+    bool getStats(VideoEncoderStats &stats) override
+    {
+        return m_encoder && m_encoder->getStats(stats);
+    }
+
+    RateUpdate setRates(int bitrate, int framerate) override
+    {
+        return m_encoder ? m_encoder->setRates(bitrate, framerate) : RateUpdateFailed;
+    }
+
+    void requestKeyFrame() override
+    {
+        if (m_encoder) {
+            m_encoder->requestKeyFrame();
+        }
+    }
+
+    // Delivered the way the current listener wants them, like
+    // ScalingVideoEncoder does.
+    void onEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs,
+                        FrameType frameType) override
+    {
+        deliverEncodedFrame(data, size, timestampUs, frameType);
+    }
+
+    bool wantsEncodedFrameRefs() override
+    {
+        return m_encoderListener && m_encoderListener->wantsEncodedFrameRefs();
+    }
+
+    void onEncodedFrameRef(shared_ptr<const EncodedFrame> frame) override
+    {
+        VideoEncoderListener *listener = m_encoderListener;
+        if (!listener) {
+            return;
+        }
+        if (listener->wantsEncodedFrameRefs()) {
+            listener->onEncodedFrameRef(move(frame));
+        } else {
+            listener->onEncodedFrame(const_cast<uint8_t *>(frame->data), frame->size,
+                                     frame->timestampUs, frame->frameType);
+        }
+    }
+
+    void onEncoderError(string errorDescription) override
+    {
+        VideoEncoderListener *listener = m_encoderListener;
+        if (listener) {
+            listener->onEncoderError(errorDescription);
+        }
+    }
+
+private:
+    CodecType m_codecType;
+    shared_ptr<VideoEncoder> m_encoder;
+    vector<shared_ptr<CodecManager>> m_fallbacks;
+};
+
+class FallbackVideoDecoder : public VideoDecoder, VideoDecoderListener
+{
+public:
+    FallbackVideoDecoder(CodecType codecType, shared_ptr<VideoDecoder> decoder,
+                         vector<shared_ptr<CodecManager>> fallbacks)
+        : m_codecType(codecType)
+        , m_decoder(move(decoder))
+        , m_fallbacks(move(fallbacks))
+    {
+    }
+
+    bool init(VideoDecoderMetadata metadata) override
+    {
+        while (m_decoder) {
+            m_decoder->setListener(this);
+            if (m_decoder->init(metadata)) {
+                return true;
+            }
+            m_decoder.reset();
+            while (!m_decoder && !m_fallbacks.empty()) {
+                shared_ptr<CodecManager> next = move(m_fallbacks.front());
+                m_fallbacks.erase(m_fallbacks.begin());
+                if (next->createVideoDecoder(m_codecType, m_decoder)) {
+                    LOGI("Falling back to the next decoder plugin");
+                }
+            }
+        }
+        return false;
+    }
+
+    bool decode(const uint8_t *data, size_t size, uint64_t timestampUs, FrameType frameType,
+                void (*releaseCallback)(void *), void *releaseCallbackData) override
+    {
+        return m_decoder && m_decoder->decode(data, size, timestampUs, frameType,
+                                              releaseCallback, releaseCallbackData);
+    }
+
+    DecodeResult tryDecode(const uint8_t *data, size_t size, uint64_t timestampUs,
+                           FrameType frameType, void (*releaseCallback)(void *),
+                           void *releaseCallbackData) override
+    {
+        if (!m_decoder) {
+            return DecodeError;
+        }
+        return m_decoder->tryDecode(data, size, timestampUs, frameType,
+                                    releaseCallback, releaseCallbackData);
+    }
+
+    void flush() override
+    {
+        if (m_decoder) {
+            m_decoder->flush();
+        }
+    }
+
+    void drain() override
+    {
+        if (m_decoder) {
+            m_decoder->drain();
+        }
+    }
+
+    void stop() override
+    {
+        if (m_decoder) {
+            m_decoder->stop();
+        }
+    }
+
+    void onDecodedYCbCrFrame(const YCbCrFrame *frame) override
+    {
+        VideoDecoderListener *listener = m_decoderListener;
+        if (listener) {
+            listener->onDecodedYCbCrFrame(frame);
+        }
+    }
+
+    void onDecodedGraphicBuffer(shared_ptr<GraphicBuffer> buffer) override
+    {
+        VideoDecoderListener *listener = m_decoderListener;
+        if (listener) {
+            listener->onDecodedGraphicBuffer(move(buffer));
+        }
+    }
+
+    void onDecoderError(string errorDescription) override
+    {
+        VideoDecoderListener *listener = m_decoderListener;
+        if (listener) {
+            listener->onDecoderError(errorDescription);
+        }
+    }
+
+    void onDecoderEOS() override
+    {
+        VideoDecoderListener *listener = m_decoderListener;
+        if (listener) {
+            listener->onDecoderEOS();
+        }
+    }
+
+    void onDecoderInputCredit() override
+    {
+        VideoDecoderListener *listener = m_decoderListener;
+        if (listener) {
+            listener->onDecoderInputCredit();
+        }
+    }
+
+private:
+    CodecType m_codecType;
+    shared_ptr<VideoDecoder> m_decoder;
+    vector<shared_ptr<CodecManager>> m_fallbacks;
+};
+
+} // namespace
+
 bool RootCodecManager::createVideoEncoder(CodecType codecType, shared_ptr<VideoEncoder> &encoder)
 {
     scoped_lock lock(m_mutex);
-    for (auto const& [path, plugin] : m_plugins) {
-        if (plugin->createVideoEncoder(codecType, encoder))
+    vector<shared_ptr<CodecManager>> plugins = pluginsFor(codecType, true);
+    for (auto it = plugins.begin(); it != plugins.end(); ++it) {
+        if ((*it)->createVideoEncoder(codecType, encoder)) {
+            vector<shared_ptr<CodecManager>> fallbacks(it + 1, plugins.end());
+            if (!fallbacks.empty()) {
+                encoder = make_shared<FallbackVideoEncoder>(codecType, move(encoder),
+                                                            move(fallbacks));
+            }
             return true;
+        }
     }
     return false;
 }
@@ -121,15 +383,95 @@ bool RootCodecManager::createVideoEncoder(CodecType codecType, shared_ptr<VideoE
 bool RootCodecManager::createVideoDecoder(CodecType codecType, shared_ptr<VideoDecoder> &decoder)
 {
     scoped_lock lock(m_mutex);
-    for (auto const& [path, plugin] : m_plugins) {
-        if (plugin->createVideoDecoder(codecType, decoder))
+    vector<shared_ptr<CodecManager>> plugins = pluginsFor(codecType, false);
+    for (auto it = plugins.begin(); it != plugins.end(); ++it) {
+        if ((*it)->createVideoDecoder(codecType, decoder)) {
+            vector<shared_ptr<CodecManager>> fallbacks(it + 1, plugins.end());
+            if (!fallbacks.empty()) {
+                decoder = make_shared<FallbackVideoDecoder>(codecType, move(decoder),
+                                                            move(fallbacks));
+            }
             return true;
+        }
     }
     return false;
 }
 
 static RootCodecManager codecRootManager;
 
+namespace {
+
+// An encoded frame holding its pooled buffer
+struct PooledEncodedFrame : public EncodedFrame {
+    PooledEncodedFrame(BufferPool::Buffer *buffer, size_t size, uint64_t timestampUs,
+                       FrameType frameType)
+        : EncodedFrame{buffer->data(), size, timestampUs, frameType}
+        , buffer(buffer)
+    {
+    }
+
+    ~PooledEncodedFrame()
+    {
+        BufferPool::Buffer::release(buffer);
+    }
+
+    BufferPool::Buffer *buffer;
+};
+
+} // namespace
+
+void VideoEncoder::deliverEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs,
+                                       FrameType frameType)
+{
+    if (!m_encoderListener) {
+        return;
+    }
+    if (!m_encodedFrameRefs) {
+        m_encoderListener->onEncodedFrame(data, size, timestampUs, frameType);
+        return;
+    }
+    BufferPool::Buffer *buffer = m_encodedBuffers->acquire(size);
+    memcpy(buffer->data(), data, size);
+    m_encoderListener->onEncodedFrameRef(
+        allocateShared<PooledEncodedFrame>(m_encodedFrames, buffer, size, timestampUs, frameType));
+}
+
+BufferPool::Buffer *VideoEncoder::acquireEncodedBuffer(size_t size)
+{
+    return m_encodedBuffers->acquire(size);
+}
+
+void VideoEncoder::deliverEncodedBuffer(BufferPool::Buffer *buffer, size_t size,
+                                        uint64_t timestampUs, FrameType frameType)
+{
+    if (!m_encoderListener) {
+        BufferPool::Buffer::release(buffer);
+    } else if (!m_encodedFrameRefs) {
+        m_encoderListener->onEncodedFrame(buffer->data(), size, timestampUs, frameType);
+        BufferPool::Buffer::release(buffer);
+    } else {
+        m_encoderListener->onEncodedFrameRef(
+            allocateShared<PooledEncodedFrame>(m_encodedFrames, buffer, size, timestampUs,
+                                               frameType));
+    }
+}
+
+uint64_t VideoEncoder::encodedFramesHeld()
+{
+    BufferPoolStats stats = m_encodedBuffers->stats();
+    return stats.allocated - stats.available;
+}
+
+bool VideoEncoder::keyFrameDue(uint64_t timestampUs, bool forceSync)
+{
+    bool due = m_keyFrameRequested.exchange(false) || forceSync
+               || (m_keyFrameIntervalUs && timestampUs >= m_nextKeyFrameUs);
+    if (due && m_keyFrameIntervalUs) {
+        m_nextKeyFrameUs = timestampUs + m_keyFrameIntervalUs;
+    }
+    return due;
+}
+
 } // namespace codec
 } // namespace gecko
 
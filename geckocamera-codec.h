@@ -21,12 +21,14 @@
 
 #include <sys/types.h>
 
+#include <atomic>
 #include <cstdint>
 #include <string>
 #include <vector>
 #include <memory>
 
 #include "geckocamera.h"
+#include "geckocamera-pool.h"
 
 namespace gecko {
 namespace codec {
@@ -38,11 +40,34 @@ enum CodecType {
     VideoCodecUnknown
 };
 
+// For PluginManifest
+constexpr uint32_t codecMask(CodecType codecType)
+{
+    return 1u << codecType;
+}
+
 enum FrameType {
     KeyFrame,
     DeltaFrame
 };
 
+enum DecodeResult {
+    DecodeOk,
+    // The codec has no room for more input, try again after
+    // VideoDecoderListener::onDecoderInputCredit().
+    DecodeWouldBlock,
+    DecodeError
+};
+
+enum RateUpdate {
+    // Applied to the running codec, from the next frame on
+    RateUpdateInPlace,
+    // The codec had to be restarted, frames in flight may be lost and the
+    // next frame is a key frame
+    RateUpdateRestarted,
+    RateUpdateFailed
+};
+
 struct VideoEncoderMetadata {
     CodecType codecType;
     int width;
@@ -51,17 +76,56 @@ struct VideoEncoderMetadata {
     int sliceHeight;
     int bitrate;
     int framerate;
+    // Time between automatic key frames, 0 leaves it to the codec.
+    int keyFrameIntervalMs = 0;
+    // Refresh the picture gradually over this many frames instead of with
+    // periodic key frames, 0 disables it. Not all codecs support it.
+    int intraRefreshFrames = 0;
+};
+
+// Encoder output which stays valid for as long as it is referenced
+struct EncodedFrame {
+    const uint8_t *data;
+    size_t size;
+    uint64_t timestampUs;
+    FrameType frameType;
+};
+
+struct VideoEncoderStats {
+    uint64_t framesQueued;
+    uint64_t framesEncoded;
+    // Frames passed to the codec without copying
+    uint64_t framesZeroCopy;
+    // Staging buffer reuse. Misses after warm-up mean allocations on the
+    // frame path.
+    uint64_t bufferPoolHits;
+    uint64_t bufferPoolMisses;
+    // Encoded frames still referenced by the listener
+    uint64_t encodedFramesHeld;
 };
 
 class VideoEncoderListener
 {
 public:
     virtual ~VideoEncoderListener() = default;
+    // The data is only valid during the call.
     virtual void onEncodedFrame(uint8_t *data,
                                 size_t size,
                                 uint64_t timestampUs,
                                 FrameType frameType) = 0;
     virtual void onEncoderError(std::string errorDescription) = 0;
+
+    // Listeners returning true get onEncodedFrameRef() calls instead of
+    // onEncodedFrame(), so that they can queue the frames without copying.
+    // Called once by setListener().
+    virtual bool wantsEncodedFrameRefs()
+    {
+        return false;
+    }
+    virtual void onEncodedFrameRef(std::shared_ptr<const EncodedFrame> frame)
+    {
+        (void)frame;
+    }
 };
 
 class VideoEncoder
@@ -71,14 +135,65 @@ public:
     virtual bool init(VideoEncoderMetadata metadata) = 0;
     virtual bool encode(std::shared_ptr<const gecko::camera::YCbCrFrame> frame,
                         bool forceSync) = 0;
+    // Returns false if the encoder doesn't collect statistics.
+    virtual bool getStats(VideoEncoderStats &stats)
+    {
+        return false;
+    }
+    // Changes the bitrate and frame rate given to init() without
+    // recreating the encoder. Can be called while encoding, from any
+    // thread.
+    virtual RateUpdate setRates(int bitrate, int framerate)
+    {
+        return RateUpdateFailed;
+    }
+    // Encodes the next frame as a key frame, e.g. after a receiver lost
+    // packets. Can be called from any thread.
+    virtual void requestKeyFrame()
+    {
+        m_keyFrameRequested = true;
+    }
 
     void setListener(VideoEncoderListener *listener)
     {
         m_encoderListener = listener;
+        m_encodedFrameRefs = listener && listener->wantsEncodedFrameRefs();
     }
 
 protected:
+    // For encoders whose output is only valid until they continue: passes
+    // it on as it is, or copied into a pooled EncodedFrame.
+    void deliverEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs,
+                             FrameType frameType);
+    // For encoders writing their output into buffers of the pool from
+    // acquireEncodedBuffer(), which are passed on without copying.
+    gecko::camera::BufferPool::Buffer *acquireEncodedBuffer(size_t size);
+    void deliverEncodedBuffer(gecko::camera::BufferPool::Buffer *buffer, size_t size,
+                              uint64_t timestampUs, FrameType frameType);
+    uint64_t encodedFramesHeld();
+
+    // For encoders scheduling key frames themselves, from init().
+    void setKeyFrameInterval(int intervalMs)
+    {
+        m_keyFrameIntervalUs = intervalMs > 0 ? intervalMs * 1000ULL : 0;
+    }
+    // Whether the frame is to be a key frame because the caller forced
+    // it, it was requested or the key frame interval has passed. Called
+    // once per frame, from one thread.
+    bool keyFrameDue(uint64_t timestampUs, bool forceSync);
+
     VideoEncoderListener *m_encoderListener = nullptr;
+
+private:
+    bool m_encodedFrameRefs = false;
+    // Grown to the largest encoded frame
+    std::shared_ptr<gecko::camera::BufferPool> m_encodedBuffers =
+        gecko::camera::BufferPool::create(0, 0);
+    std::shared_ptr<gecko::camera::ObjectPool> m_encodedFrames =
+        gecko::camera::ObjectPool::create();
+    std::atomic<bool> m_keyFrameRequested = false;
+    uint64_t m_keyFrameIntervalUs = 0;
+    uint64_t m_nextKeyFrameUs = 0;
 };
 
 class VideoDecoderListener
@@ -89,6 +204,10 @@ public:
     virtual void onDecodedGraphicBuffer(std::shared_ptr<gecko::camera::GraphicBuffer> buffer) = 0;
     virtual void onDecoderError(std::string errorDescription) = 0;
     virtual void onDecoderEOS() = 0;
+    // Called after VideoDecoder::tryDecode() returned DecodeWouldBlock, once
+    // the codec can take more input. It comes from a codec thread, so the
+    // decoding should be scheduled rather than done from here.
+    virtual void onDecoderInputCredit() {}
 };
 
 struct VideoDecoderMetadata {
@@ -112,6 +231,18 @@ public:
                         FrameType frameType,
                         void (*releaseCallback)(void *),
                         void *releaseCallbackData) = 0;
+    // Never blocks. The release callback is only called for DecodeOk.
+    // Decoders which can't tell if their queue is full fall back to decode().
+    virtual DecodeResult tryDecode(const uint8_t *data,
+                                   size_t size,
+                                   uint64_t timestampUs,
+                                   FrameType frameType,
+                                   void (*releaseCallback)(void *),
+                                   void *releaseCallbackData)
+    {
+        return decode(data, size, timestampUs, frameType,
+                      releaseCallback, releaseCallbackData) ? DecodeOk : DecodeError;
+    }
     virtual void flush() = 0;
     virtual void drain() = 0;
     virtual void stop() = 0;
@@ -0,0 +1,453 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <cstring>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include "geckocamera-convert.h"
+
+#define LOG_TOPIC "convert"
+#include "geckocamera-utils.h"
+
+namespace gecko {
+namespace camera {
+
+using namespace std;
+
+namespace {
+
+struct ConvertKernels {
+    ConvertImplementation impl;
+    void (*interleaveRow)(const uint8_t *u, const uint8_t *v, uint8_t *uv, size_t n);
+    void (*deinterleaveRow)(const uint8_t *uv, uint8_t *u, uint8_t *v, size_t n);
+};
+
+void interleaveRowScalar(const uint8_t *u, const uint8_t *v, uint8_t *uv, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        uv[2 * i] = u[i];
+        uv[2 * i + 1] = v[i];
+    }
+}
+
+void deinterleaveRowScalar(const uint8_t *uv, uint8_t *u, uint8_t *v, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        u[i] = uv[2 * i];
+        v[i] = uv[2 * i + 1];
+    }
+}
+
+const ConvertKernels scalarKernels = {
+    ConvertImplScalar,
+    interleaveRowScalar,
+    deinterleaveRowScalar
+};
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+void interleaveRowSSE2(const uint8_t *u, const uint8_t *v, uint8_t *uv, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(u + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(uv + 2 * i),
+                         _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(uv + 2 * i + 16),
+                         _mm_unpackhi_epi8(a, b));
+    }
+    interleaveRowScalar(u + i, v + i, uv + 2 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+void deinterleaveRowSSE2(const uint8_t *uv, uint8_t *u, uint8_t *v, size_t n)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(uv + 2 * i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(uv + 2 * i + 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(u + i),
+                         _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(v + i),
+                         _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    deinterleaveRowScalar(uv + 2 * i, u + i, v + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void interleaveRowAVX2(const uint8_t *u, const uint8_t *v, uint8_t *uv, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(u + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + i));
+        // Unpack works within 128-bit lanes, fix the lane order afterwards.
+        __m256i lo = _mm256_unpacklo_epi8(a, b);
+        __m256i hi = _mm256_unpackhi_epi8(a, b);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(uv + 2 * i),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(uv + 2 * i + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    interleaveRowSSE2(u + i, v + i, uv + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+void deinterleaveRowAVX2(const uint8_t *uv, uint8_t *u, uint8_t *v, size_t n)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(uv + 2 * i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(uv + 2 * i + 32));
+        __m256i pu = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                                         _mm256_and_si256(b, mask));
+        __m256i pv = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                         _mm256_srli_epi16(b, 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(u + i),
+                            _mm256_permute4x64_epi64(pu, 0xd8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(v + i),
+                            _mm256_permute4x64_epi64(pv, 0xd8));
+    }
+    deinterleaveRowSSE2(uv + 2 * i, u + i, v + i, n - i);
+}
+
+const ConvertKernels sse2Kernels = {
+    ConvertImplSSE2,
+    interleaveRowSSE2,
+    deinterleaveRowSSE2
+};
+
+const ConvertKernels avx2Kernels = {
+    ConvertImplAVX2,
+    interleaveRowAVX2,
+    deinterleaveRowAVX2
+};
+#endif // HAVE_X86_KERNELS
+
+#ifdef HAVE_NEON_KERNELS
+void interleaveRowNEON(const uint8_t *u, const uint8_t *v, uint8_t *uv, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t val;
+        val.val[0] = vld1q_u8(u + i);
+        val.val[1] = vld1q_u8(v + i);
+        vst2q_u8(uv + 2 * i, val);
+    }
+    interleaveRowScalar(u + i, v + i, uv + 2 * i, n - i);
+}
+
+void deinterleaveRowNEON(const uint8_t *uv, uint8_t *u, uint8_t *v, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t val = vld2q_u8(uv + 2 * i);
+        vst1q_u8(u + i, val.val[0]);
+        vst1q_u8(v + i, val.val[1]);
+    }
+    deinterleaveRowScalar(uv + 2 * i, u + i, v + i, n - i);
+}
+
+const ConvertKernels neonKernels = {
+    ConvertImplNEON,
+    interleaveRowNEON,
+    deinterleaveRowNEON
+};
+#endif // HAVE_NEON_KERNELS
+
+const ConvertKernels *kernelsFor(ConvertImplementation impl)
+{
+    switch (impl) {
+    case ConvertImplAuto:
+#ifdef HAVE_NEON_KERNELS
+        return &neonKernels;
+#endif
+#ifdef HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return &avx2Kernels;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return &sse2Kernels;
+        }
+#endif
+        return &scalarKernels;
+    case ConvertImplScalar:
+        return &scalarKernels;
+    case ConvertImplSSE2:
+#ifdef HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2")) {
+            return &sse2Kernels;
+        }
+#endif
+        break;
+    case ConvertImplAVX2:
+#ifdef HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return &avx2Kernels;
+        }
+#endif
+        break;
+    case ConvertImplNEON:
+#ifdef HAVE_NEON_KERNELS
+        return &neonKernels;
+#endif
+        break;
+    }
+    return nullptr;
+}
+
+atomic<const ConvertKernels *> currentKernels(nullptr);
+
+const ConvertKernels *kernels()
+{
+    const ConvertKernels *k = currentKernels.load(memory_order_acquire);
+    if (!k) {
+        k = kernelsFor(ConvertImplAuto);
+        LOGD("Using " << convertImplementationName(k->impl) << " kernels");
+        currentKernels.store(k, memory_order_release);
+    }
+    return k;
+}
+
+} // namespace
+
+bool convertSetImplementation(ConvertImplementation impl)
+{
+    const ConvertKernels *k = kernelsFor(impl);
+    if (k) {
+        currentKernels.store(k, memory_order_release);
+        return true;
+    }
+    return false;
+}
+
+ConvertImplementation convertGetImplementation()
+{
+    return kernels()->impl;
+}
+
+const char *convertImplementationName(ConvertImplementation impl)
+{
+    switch (impl) {
+    case ConvertImplAuto:
+        return "auto";
+    case ConvertImplScalar:
+        return "scalar";
+    case ConvertImplSSE2:
+        return "sse2";
+    case ConvertImplAVX2:
+        return "avx2";
+    case ConvertImplNEON:
+        return "neon";
+    }
+    return "unknown";
+}
+
+void copyPlane(const uint8_t *src, unsigned int srcStride,
+               uint8_t *dst, unsigned int dstStride,
+               unsigned int width, unsigned int height)
+{
+    // memcpy is already vectorized by libc, so just take care of the strides.
+    if (srcStride == width && dstStride == width) {
+        memcpy(dst, src, (size_t)width * height);
+        return;
+    }
+    for (unsigned int row = 0; row < height; row++) {
+        memcpy(dst, src, width);
+        src += srcStride;
+        dst += dstStride;
+    }
+}
+
+void copyPlaneStep(const uint8_t *src, unsigned int srcStride, unsigned int srcStep,
+                   uint8_t *dst, unsigned int dstStride, unsigned int dstStep,
+                   unsigned int width, unsigned int height)
+{
+    if (srcStep == 1 && dstStep == 1) {
+        copyPlane(src, srcStride, dst, dstStride, width, height);
+        return;
+    }
+    for (unsigned int row = 0; row < height; row++) {
+        const uint8_t *s = src;
+        uint8_t *d = dst;
+        for (unsigned int i = 0; i < width; i++) {
+            *d = *s;
+            s += srcStep;
+            d += dstStep;
+        }
+        src += srcStride;
+        dst += dstStride;
+    }
+}
+
+void interleavePlanes(const uint8_t *srcU, unsigned int srcUStride,
+                      const uint8_t *srcV, unsigned int srcVStride,
+                      uint8_t *dst, unsigned int dstStride,
+                      unsigned int width, unsigned int height)
+{
+    auto interleaveRow = kernels()->interleaveRow;
+    for (unsigned int row = 0; row < height; row++) {
+        interleaveRow(srcU, srcV, dst, width);
+        srcU += srcUStride;
+        srcV += srcVStride;
+        dst += dstStride;
+    }
+}
+
+void deinterleavePlane(const uint8_t *src, unsigned int srcStride,
+                       uint8_t *dstU, unsigned int dstUStride,
+                       uint8_t *dstV, unsigned int dstVStride,
+                       unsigned int width, unsigned int height)
+{
+    auto deinterleaveRow = kernels()->deinterleaveRow;
+    for (unsigned int row = 0; row < height; row++) {
+        deinterleaveRow(src, dstU, dstV, width);
+        src += srcStride;
+        dstU += dstUStride;
+        dstV += dstVStride;
+    }
+}
+
+static YCbCrFrame makeLayout(uint8_t *buffer, unsigned int width, unsigned int height,
+                             unsigned int stride)
+{
+    YCbCrFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.width = width;
+    frame.height = height;
+    frame.yStride = stride ? stride : width;
+    frame.y = buffer;
+    return frame;
+}
+
+YCbCrFrame makeI420Layout(uint8_t *buffer, unsigned int width, unsigned int height,
+                          unsigned int stride, unsigned int sliceHeight)
+{
+    YCbCrFrame frame = makeLayout(buffer, width, height, stride);
+    size_t ySize = (size_t)frame.yStride * (sliceHeight ? sliceHeight : height);
+    frame.cStride = (frame.yStride + 1) / 2;
+    frame.chromaStep = 1;
+    frame.cb = buffer + ySize;
+    frame.cr = frame.cb + (size_t)frame.cStride * (((sliceHeight ? sliceHeight : height) + 1) / 2);
+    return frame;
+}
+
+YCbCrFrame makeNV12Layout(uint8_t *buffer, unsigned int width, unsigned int height,
+                          unsigned int stride, unsigned int sliceHeight)
+{
+    YCbCrFrame frame = makeLayout(buffer, width, height, stride);
+    size_t ySize = (size_t)frame.yStride * (sliceHeight ? sliceHeight : height);
+    frame.cStride = frame.yStride;
+    frame.chromaStep = 2;
+    frame.cb = buffer + ySize;
+    frame.cr = frame.cb + 1;
+    return frame;
+}
+
+YCbCrFrame makeNV21Layout(uint8_t *buffer, unsigned int width, unsigned int height,
+                          unsigned int stride, unsigned int sliceHeight)
+{
+    YCbCrFrame frame = makeNV12Layout(buffer, width, height, stride, sliceHeight);
+    frame.cr = frame.cb;
+    frame.cb = frame.cr + 1;
+    return frame;
+}
+
+size_t yuv420BufferSize(unsigned int width, unsigned int height,
+                        unsigned int stride, unsigned int sliceHeight)
+{
+    size_t yStride = stride ? stride : width;
+    size_t ySliceHeight = sliceHeight ? sliceHeight : height;
+    // Rounding the chroma stride up makes it large enough for NV12 as well.
+    return yStride * ySliceHeight + 2 * ((yStride + 1) / 2) * ((ySliceHeight + 1) / 2);
+}
+
+bool convertYCbCrFrame(const YCbCrFrame &src, const YCbCrFrame &dst)
+{
+    if (!src.y || !src.cb || !src.cr || !dst.y || !dst.cb || !dst.cr) {
+        LOGE("Invalid frame");
+        return false;
+    }
+    if (src.width != dst.width || src.height != dst.height) {
+        LOGE("Frame size mismatch " << src.width << "x" << src.height
+             << " vs " << dst.width << "x" << dst.height);
+        return false;
+    }
+
+    const unsigned int cWidth = (src.width + 1) / 2;
+    const unsigned int cHeight = (src.height + 1) / 2;
+    uint8_t *dstY = const_cast<uint8_t *>(dst.y);
+    uint8_t *dstCb = const_cast<uint8_t *>(dst.cb);
+    uint8_t *dstCr = const_cast<uint8_t *>(dst.cr);
+
+    copyPlane(src.y, src.yStride, dstY, dst.yStride, src.width, src.height);
+
+    const bool srcPlanar = src.chromaStep == 1;
+    const bool dstPlanar = dst.chromaStep == 1;
+    const bool srcCbFirst = src.chromaStep == 2 && src.cr == src.cb + 1;
+    const bool srcCrFirst = src.chromaStep == 2 && src.cb == src.cr + 1;
+    const bool dstCbFirst = dst.chromaStep == 2 && dst.cr == dst.cb + 1;
+    const bool dstCrFirst = dst.chromaStep == 2 && dst.cb == dst.cr + 1;
+
+    if (srcPlanar && dstPlanar) {
+        copyPlane(src.cb, src.cStride, dstCb, dst.cStride, cWidth, cHeight);
+        copyPlane(src.cr, src.cStride, dstCr, dst.cStride, cWidth, cHeight);
+    } else if (srcPlanar && dstCbFirst) {
+        interleavePlanes(src.cb, src.cStride, src.cr, src.cStride,
+                         dstCb, dst.cStride, cWidth, cHeight);
+    } else if (srcPlanar && dstCrFirst) {
+        interleavePlanes(src.cr, src.cStride, src.cb, src.cStride,
+                         dstCr, dst.cStride, cWidth, cHeight);
+    } else if (srcCbFirst && dstPlanar) {
+        deinterleavePlane(src.cb, src.cStride, dstCb, dst.cStride,
+                          dstCr, dst.cStride, cWidth, cHeight);
+    } else if (srcCrFirst && dstPlanar) {
+        deinterleavePlane(src.cr, src.cStride, dstCr, dst.cStride,
+                          dstCb, dst.cStride, cWidth, cHeight);
+    } else if ((srcCbFirst && dstCbFirst) || (srcCrFirst && dstCrFirst)) {
+        copyPlane(min(src.cb, src.cr), src.cStride, min(dstCb, dstCr),
+                  dst.cStride, cWidth * 2, cHeight);
+    } else {
+        copyPlaneStep(src.cb, src.cStride, src.chromaStep,
+                      dstCb, dst.cStride, dst.chromaStep, cWidth, cHeight);
+        copyPlaneStep(src.cr, src.cStride, src.chromaStep,
+                      dstCr, dst.cStride, dst.chromaStep, cWidth, cHeight);
+    }
+    return true;
+}
+
+} // namespace camera
+} // namespace gecko
+
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GECKOCAMERA_CONVERT__
+#define __GECKOCAMERA_CONVERT__
+
+#include <sys/types.h>
+
+#include <cstdint>
+
+#include "geckocamera.h"
+
+namespace gecko {
+namespace camera {
+
+enum ConvertImplementation {
+    ConvertImplAuto = 0,
+    ConvertImplScalar,
+    ConvertImplSSE2,
+    ConvertImplAVX2,
+    ConvertImplNEON
+};
+
+// The best implementation supported by the CPU is picked on first use.
+// Forcing a specific one is mostly useful for testing and benchmarking,
+// returns false if it is not available on this CPU or in this build.
+bool convertSetImplementation(ConvertImplementation impl);
+ConvertImplementation convertGetImplementation();
+const char *convertImplementationName(ConvertImplementation impl);
+
+// Plane kernels. Width is in samples, strides are in bytes.
+void copyPlane(const uint8_t *src, unsigned int srcStride,
+               uint8_t *dst, unsigned int dstStride,
+               unsigned int width, unsigned int height);
+
+// Copy a plane whose samples are chromaStep bytes apart, e.g. one of the
+// chroma planes of a semi-planar frame.
+void copyPlaneStep(const uint8_t *src, unsigned int srcStride, unsigned int srcStep,
+                   uint8_t *dst, unsigned int dstStride, unsigned int dstStep,
+                   unsigned int width, unsigned int height);
+
+// Two planar chroma planes into one interleaved plane (I420 -> NV12/NV21).
+void interleavePlanes(const uint8_t *srcU, unsigned int srcUStride,
+                      const uint8_t *srcV, unsigned int srcVStride,
+                      uint8_t *dst, unsigned int dstStride,
+                      unsigned int width, unsigned int height);
+
+// One interleaved chroma plane into two planar ones (NV12/NV21 -> I420).
+void deinterleavePlane(const uint8_t *src, unsigned int srcStride,
+                       uint8_t *dstU, unsigned int dstUStride,
+                       uint8_t *dstV, unsigned int dstVStride,
+                       unsigned int width, unsigned int height);
+
+// Describe a contiguous frame in the given buffer. The stride and slice
+// height may be larger than the frame size, zero means "same as frame".
+YCbCrFrame makeI420Layout(uint8_t *buffer, unsigned int width, unsigned int height,
+                          unsigned int stride = 0, unsigned int sliceHeight = 0);
+YCbCrFrame makeNV12Layout(uint8_t *buffer, unsigned int width, unsigned int height,
+                          unsigned int stride = 0, unsigned int sliceHeight = 0);
+YCbCrFrame makeNV21Layout(uint8_t *buffer, unsigned int width, unsigned int height,
+                          unsigned int stride = 0, unsigned int sliceHeight = 0);
+
+// Buffer size required by the layouts above, I420 and NV12/NV21 are the same.
+size_t yuv420BufferSize(unsigned int width, unsigned int height,
+                        unsigned int stride = 0, unsigned int sliceHeight = 0);
+
+// Copy and convert src into the memory described by dst, which must have the
+// same size. Any chromaStep and plane order is accepted for both frames,
+// the common I420/NV12/NV21 combinations use vectorized kernels.
+bool convertYCbCrFrame(const YCbCrFrame &src, const YCbCrFrame &dst);
+
+} // namespace camera
+} // namespace gecko
+
+#endif // __GECKOCAMERA_CONVERT__
+/* vim: set ts=4 et sw=4 tw=80: */
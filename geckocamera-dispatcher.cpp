@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "geckocamera-dispatcher.h"
+#include "geckocamera-latency.h"
+
+#define LOG_TOPIC "dispatcher"
+#include "geckocamera-utils.h"
+
+namespace gecko {
+namespace camera {
+
+using namespace std;
+
+static size_t roundUpPowerOfTwo(size_t value)
+{
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+FrameDispatcher::FrameDispatcher(Camera *camera, CameraListener *listener,
+                                 unsigned int queueDepth, FrameDropPolicy policy)
+    : m_camera(camera)
+    , m_listener(listener)
+    , m_policy(policy)
+    , m_capacity(roundUpPowerOfTwo(queueDepth))
+    , m_cells(new Cell[m_capacity])
+    , m_enqueuePos(0)
+    , m_dequeuePos(0)
+    , m_delivered(0)
+    , m_dropped(0)
+    , m_maxQueued(0)
+    , m_consumerWaiting(false)
+    , m_producerWaiting(false)
+{
+    for (size_t i = 0; i < m_capacity; i++) {
+        m_cells[i].sequence.store(i, memory_order_relaxed);
+    }
+    m_thread = thread(&FrameDispatcher::loop, this);
+    LOGD(camera << " queue depth " << m_capacity << " policy " << policy);
+}
+
+FrameDispatcher::~FrameDispatcher()
+{
+    {
+        scoped_lock lock(m_mutex);
+        m_quit = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+bool FrameDispatcher::tryPush(shared_ptr<GraphicBuffer> &buffer)
+{
+    size_t pos = m_enqueuePos.load(memory_order_relaxed);
+    Cell *cell;
+    for (;;) {
+        cell = &m_cells[pos & (m_capacity - 1)];
+        size_t sequence = cell->sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_enqueuePos.load(memory_order_relaxed);
+        }
+    }
+    cell->buffer = move(buffer);
+    cell->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
+
+bool FrameDispatcher::tryPop(shared_ptr<GraphicBuffer> &buffer)
+{
+    size_t pos = m_dequeuePos.load(memory_order_relaxed);
+    Cell *cell;
+    for (;;) {
+        cell = &m_cells[pos & (m_capacity - 1)];
+        size_t sequence = cell->sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (m_dequeuePos.compare_exchange_weak(pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_dequeuePos.load(memory_order_relaxed);
+        }
+    }
+    buffer = move(cell->buffer);
+    cell->sequence.store(pos + m_capacity, memory_order_release);
+    return true;
+}
+
+unsigned int FrameDispatcher::queued() const
+{
+    size_t dequeuePos = m_dequeuePos.load();
+    size_t enqueuePos = m_enqueuePos.load();
+    return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+}
+
+// The waiting side sets its flag under the mutex and checks the ring again
+// before sleeping, so taking the mutex here can't miss the wakeup.
+void FrameDispatcher::wakeConsumer()
+{
+    if (m_consumerWaiting.exchange(false)) {
+        {
+            scoped_lock lock(m_mutex);
+        }
+        m_cond.notify_all();
+    }
+}
+
+void FrameDispatcher::wakeProducer()
+{
+    if (m_producerWaiting.exchange(false)) {
+        {
+            scoped_lock lock(m_mutex);
+        }
+        m_cond.notify_all();
+    }
+}
+
+void FrameDispatcher::push(shared_ptr<GraphicBuffer> buffer)
+{
+    while (!tryPush(buffer)) {
+        if (m_policy == DropNewest) {
+            m_dropped++;
+            return;
+        } else if (m_policy == DropOldest) {
+            // The old frame is released here, on the camera thread.
+            shared_ptr<GraphicBuffer> oldest;
+            if (tryPop(oldest)) {
+                m_dropped++;
+            }
+        } else {
+            unique_lock lock(m_mutex);
+            if (m_quit) {
+                m_dropped++;
+                return;
+            }
+            m_producerWaiting = true;
+            if (queued() < m_capacity) {
+                m_producerWaiting = false;
+                continue;
+            }
+            m_cond.wait(lock, [this] { return !m_producerWaiting || m_quit; });
+        }
+    }
+
+    // Only the producer writes the maximum.
+    unsigned int count = queued();
+    if (count > m_maxQueued.load(memory_order_relaxed)) {
+        m_maxQueued.store(count, memory_order_relaxed);
+    }
+    wakeConsumer();
+}
+
+void FrameDispatcher::flush()
+{
+    shared_ptr<GraphicBuffer> buffer;
+    while (tryPop(buffer)) {
+        buffer.reset();
+        m_dropped++;
+    }
+    wakeProducer();
+
+    // Like with direct delivery the listener must not be called after
+    // the capture has stopped, so wait for the frame being delivered.
+    // The listener itself may stop the capture.
+    if (this_thread::get_id() != m_thread.get_id()) {
+        scoped_lock lock(m_deliveryMutex);
+    }
+}
+
+void FrameDispatcher::getStats(FrameDeliveryStats &stats) const
+{
+    stats.delivered = m_delivered.load(memory_order_relaxed);
+    stats.dropped = m_dropped.load(memory_order_relaxed);
+    stats.queued = queued();
+    stats.queueDepth = m_capacity;
+    stats.maxQueued = m_maxQueued.load(memory_order_relaxed);
+}
+
+void FrameDispatcher::loop()
+{
+    shared_ptr<GraphicBuffer> buffer;
+    for (;;) {
+        {
+            scoped_lock deliveryLock(m_deliveryMutex);
+            if (tryPop(buffer)) {
+                wakeProducer();
+                CameraListener *listener = m_listener ? m_listener : m_camera->cameraListener;
+                if (m_camera->dispatchFrame(listener, move(buffer))) {
+                    m_delivered.fetch_add(1, memory_order_relaxed);
+                }
+                buffer.reset();
+                continue;
+            }
+        }
+
+        unique_lock lock(m_mutex);
+        if (m_quit) {
+            break;
+        }
+        m_consumerWaiting = true;
+        if (queued()) {
+            // A frame is being published.
+            m_consumerWaiting = false;
+            lock.unlock();
+            this_thread::yield();
+            continue;
+        }
+        m_cond.wait(lock, [this] { return !m_consumerWaiting || m_quit; });
+    }
+}
+
+CameraListenerSet::CameraListenerSet(Camera *camera)
+    : m_camera(camera)
+    , m_count(0)
+{
+    for (Slot &slot : m_slots) {
+        slot.sink.store(nullptr, memory_order_relaxed);
+        slot.users.store(0, memory_order_relaxed);
+    }
+}
+
+CameraListenerSet::~CameraListenerSet()
+{
+    for (Slot &slot : m_slots) {
+        destroy(slot);
+    }
+}
+
+// Returns the sink of the slot, which stays valid until leave(). The
+// counter is raised before loading the sink so that remove() either sees
+// it or the sink was already taken out.
+CameraListenerSet::Sink *CameraListenerSet::enter(Slot &slot)
+{
+    slot.users.fetch_add(1);
+    Sink *sink = slot.sink.load();
+    if (!sink) {
+        slot.users.fetch_sub(1);
+    }
+    return sink;
+}
+
+void CameraListenerSet::leave(Slot &slot)
+{
+    slot.users.fetch_sub(1);
+}
+
+// static
+void CameraListenerSet::destroy(Slot &slot)
+{
+    Sink *sink = slot.sink.exchange(nullptr);
+    if (sink) {
+        while (slot.users.load()) {
+            this_thread::yield();
+        }
+        // Stops the delivery thread after the frame in flight.
+        delete sink;
+    }
+}
+
+bool CameraListenerSet::add(CameraListener *listener, unsigned int queueDepth,
+                            FrameDropPolicy policy)
+{
+    scoped_lock lock(m_mutex);
+    Slot *free = nullptr;
+    for (Slot &slot : m_slots) {
+        Sink *sink = slot.sink.load();
+        if (sink && sink->listener == listener) {
+            LOGE("Listener " << listener << " already added");
+            return false;
+        } else if (!sink && !free) {
+            free = &slot;
+        }
+    }
+    if (!free) {
+        LOGE("Too many listeners");
+        return false;
+    }
+
+    Sink *sink = new Sink;
+    sink->listener = listener;
+    sink->delivered.store(0, memory_order_relaxed);
+    if (queueDepth) {
+        sink->dispatcher = make_unique<FrameDispatcher>(m_camera, listener, queueDepth, policy);
+    }
+    free->sink.store(sink);
+    m_count.fetch_add(1);
+    return true;
+}
+
+bool CameraListenerSet::remove(CameraListener *listener)
+{
+    scoped_lock lock(m_mutex);
+    for (Slot &slot : m_slots) {
+        Sink *sink = slot.sink.load();
+        if (sink && sink->listener == listener) {
+            m_count.fetch_sub(1);
+            destroy(slot);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CameraListenerSet::getStats(CameraListener *listener, FrameDeliveryStats &stats)
+{
+    scoped_lock lock(m_mutex);
+    for (Slot &slot : m_slots) {
+        Sink *sink = slot.sink.load();
+        if (sink && sink->listener == listener) {
+            if (sink->dispatcher) {
+                sink->dispatcher->getStats(stats);
+            } else {
+                stats.delivered = sink->delivered.load(memory_order_relaxed);
+                stats.dropped = 0;
+                stats.queued = 0;
+                stats.queueDepth = 0;
+                stats.maxQueued = 0;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void CameraListenerSet::deliver(const shared_ptr<GraphicBuffer> &buffer)
+{
+    if (!m_count.load(memory_order_relaxed)) {
+        return;
+    }
+    for (Slot &slot : m_slots) {
+        Sink *sink = enter(slot);
+        if (sink) {
+            if (sink->dispatcher) {
+                sink->dispatcher->push(buffer);
+            } else if (m_camera->dispatchFrame(sink->listener, buffer)) {
+                sink->delivered.fetch_add(1, memory_order_relaxed);
+            }
+            leave(slot);
+        }
+    }
+}
+
+void CameraListenerSet::deliverError(const string &errorDescription)
+{
+    for (Slot &slot : m_slots) {
+        Sink *sink = enter(slot);
+        if (sink) {
+            sink->listener->onCameraError(errorDescription);
+            leave(slot);
+        }
+    }
+}
+
+void CameraListenerSet::deliverCaptureState(CaptureState state, const CameraCapability &cap)
+{
+    for (Slot &slot : m_slots) {
+        Sink *sink = enter(slot);
+        if (sink) {
+            sink->listener->onCaptureStateChanged(state, cap);
+            leave(slot);
+        }
+    }
+}
+
+void CameraListenerSet::flush()
+{
+    for (Slot &slot : m_slots) {
+        Sink *sink = enter(slot);
+        if (sink) {
+            if (sink->dispatcher) {
+                sink->dispatcher->flush();
+            }
+            leave(slot);
+        }
+    }
+}
+
+Camera::Camera()
+    : m_listeners(make_shared<CameraListenerSet>(this))
+{
+}
+
+Camera::~Camera()
+{
+}
+
+bool Camera::setFrameDelivery(unsigned int queueDepth, FrameDropPolicy policy)
+{
+    if (captureStarted()) {
+        LOGE("Cannot change frame delivery while capturing");
+        return false;
+    }
+    m_dispatcher.reset();
+    if (queueDepth) {
+        m_dispatcher = make_shared<FrameDispatcher>(this, nullptr, queueDepth, policy);
+    }
+    return true;
+}
+
+bool Camera::getFrameDeliveryStats(FrameDeliveryStats &stats) const
+{
+    if (m_dispatcher) {
+        m_dispatcher->getStats(stats);
+    } else {
+        stats.delivered = m_framesDelivered.load(memory_order_relaxed);
+        stats.dropped = 0;
+        stats.queued = 0;
+        stats.queueDepth = 0;
+        stats.maxQueued = 0;
+    }
+    return true;
+}
+
+bool Camera::addListener(CameraListener *listener, unsigned int queueDepth,
+                         FrameDropPolicy policy)
+{
+    if (!listener) {
+        return false;
+    }
+    return m_listeners->add(listener, queueDepth, policy);
+}
+
+bool Camera::removeListener(CameraListener *listener)
+{
+    return m_listeners->remove(listener);
+}
+
+bool Camera::getFrameDeliveryStats(CameraListener *listener, FrameDeliveryStats &stats) const
+{
+    return m_listeners->getStats(listener, stats);
+}
+
+bool Camera::getSwitchStats(CameraSwitchStats &stats) const
+{
+    if (!m_switchStartUs.load(memory_order_relaxed)) {
+        return false;
+    }
+    stats.startUs = m_switchReadyUs;
+    stats.firstFrameUs = m_switchFirstFrameUs.load(memory_order_relaxed);
+    return true;
+}
+
+void Camera::deliverFrame(shared_ptr<GraphicBuffer> buffer)
+{
+    uint64_t switchStartUs = m_switchStartUs.load(memory_order_relaxed);
+    if (switchStartUs && !m_switchFirstFrameUs.load(memory_order_relaxed)) {
+        m_switchFirstFrameUs.store(LatencyStream::nowUs() - switchStartUs,
+                                   memory_order_relaxed);
+    }
+
+    // The other listeners share the buffer, the main one gets the last
+    // reference.
+    m_listeners->deliver(buffer);
+    if (m_dispatcher) {
+        m_dispatcher->push(move(buffer));
+    } else if (dispatchFrame(cameraListener, move(buffer))) {
+        m_framesDelivered.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void Camera::deliverError(const string &errorDescription)
+{
+    CameraListener *listener = cameraListener;
+    if (listener) {
+        listener->onCameraError(errorDescription);
+    }
+    m_listeners->deliverError(errorDescription);
+}
+
+void Camera::deliverCaptureState(CaptureState state, const CameraCapability &cap)
+{
+    CameraListener *listener = cameraListener;
+    if (listener) {
+        listener->onCaptureStateChanged(state, cap);
+    }
+    m_listeners->deliverCaptureState(state, cap);
+}
+
+void Camera::flushFrames()
+{
+    if (m_dispatcher) {
+        m_dispatcher->flush();
+    }
+    m_listeners->flush();
+}
+
+void Camera::resetOwnerState()
+{
+    cameraListener = nullptr;
+    m_dispatcher.reset();
+    m_listeners = make_shared<CameraListenerSet>(this);
+    m_framesDelivered = 0;
+    m_switchStartUs = 0;
+    m_switchReadyUs = 0;
+    m_switchFirstFrameUs = 0;
+    m_capturePriority = CapturePriorityNormal;
+}
+
+bool Camera::dispatchFrame(CameraListener *listener, shared_ptr<GraphicBuffer> buffer)
+{
+    if (listener) {
+        // Latency is tracked for the main listener only.
+        if (latencyStream && listener == cameraListener) {
+            latencyStream->record(LatencyDelivered, buffer->timestampUs);
+        }
+        listener->onCameraFrame(buffer);
+        return true;
+    }
+    return false;
+}
+
+} // namespace camera
+} // namespace gecko
+
+/* vim: set ts=4 et sw=4 tw=80: */
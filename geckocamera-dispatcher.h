@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GECKOCAMERA_DISPATCHER__
+#define __GECKOCAMERA_DISPATCHER__
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "geckocamera.h"
+
+namespace gecko {
+namespace camera {
+
+// Passes frames from the camera thread to a delivery thread through a
+// bounded ring. The ring follows the Vyukov bounded queue, so that with
+// DropOldest the producer can take the oldest frame out while the
+// delivery thread is consuming. Without a listener frames go to the
+// camera's main listener.
+class FrameDispatcher
+{
+public:
+    FrameDispatcher(Camera *camera, CameraListener *listener,
+                    unsigned int queueDepth, FrameDropPolicy policy);
+    ~FrameDispatcher();
+
+    void push(std::shared_ptr<GraphicBuffer> buffer);
+    void flush();
+    void getStats(FrameDeliveryStats &stats) const;
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        std::shared_ptr<GraphicBuffer> buffer;
+    };
+
+    bool tryPush(std::shared_ptr<GraphicBuffer> &buffer);
+    bool tryPop(std::shared_ptr<GraphicBuffer> &buffer);
+    unsigned int queued() const;
+    void wakeConsumer();
+    void wakeProducer();
+    void loop();
+
+    Camera *m_camera;
+    CameraListener *m_listener;
+    const FrameDropPolicy m_policy;
+    const size_t m_capacity;
+    std::unique_ptr<Cell[]> m_cells;
+
+    alignas(64) std::atomic<size_t> m_enqueuePos;
+    alignas(64) std::atomic<size_t> m_dequeuePos;
+
+    std::atomic<uint64_t> m_delivered;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<unsigned int> m_maxQueued;
+
+    // Held by the delivery thread while it takes and delivers a frame.
+    std::mutex m_deliveryMutex;
+
+    // Only used to sleep when the ring is empty, or full with BlockProducer.
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::atomic<bool> m_consumerWaiting;
+    std::atomic<bool> m_producerWaiting;
+    bool m_quit = false;
+    std::thread m_thread;
+};
+
+// The listeners added with Camera::addListener(). The frame path only uses
+// atomics: a slot counts the threads handing frames to it, and removing a
+// listener waits for them before destroying its queue.
+class CameraListenerSet
+{
+public:
+    explicit CameraListenerSet(Camera *camera);
+    ~CameraListenerSet();
+
+    bool add(CameraListener *listener, unsigned int queueDepth, FrameDropPolicy policy);
+    bool remove(CameraListener *listener);
+    bool getStats(CameraListener *listener, FrameDeliveryStats &stats);
+
+    void deliver(const std::shared_ptr<GraphicBuffer> &buffer);
+    void deliverError(const std::string &errorDescription);
+    void deliverCaptureState(CaptureState state, const CameraCapability &cap);
+    void flush();
+
+private:
+    struct Sink {
+        CameraListener *listener;
+        std::unique_ptr<FrameDispatcher> dispatcher;
+        std::atomic<uint64_t> delivered;
+    };
+
+    struct Slot {
+        std::atomic<Sink *> sink;
+        std::atomic<unsigned int> users;
+    };
+
+    Sink *enter(Slot &slot);
+    void leave(Slot &slot);
+    static void destroy(Slot &slot);
+
+    Camera *m_camera;
+    Slot m_slots[Camera::MAX_LISTENERS];
+    std::atomic<unsigned int> m_count;
+    // Serialises add() and remove()
+    std::mutex m_mutex;
+};
+
+} // namespace camera
+} // namespace gecko
+
+#endif // __GECKOCAMERA_DISPATCHER__
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "geckocamera-latency.h"
+
+#define LOG_TOPIC "latency"
+#include "geckocamera-utils.h"
+
+namespace gecko {
+namespace camera {
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+// Values below 16us get a bucket each, above that every power of two is
+// split into eight buckets.
+unsigned int LatencyHistogram::bucketIndex(uint64_t us)
+{
+    if (us < 16) {
+        return us;
+    }
+    unsigned int msb = 63 - __builtin_clzll(us);
+    unsigned int sub = (us >> (msb - 3)) & 7;
+    unsigned int index = 16 + (msb - 4) * 8 + sub;
+    return index < BUCKETS ? index : BUCKETS - 1;
+}
+
+uint64_t LatencyHistogram::bucketValue(unsigned int index)
+{
+    if (index < 16) {
+        return index;
+    }
+    unsigned int msb = (index - 16) / 8 + 4;
+    unsigned int sub = (index - 16) % 8;
+    // Report the upper bound of the bucket.
+    return ((uint64_t)(8 + sub + 1) << (msb - 3)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t us)
+{
+    m_buckets[bucketIndex(us)].fetch_add(1, memory_order_relaxed);
+    uint64_t max = m_max.load(memory_order_relaxed);
+    while (us > max && !m_max.compare_exchange_weak(max, us, memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        m_buckets[i].store(0, memory_order_relaxed);
+    }
+    m_max.store(0, memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    uint64_t count = 0;
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        count += m_buckets[i].load(memory_order_relaxed);
+    }
+    return count;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    uint32_t snapshot[BUCKETS];
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        snapshot[i] = m_buckets[i].load(memory_order_relaxed);
+        total += snapshot[i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p * total);
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        seen += snapshot[i];
+        if (seen > rank) {
+            return min(bucketValue(i), max());
+        }
+    }
+    return max();
+}
+
+uint64_t LatencyHistogram::max() const
+{
+    return m_max.load(memory_order_relaxed);
+}
+
+atomic<bool> LatencyStream::s_enabled(false);
+
+namespace {
+
+class LatencyRegistry
+{
+public:
+    ~LatencyRegistry()
+    {
+        stopDumping();
+    }
+
+    LatencyStream *get(const string &name, LatencyStream *(*create)(const string &))
+    {
+        scoped_lock lock(m_mutex);
+        auto it = m_streams.find(name);
+        if (it == m_streams.end()) {
+            it = m_streams.emplace(name, unique_ptr<LatencyStream>(create(name))).first;
+        }
+        return it->second.get();
+    }
+
+    vector<LatencyStream *> streams()
+    {
+        scoped_lock lock(m_mutex);
+        vector<LatencyStream *> streams;
+        for (auto const& [name, stream] : m_streams) {
+            streams.push_back(stream.get());
+        }
+        return streams;
+    }
+
+    void startDumping(unsigned int intervalSeconds)
+    {
+        stopDumping();
+        if (intervalSeconds) {
+            m_dumping = true;
+            m_dumpThread = thread([this, intervalSeconds]() {
+                unique_lock lock(m_dumpMutex);
+                while (!m_dumpCond.wait_for(lock, chrono::seconds(intervalSeconds),
+                                            [this] { return !m_dumping; })) {
+                    latencyDump();
+                }
+            });
+        }
+    }
+
+    void stopDumping()
+    {
+        if (m_dumpThread.joinable()) {
+            {
+                scoped_lock lock(m_dumpMutex);
+                m_dumping = false;
+            }
+            m_dumpCond.notify_all();
+            m_dumpThread.join();
+        }
+    }
+
+private:
+    mutex m_mutex;
+    map<string, unique_ptr<LatencyStream>> m_streams;
+
+    mutex m_dumpMutex;
+    condition_variable m_dumpCond;
+    bool m_dumping = false;
+    thread m_dumpThread;
+};
+
+LatencyRegistry registry;
+
+} // namespace
+
+LatencyStream::LatencyStream(const string &name)
+    : m_name(name)
+{
+    for (unsigned int i = 0; i < PENDING_SLOTS; i++) {
+        m_pending[i].timestampUs.store(0, memory_order_relaxed);
+        m_pending[i].queuedUs.store(0, memory_order_relaxed);
+    }
+}
+
+// static
+LatencyStream *LatencyStream::get(const string &name)
+{
+    return registry.get(name, [](const string &n) {
+        return new LatencyStream(n);
+    });
+}
+
+// static
+uint64_t LatencyStream::nowUs()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LatencyStream::recordAt(LatencyStage stage, uint64_t timestampUs, uint64_t now)
+{
+    // Clock differences between the HAL and us must not wrap around.
+    m_histograms[stage].record(now > timestampUs ? now - timestampUs : 0);
+}
+
+void LatencyStream::markQueued(uint64_t timestampUs)
+{
+    Pending &slot = m_pending[timestampUs % PENDING_SLOTS];
+    slot.queuedUs.store(nowUs(), memory_order_relaxed);
+    slot.timestampUs.store(timestampUs, memory_order_release);
+}
+
+void LatencyStream::recordDecoded(uint64_t timestampUs)
+{
+    Pending &slot = m_pending[timestampUs % PENDING_SLOTS];
+    if (slot.timestampUs.load(memory_order_acquire) == timestampUs) {
+        recordAt(LatencyDecoded, slot.queuedUs.load(memory_order_relaxed), nowUs());
+    }
+}
+
+void LatencyStream::reset()
+{
+    for (unsigned int i = 0; i < LatencyStageCount; i++) {
+        m_histograms[i].reset();
+    }
+}
+
+void latencySetEnabled(bool enabled, unsigned int dumpIntervalSeconds)
+{
+    LOGI("Latency tracing " << (enabled ? "enabled" : "disabled"));
+    LatencyStream::s_enabled = enabled;
+    registry.startDumping(enabled ? dumpIntervalSeconds : 0);
+}
+
+bool latencyEnabled()
+{
+    return LatencyStream::enabled();
+}
+
+vector<LatencySummary> latencyQuery()
+{
+    vector<LatencySummary> result;
+    for (LatencyStream *stream : registry.streams()) {
+        for (unsigned int i = 0; i < LatencyStageCount; i++) {
+            const LatencyHistogram &histogram = stream->histogram((LatencyStage)i);
+            uint64_t count = histogram.count();
+            if (count) {
+                LatencySummary summary;
+                summary.stream = stream->name();
+                summary.stage = (LatencyStage)i;
+                summary.count = count;
+                summary.p50Us = histogram.percentile(0.5);
+                summary.p90Us = histogram.percentile(0.9);
+                summary.p99Us = histogram.percentile(0.99);
+                summary.p999Us = histogram.percentile(0.999);
+                summary.maxUs = histogram.max();
+                result.push_back(summary);
+            }
+        }
+    }
+    return result;
+}
+
+void latencyReset()
+{
+    for (LatencyStream *stream : registry.streams()) {
+        stream->reset();
+    }
+}
+
+void latencyDump()
+{
+    for (const LatencySummary &s : latencyQuery()) {
+        LOGI(s.stream << " " << latencyStageName(s.stage)
+             << " n=" << s.count
+             << " p50=" << s.p50Us
+             << " p90=" << s.p90Us
+             << " p99=" << s.p99Us
+             << " p99.9=" << s.p999Us
+             << " max=" << s.maxUs << "us");
+    }
+}
+
+const char *latencyStageName(LatencyStage stage)
+{
+    switch (stage) {
+    case LatencyDelivered:
+        return "delivered";
+    case LatencyMapped:
+        return "mapped";
+    case LatencyEncodeQueued:
+        return "encode-queued";
+    case LatencyEncoded:
+        return "encoded";
+    case LatencyDecoded:
+        return "decoded";
+    case LatencyStageCount:
+        break;
+    }
+    return "unknown";
+}
+
+} // namespace camera
+} // namespace gecko
+
+/* vim: set ts=4 et sw=4 tw=80: */
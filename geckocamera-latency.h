@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GECKOCAMERA_LATENCY__
+#define __GECKOCAMERA_LATENCY__
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace gecko {
+namespace camera {
+
+// Points on the frame path. Latencies are measured from the frame
+// timestamp reported by the HAL, except for LatencyDecoded which is
+// measured from the matching VideoDecoder::decode() call.
+enum LatencyStage {
+    LatencyDelivered = 0,   // CameraListener::onCameraFrame() called
+    LatencyMapped,          // GraphicBuffer::mapYCbCr() returned
+    LatencyEncodeQueued,    // VideoEncoder::encode() called
+    LatencyEncoded,         // VideoEncoderListener::onEncodedFrame() called
+    LatencyDecoded,         // VideoDecoderListener got the decoded frame
+    LatencyStageCount
+};
+
+struct LatencySummary {
+    std::string stream;
+    LatencyStage stage;
+    uint64_t count;
+    uint64_t p50Us;
+    uint64_t p90Us;
+    uint64_t p99Us;
+    uint64_t p999Us;
+    uint64_t maxUs;
+};
+
+// Lock-free log-linear histogram of microsecond values, precise to 1/8th.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(uint64_t us);
+    void reset();
+
+    uint64_t count() const;
+    uint64_t percentile(double p) const;
+    uint64_t max() const;
+
+private:
+    static const unsigned int BUCKETS = 16 + 32 * 8;
+
+    static unsigned int bucketIndex(uint64_t us);
+    static uint64_t bucketValue(unsigned int index);
+
+    std::atomic<uint32_t> m_buckets[BUCKETS];
+    std::atomic<uint64_t> m_max;
+};
+
+class LatencyStream
+{
+public:
+    // Streams are kept until the process exits, so the returned pointer
+    // can be used without further synchronisation.
+    static LatencyStream *get(const std::string &name);
+
+    static bool enabled()
+    {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    static uint64_t nowUs();
+
+    // Record the latency of the stage for a frame with the given timestamp.
+    void record(LatencyStage stage, uint64_t timestampUs)
+    {
+        if (enabled()) {
+            recordAt(stage, timestampUs, nowUs());
+        }
+    }
+
+    // Decoder latency is measured between these two calls, matched by
+    // the frame timestamp.
+    void decodeQueued(uint64_t timestampUs)
+    {
+        if (enabled()) {
+            markQueued(timestampUs);
+        }
+    }
+
+    void decoded(uint64_t timestampUs)
+    {
+        if (enabled()) {
+            recordDecoded(timestampUs);
+        }
+    }
+
+    const std::string &name() const
+    {
+        return m_name;
+    }
+
+    const LatencyHistogram &histogram(LatencyStage stage) const
+    {
+        return m_histograms[stage];
+    }
+
+    void reset();
+
+private:
+    friend void latencySetEnabled(bool enabled, unsigned int dumpIntervalSeconds);
+
+    explicit LatencyStream(const std::string &name);
+
+    void recordAt(LatencyStage stage, uint64_t timestampUs, uint64_t now);
+    void markQueued(uint64_t timestampUs);
+    void recordDecoded(uint64_t timestampUs);
+
+    static std::atomic<bool> s_enabled;
+
+    static const unsigned int PENDING_SLOTS = 64;
+    struct Pending {
+        std::atomic<uint64_t> timestampUs;
+        std::atomic<uint64_t> queuedUs;
+    };
+
+    std::string m_name;
+    LatencyHistogram m_histograms[LatencyStageCount];
+    Pending m_pending[PENDING_SLOTS];
+};
+
+// Also enabled with GECKO_CAMERA_LATENCY=<dump interval in seconds>.
+// A zero interval disables the periodic log dump.
+void latencySetEnabled(bool enabled, unsigned int dumpIntervalSeconds = 0);
+bool latencyEnabled();
+std::vector<LatencySummary> latencyQuery();
+void latencyReset();
+void latencyDump();
+const char *latencyStageName(LatencyStage stage);
+
+} // namespace camera
+} // namespace gecko
+
+#endif // __GECKOCAMERA_LATENCY__
+/* vim: set ts=4 et sw=4 tw=80: */
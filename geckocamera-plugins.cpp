@@ -17,10 +17,21 @@
  */
 
 #include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <sstream>
 #include <vector>
 #include <filesystem>
 
 #include "geckocamera-plugins.h"
+#include "geckocamera-latency.h"
+
+#define LOG_TOPIC "plugins"
 #include "geckocamera-utils.h"
 
 namespace gecko {
@@ -28,28 +39,239 @@ namespace camera {
 
 using namespace std;
 
+// Bump when the format of the cache file changes.
+static const unsigned int MANIFEST_CACHE_VERSION = 2;
+static const char *MANIFEST_CACHE_HEADER = "gecko-camera-plugins";
+
+// Plugins may advertise more with a GECKO_CAMERA_ variable set, so the
+// cached manifests are only valid for the same such variables.
+static uint64_t environmentStamp()
+{
+    vector<string> vars;
+    for (char **var = environ; *var; var++) {
+        if (!strncmp(*var, "GECKO_CAMERA_", 13)) {
+            vars.push_back(*var);
+        }
+    }
+    sort(vars.begin(), vars.end());
+    string all;
+    for (const string &var : vars) {
+        all += var;
+        all += '\n';
+    }
+    return hash<string>()(all);
+}
+
+static bool fileStamp(const string &path, int64_t &mtime, uint64_t &size)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st)) {
+        return false;
+    }
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    size = st.st_size;
+    return true;
+}
+
+// static
+uint64_t PluginManager::nowUs()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 std::vector<Plugin> PluginManager::listPlugins()
 {
     scoped_lock lock(m_mutex);
     if (!m_initialized) {
         LogInit("gecko-camera", getenv("GECKO_CAMERA_DEBUG") ? LogDebug : LogInfo);
-        filesystem::directory_entry pluginDir(GECKO_CAMERA_PLUGIN_DIR);
-        if (pluginDir.exists() && pluginDir.is_directory()) {
-            for (const auto &entry : filesystem::directory_iterator(GECKO_CAMERA_PLUGIN_DIR)) {
-                if (entry.is_regular_file()) {
-                    string path = entry.path();
-                    // Clear error
-                    dlerror();
-                    void *handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_LOCAL);
-                    if (handle) {
-                        m_plugins.push_back(Plugin{path, handle});
-                    }
-                }
-            }
+        if (getenv("GECKO_CAMERA_LATENCY")) {
+            latencySetEnabled(true, atoi(getenv("GECKO_CAMERA_LATENCY")));
         }
+        scan();
         m_initialized = true;
     }
-    return m_plugins;
+
+    vector<Plugin> plugins;
+    for (const Entry &entry : m_plugins) {
+        plugins.push_back(entry.plugin);
+    }
+    return plugins;
+}
+
+void PluginManager::scan()
+{
+    uint64_t startUs = nowUs();
+    vector<string> paths;
+
+    filesystem::directory_entry pluginDir(GECKO_CAMERA_PLUGIN_DIR);
+    if (pluginDir.exists() && pluginDir.is_directory()) {
+        for (const auto &entry : filesystem::directory_iterator(GECKO_CAMERA_PLUGIN_DIR)) {
+            if (entry.is_regular_file()) {
+                paths.push_back(entry.path());
+            }
+        }
+    }
+    // Keep the order stable between runs.
+    sort(paths.begin(), paths.end());
+
+    readCache();
+
+    map<string, CachedManifest> cache;
+    bool dirty = false;
+    for (const string &path : paths) {
+        Entry entry = {};
+        entry.plugin.path = path;
+        entry.stats.path = path;
+
+        CachedManifest stamp = {};
+        if (!fileStamp(path, stamp.mtime, stamp.size)) {
+            continue;
+        }
+
+        auto it = m_cache.find(path);
+        if (it != m_cache.end() && it->second.mtime == stamp.mtime
+                && it->second.size == stamp.size) {
+            entry.plugin.manifest = it->second.manifest;
+            entry.stats.manifestCached = true;
+        } else if (loadUnlocked(entry)) {
+            // Load the plugin once to read the manifest. It stays loaded,
+            // it is likely to be used anyway.
+            const PluginManifest *manifest = static_cast<const PluginManifest *>(
+                dlsym(entry.handle, "gecko_camera_plugin_manifest"));
+            if (manifest && manifest->version == PLUGIN_MANIFEST_VERSION) {
+                entry.plugin.manifest = *manifest;
+            } else {
+                LOGD(path << " has no manifest");
+                entry.plugin.manifest.version = PLUGIN_MANIFEST_VERSION;
+                entry.plugin.manifest.camera = true;
+                entry.plugin.manifest.videoEncoders = ~0u;
+                entry.plugin.manifest.videoDecoders = ~0u;
+            }
+            dirty = true;
+        } else {
+            // Not cached, the library may become loadable later.
+            continue;
+        }
+
+        stamp.manifest = entry.plugin.manifest;
+        cache.emplace(path, stamp);
+        m_plugins.push_back(move(entry));
+    }
+
+    if (dirty || cache.size() != m_cache.size()) {
+        m_cache = move(cache);
+        writeCache();
+    }
+
+    LOGI("Found " << m_plugins.size() << " plugins in " << (nowUs() - startUs) << "us");
+}
+
+bool PluginManager::readCache()
+{
+    string path = cacheFilePath("plugins");
+    if (path.empty()) {
+        return false;
+    }
+
+    ifstream in(path);
+    string header;
+    unsigned int version = 0;
+    uint64_t stamp = 0;
+    if (!(in >> header >> version >> stamp) || header != MANIFEST_CACHE_HEADER
+            || version != MANIFEST_CACHE_VERSION || stamp != environmentStamp()) {
+        return false;
+    }
+
+    CachedManifest cached;
+    unsigned int camera;
+    string pluginPath;
+    while (in >> cached.mtime >> cached.size >> camera
+               >> cached.manifest.videoEncoders >> cached.manifest.videoDecoders) {
+        in >> ws;
+        if (!getline(in, pluginPath)) {
+            break;
+        }
+        cached.manifest.version = PLUGIN_MANIFEST_VERSION;
+        cached.manifest.camera = camera;
+        m_cache[pluginPath] = cached;
+    }
+    return true;
+}
+
+void PluginManager::writeCache()
+{
+    string path = cacheFilePath("plugins");
+    if (path.empty()) {
+        return;
+    }
+
+    ostringstream out;
+    out << MANIFEST_CACHE_HEADER << " " << MANIFEST_CACHE_VERSION << " "
+        << environmentStamp() << "\n";
+    for (auto const& [pluginPath, cached] : m_cache) {
+        out << cached.mtime << " " << cached.size << " "
+            << cached.manifest.camera << " "
+            << cached.manifest.videoEncoders << " "
+            << cached.manifest.videoDecoders << " "
+            << pluginPath << "\n";
+    }
+    writeCacheFile(path, out.str());
+}
+
+void *PluginManager::loadUnlocked(Entry &entry)
+{
+    if (!entry.handle) {
+        uint64_t startUs = nowUs();
+        // Clear error
+        dlerror();
+        entry.handle = dlopen(entry.plugin.path.c_str(), RTLD_LAZY | RTLD_LOCAL);
+        if (!entry.handle) {
+            LOGD("Cannot load " << entry.plugin.path << ": " << dlerror());
+            return nullptr;
+        }
+        entry.stats.loaded = true;
+        entry.stats.loadUs = nowUs() - startUs;
+        LOGI("Loaded " << entry.plugin.path << " in " << entry.stats.loadUs << "us");
+    }
+    return entry.handle;
+}
+
+void *PluginManager::load(const string &path)
+{
+    scoped_lock lock(m_mutex);
+    for (Entry &entry : m_plugins) {
+        if (entry.plugin.path == path) {
+            return loadUnlocked(entry);
+        }
+    }
+    return nullptr;
+}
+
+void PluginManager::recordInit(const string &path, PluginInitType type, uint64_t us)
+{
+    scoped_lock lock(m_mutex);
+    for (Entry &entry : m_plugins) {
+        if (entry.plugin.path == path) {
+            // Non-zero marks the plugin initialized.
+            us = max<uint64_t>(us, 1);
+            if (type == PluginInitCamera) {
+                entry.stats.cameraInitUs = us;
+            } else {
+                entry.stats.codecInitUs = us;
+            }
+        }
+    }
+}
+
+vector<PluginLoadStats> PluginManager::loadStats()
+{
+    scoped_lock lock(m_mutex);
+    vector<PluginLoadStats> stats;
+    for (const Entry &entry : m_plugins) {
+        stats.push_back(entry.stats);
+    }
+    return stats;
 }
 
 static PluginManager pluginManager;
@@ -59,6 +281,11 @@ PluginManager *PluginManager::get()
     return &pluginManager;
 }
 
+vector<PluginLoadStats> pluginLoadStats()
+{
+    return PluginManager::get()->loadStats();
+}
+
 } // namespace camera
 } // namespace gecko
 /* vim: set ts=4 et sw=4 tw=80: */
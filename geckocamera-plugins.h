@@ -19,23 +19,60 @@
 #ifndef __GECKO_CAMERA_PLUGINS__
 #define __GECKO_CAMERA_PLUGINS__
 
+#include <string>
 #include <vector>
+#include <map>
 #include <mutex>
 
+#include "geckocamera.h"
+
 namespace gecko {
 namespace camera {
 
 struct Plugin {
     std::string path;
-    void *handle;
+    PluginManifest manifest;
+};
+
+enum PluginInitType {
+    PluginInitCamera,
+    PluginInitCodec
 };
 
 class PluginManager {
 public:
     static PluginManager *get();
+    // Lists the plugins with their manifests without loading them if the
+    // manifests are cached.
     std::vector<Plugin> listPlugins();
+    // Returns the dlopen() handle, loading the plugin on the first call.
+    void *load(const std::string &path);
+    void recordInit(const std::string &path, PluginInitType type, uint64_t us);
+    std::vector<PluginLoadStats> loadStats();
+
+    static uint64_t nowUs();
+
 private:
-    std::vector<Plugin> m_plugins;
+    struct Entry {
+        Plugin plugin;
+        void *handle;
+        PluginLoadStats stats;
+    };
+
+    // The manifest is valid while the file is unchanged
+    struct CachedManifest {
+        int64_t mtime;
+        uint64_t size;
+        PluginManifest manifest;
+    };
+
+    void scan();
+    void *loadUnlocked(Entry &entry);
+    bool readCache();
+    void writeCache();
+
+    std::vector<Entry> m_plugins;
+    std::map<std::string, CachedManifest> m_cache;
     std::mutex m_mutex;
     bool m_initialized = false;
 };
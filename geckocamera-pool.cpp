@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <cstring>
+
+#include "geckocamera-pool.h"
+
+#define LOG_TOPIC "pool"
+#include "geckocamera-utils.h"
+
+namespace gecko {
+namespace camera {
+
+using namespace std;
+
+BufferPool::BufferPool(size_t bufferSize, unsigned int count)
+    : m_bufferSize(bufferSize)
+{
+    m_buffers.reserve(count);
+    m_free.reserve(count);
+    for (unsigned int i = 0; i < count; i++) {
+        m_buffers.push_back(make_unique<Buffer>());
+        allocate(m_buffers.back().get(), bufferSize);
+        m_free.push_back(m_buffers.back().get());
+    }
+}
+
+// static
+void BufferPool::allocate(Buffer *buffer, size_t size)
+{
+    buffer->m_data.reset(new uint8_t[size]);
+    buffer->m_size = size;
+    // Touch the pages now rather than on the frame path.
+    memset(buffer->m_data.get(), 0, size);
+}
+
+BufferPool::Buffer *BufferPool::acquire(size_t size)
+{
+    scoped_lock lock(m_mutex);
+    Buffer *buffer;
+
+    if (size < m_bufferSize) {
+        size = m_bufferSize;
+    }
+
+    if (!m_free.empty()) {
+        buffer = m_free.back();
+        m_free.pop_back();
+        if (buffer->m_size < size) {
+            allocate(buffer, size);
+            m_misses++;
+        } else {
+            m_hits++;
+        }
+    } else {
+        m_buffers.push_back(make_unique<Buffer>());
+        buffer = m_buffers.back().get();
+        allocate(buffer, size);
+        // Keep recycle() allocation free.
+        m_free.reserve(m_buffers.size());
+        m_misses++;
+        LOGD("Pool " << this << " grown to " << m_buffers.size() << " buffers");
+    }
+
+    buffer->m_pool = shared_from_this();
+    return buffer;
+}
+
+void BufferPool::recycle(Buffer *buffer)
+{
+    scoped_lock lock(m_mutex);
+    m_free.push_back(buffer);
+}
+
+// static
+void BufferPool::Buffer::release(void *data)
+{
+    Buffer *buffer = static_cast<Buffer *>(data);
+    // The buffer may hold the last reference to its pool.
+    shared_ptr<BufferPool> pool = move(buffer->m_pool);
+    pool->recycle(buffer);
+}
+
+void BufferPool::setBufferSize(size_t bufferSize)
+{
+    scoped_lock lock(m_mutex);
+    m_bufferSize = bufferSize;
+}
+
+size_t BufferPool::bufferSize()
+{
+    scoped_lock lock(m_mutex);
+    return m_bufferSize;
+}
+
+BufferPoolStats BufferPool::stats()
+{
+    scoped_lock lock(m_mutex);
+    BufferPoolStats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.allocated = m_buffers.size();
+    stats.available = m_free.size();
+    return stats;
+}
+
+ObjectPool::~ObjectPool()
+{
+    for (void *block : m_free) {
+        ::operator delete(block);
+    }
+}
+
+void *ObjectPool::allocate(size_t size)
+{
+    {
+        scoped_lock lock(m_mutex);
+        if (!m_blockSize) {
+            m_blockSize = size;
+        }
+        if (size == m_blockSize) {
+            if (!m_free.empty()) {
+                void *block = m_free.back();
+                m_free.pop_back();
+                m_hits++;
+                return block;
+            }
+            m_allocated++;
+            // Keep deallocate() allocation free.
+            m_free.reserve(m_allocated);
+        }
+        m_misses++;
+    }
+    return ::operator new(size);
+}
+
+void ObjectPool::deallocate(void *block, size_t size)
+{
+    {
+        scoped_lock lock(m_mutex);
+        if (size == m_blockSize) {
+            m_free.push_back(block);
+            return;
+        }
+    }
+    ::operator delete(block);
+}
+
+BufferPoolStats ObjectPool::stats()
+{
+    scoped_lock lock(m_mutex);
+    BufferPoolStats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.allocated = m_allocated;
+    stats.available = m_free.size();
+    return stats;
+}
+
+} // namespace camera
+} // namespace gecko
+
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GECKOCAMERA_POOL__
+#define __GECKOCAMERA_POOL__
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace gecko {
+namespace camera {
+
+struct BufferPoolStats {
+    // Buffers handed out without allocating memory
+    uint64_t hits;
+    // Buffers that had to be allocated or grown
+    uint64_t misses;
+    unsigned int allocated;
+    unsigned int available;
+};
+
+// A pool of equally sized memory buffers. Buffers are returned to the pool
+// with Buffer::release(), which can be passed directly as a C callback.
+// Outstanding buffers keep the pool alive.
+class BufferPool : public std::enable_shared_from_this<BufferPool>
+{
+public:
+    class Buffer
+    {
+    public:
+        uint8_t *data() const
+        {
+            return m_data.get();
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        static void release(void *buffer);
+
+    private:
+        friend class BufferPool;
+
+        std::unique_ptr<uint8_t[]> m_data;
+        size_t m_size = 0;
+        std::shared_ptr<BufferPool> m_pool;
+    };
+
+    static std::shared_ptr<BufferPool> create(size_t bufferSize, unsigned int count)
+    {
+        return std::make_shared<BufferPool>(bufferSize, count);
+    }
+
+    explicit BufferPool(size_t bufferSize, unsigned int count);
+
+    // Returns a buffer of at least the given size, or of the pool's buffer
+    // size if it is zero.
+    Buffer *acquire(size_t size = 0);
+
+    // New and recycled buffers are grown to this size on demand.
+    void setBufferSize(size_t bufferSize);
+    size_t bufferSize();
+
+    BufferPoolStats stats();
+
+private:
+    void recycle(Buffer *buffer);
+    static void allocate(Buffer *buffer, size_t size);
+
+    std::mutex m_mutex;
+    size_t m_bufferSize;
+    std::vector<std::unique_ptr<Buffer>> m_buffers;
+    std::vector<Buffer *> m_free;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+};
+
+// Recycles the memory of objects made with allocateShared(), including the
+// shared_ptr control block, so that per-frame wrapper objects don't touch
+// the heap once the pool is warm. Meant for one object type per pool,
+// blocks of any other size go to the heap. Outstanding objects keep the
+// pool alive.
+class ObjectPool
+{
+public:
+    static std::shared_ptr<ObjectPool> create()
+    {
+        return std::make_shared<ObjectPool>();
+    }
+
+    ~ObjectPool();
+
+    void *allocate(size_t size);
+    void deallocate(void *block, size_t size);
+
+    BufferPoolStats stats();
+
+private:
+    std::mutex m_mutex;
+    size_t m_blockSize = 0;
+    std::vector<void *> m_free;
+    unsigned int m_allocated = 0;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+};
+
+template <class T>
+class ObjectPoolAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit ObjectPoolAllocator(std::shared_ptr<ObjectPool> pool)
+        : m_pool(std::move(pool))
+    {
+    }
+
+    template <class U>
+    ObjectPoolAllocator(const ObjectPoolAllocator<U> &other)
+        : m_pool(other.pool())
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(m_pool->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        m_pool->deallocate(p, n * sizeof(T));
+    }
+
+    const std::shared_ptr<ObjectPool> &pool() const
+    {
+        return m_pool;
+    }
+
+    template <class U>
+    bool operator==(const ObjectPoolAllocator<U> &other) const
+    {
+        return m_pool == other.pool();
+    }
+
+    template <class U>
+    bool operator!=(const ObjectPoolAllocator<U> &other) const
+    {
+        return m_pool != other.pool();
+    }
+
+private:
+    std::shared_ptr<ObjectPool> m_pool;
+};
+
+template <class T, class... Args>
+std::shared_ptr<T> allocateShared(const std::shared_ptr<ObjectPool> &pool, Args&&... args)
+{
+    return std::allocate_shared<T>(ObjectPoolAllocator<T>(pool), std::forward<Args>(args)...);
+}
+
+// Keeps shared objects alive across C callbacks: hold() returns the
+// callback data and release() drops the reference. The slots are recycled
+// so that holding an object doesn't allocate. Outstanding references keep
+// the pool alive.
+template <class T>
+class RefPool : public std::enable_shared_from_this<RefPool<T>>
+{
+public:
+    static std::shared_ptr<RefPool> create()
+    {
+        return std::make_shared<RefPool>();
+    }
+
+    void *hold(std::shared_ptr<T> object)
+    {
+        std::scoped_lock lock(m_mutex);
+        Ref *ref;
+        if (m_free.empty()) {
+            m_refs.push_back(std::make_unique<Ref>());
+            m_free.reserve(m_refs.size());
+            ref = m_refs.back().get();
+        } else {
+            ref = m_free.back();
+            m_free.pop_back();
+        }
+        ref->object = std::move(object);
+        ref->pool = this->shared_from_this();
+        return ref;
+    }
+
+    static void release(void *data)
+    {
+        Ref *ref = static_cast<Ref *>(data);
+        ref->object.reset();
+        std::shared_ptr<RefPool> pool = std::move(ref->pool);
+        std::scoped_lock lock(pool->m_mutex);
+        pool->m_free.push_back(ref);
+    }
+
+private:
+    struct Ref {
+        std::shared_ptr<T> object;
+        std::shared_ptr<RefPool> pool;
+    };
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Ref>> m_refs;
+    std::vector<Ref *> m_free;
+};
+
+} // namespace camera
+} // namespace gecko
+
+#endif // __GECKOCAMERA_POOL__
+/* vim: set ts=4 et sw=4 tw=80: */
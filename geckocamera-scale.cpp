@@ -0,0 +1,785 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include "geckocamera-convert.h"
+#include "geckocamera-scale.h"
+
+#define LOG_TOPIC "scale"
+#include "geckocamera-utils.h"
+
+namespace gecko {
+namespace camera {
+
+using namespace std;
+
+namespace {
+
+// Only the vertical pass and 2:1 steps are vectorized, other horizontal
+// ratios need gathers which don't pay off for these sizes.
+struct ScaleKernels {
+    // acc[i] += src[i]
+    void (*addRow)(const uint8_t *src, uint16_t *acc, size_t n);
+    // dst[i] = (r0[i] * (256 - f) + r1[i] * f + 128) >> 8, 0 < f < 256
+    void (*blendRows)(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n,
+                      unsigned int f);
+    // dst[i] = (src[2i] + src[2i + 1] + 1) >> 1
+    void (*halveRow)(const uint8_t *src, uint8_t *dst, size_t n);
+    // The 2x2 box of two rows, rounded like the generic box filter
+    void (*quarterRows)(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n);
+};
+
+void addRowScalar(const uint8_t *src, uint16_t *acc, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += src[i];
+    }
+}
+
+void blendRowsScalar(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n,
+                     unsigned int f)
+{
+    const unsigned int f0 = 256 - f;
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (r0[i] * f0 + r1[i] * f + 128) >> 8;
+    }
+}
+
+void halveRowScalar(const uint8_t *src, uint8_t *dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (src[2 * i] + src[2 * i + 1] + 1) >> 1;
+    }
+}
+
+void quarterRowsScalar(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (r0[2 * i] + r0[2 * i + 1] + r1[2 * i] + r1[2 * i + 1] + 2) >> 2;
+    }
+}
+
+const ScaleKernels scalarKernels = {
+    addRowScalar,
+    blendRowsScalar,
+    halveRowScalar,
+    quarterRowsScalar
+};
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+void addRowSSE2(const uint8_t *src, uint16_t *acc, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i *a = reinterpret_cast<__m128i *>(acc + i);
+        _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_unpacklo_epi8(s, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1),
+                                              _mm_unpackhi_epi8(s, zero)));
+    }
+    addRowScalar(src + i, acc + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void blendRowsSSE2(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n,
+                   unsigned int f)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w0 = _mm_set1_epi16(256 - f);
+    const __m128i w1 = _mm_set1_epi16(f);
+    const __m128i round = _mm_set1_epi16(128);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0 + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1 + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    blendRowsScalar(r0 + i, r1 + i, dst + i, n - i, f);
+}
+
+__attribute__((target("sse2")))
+void halveRowSSE2(const uint8_t *src, uint8_t *dst, size_t n)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i + 16));
+        __m128i even = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+        __m128i odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_avg_epu8(even, odd));
+    }
+    halveRowScalar(src + 2 * i, dst + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void quarterRowsSSE2(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    const __m128i round = _mm_set1_epi16(2);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0 + 2 * i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1 + 2 * i));
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, mask), _mm_srli_epi16(a, 8)),
+                                    _mm_add_epi16(_mm_and_si128(b, mask), _mm_srli_epi16(b, 8)));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(sum, sum));
+    }
+    quarterRowsScalar(r0 + 2 * i, r1 + 2 * i, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void addRowAVX2(const uint8_t *src, uint16_t *acc, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i s = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+        __m256i *a = reinterpret_cast<__m256i *>(acc + i);
+        _mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a), s));
+    }
+    addRowSSE2(src + i, acc + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void blendRowsAVX2(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n,
+                   unsigned int f)
+{
+    const __m256i w0 = _mm256_set1_epi16(256 - f);
+    const __m256i w1 = _mm256_set1_epi16(f);
+    const __m256i round = _mm256_set1_epi16(128);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0 + i)));
+        __m256i b = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1 + i)));
+        __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(a, w0), _mm256_mullo_epi16(b, w1));
+        sum = _mm256_srli_epi16(_mm256_add_epi16(sum, round), 8);
+        // Pack works within 128-bit lanes, take the low half of each.
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), 0xd8);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm256_castsi256_si128(packed));
+    }
+    blendRowsSSE2(r0 + i, r1 + i, dst + i, n - i, f);
+}
+
+__attribute__((target("avx2")))
+void halveRowAVX2(const uint8_t *src, uint8_t *dst, size_t n)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i + 32));
+        __m256i even = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                                           _mm256_and_si256(b, mask));
+        __m256i odd = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                            _mm256_permute4x64_epi64(_mm256_avg_epu8(even, odd), 0xd8));
+    }
+    halveRowSSE2(src + 2 * i, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void quarterRowsAVX2(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n)
+{
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i round = _mm256_set1_epi16(2);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r0 + 2 * i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r1 + 2 * i));
+        __m256i sum = _mm256_add_epi16(_mm256_maddubs_epi16(a, ones),
+                                       _mm256_maddubs_epi16(b, ones));
+        sum = _mm256_srli_epi16(_mm256_add_epi16(sum, round), 2);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), 0xd8);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm256_castsi256_si128(packed));
+    }
+    quarterRowsSSE2(r0 + 2 * i, r1 + 2 * i, dst + i, n - i);
+}
+
+const ScaleKernels sse2Kernels = {
+    addRowSSE2,
+    blendRowsSSE2,
+    halveRowSSE2,
+    quarterRowsSSE2
+};
+
+const ScaleKernels avx2Kernels = {
+    addRowAVX2,
+    blendRowsAVX2,
+    halveRowAVX2,
+    quarterRowsAVX2
+};
+#endif // HAVE_X86_KERNELS
+
+#ifdef HAVE_NEON_KERNELS
+void addRowNEON(const uint8_t *src, uint16_t *acc, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(s)));
+        vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(s)));
+    }
+    addRowScalar(src + i, acc + i, n - i);
+}
+
+void blendRowsNEON(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n,
+                   unsigned int f)
+{
+    const uint8x8_t w0 = vdup_n_u8(256 - f);
+    const uint8x8_t w1 = vdup_n_u8(f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t a = vld1q_u8(r0 + i);
+        uint8x16_t b = vld1q_u8(r1 + i);
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(a), w0), vget_low_u8(b), w1);
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(a), w0), vget_high_u8(b), w1);
+        vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+    blendRowsScalar(r0 + i, r1 + i, dst + i, n - i, f);
+}
+
+void halveRowNEON(const uint8_t *src, uint8_t *dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t val = vld2q_u8(src + 2 * i);
+        vst1q_u8(dst + i, vrhaddq_u8(val.val[0], val.val[1]));
+    }
+    halveRowScalar(src + 2 * i, dst + i, n - i);
+}
+
+void quarterRowsNEON(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t sum = vpadalq_u8(vpaddlq_u8(vld1q_u8(r0 + 2 * i)), vld1q_u8(r1 + 2 * i));
+        vst1_u8(dst + i, vrshrn_n_u16(sum, 2));
+    }
+    quarterRowsScalar(r0 + 2 * i, r1 + 2 * i, dst + i, n - i);
+}
+
+const ScaleKernels neonKernels = {
+    addRowNEON,
+    blendRowsNEON,
+    halveRowNEON,
+    quarterRowsNEON
+};
+#endif // HAVE_NEON_KERNELS
+
+// Follows the implementation picked for the conversions.
+const ScaleKernels &kernels()
+{
+    switch (convertGetImplementation()) {
+#ifdef HAVE_X86_KERNELS
+    case ConvertImplSSE2:
+        return sse2Kernels;
+    case ConvertImplAVX2:
+        return avx2Kernels;
+#endif
+#ifdef HAVE_NEON_KERNELS
+    case ConvertImplNEON:
+        return neonKernels;
+#endif
+    default:
+        break;
+    }
+    return scalarKernels;
+}
+
+// Scales one plane of one or two interleaved channels. The tables and
+// scratch rows are set up by configure() and reused for every frame.
+class PlaneScaler
+{
+public:
+    bool configured(ScaleFilter filter, unsigned int srcWidth, unsigned int srcHeight,
+                    unsigned int dstWidth, unsigned int dstHeight,
+                    unsigned int channels) const
+    {
+        return m_filter == filter && m_srcWidth == srcWidth && m_srcHeight == srcHeight
+               && m_dstWidth == dstWidth && m_dstHeight == dstHeight
+               && m_channels == channels;
+    }
+
+    void configure(ScaleFilter filter, unsigned int srcWidth, unsigned int srcHeight,
+                   unsigned int dstWidth, unsigned int dstHeight, unsigned int channels)
+    {
+        m_filter = filter;
+        m_srcWidth = srcWidth;
+        m_srcHeight = srcHeight;
+        m_dstWidth = dstWidth;
+        m_dstHeight = dstHeight;
+        m_channels = channels;
+
+        m_x0.resize(dstWidth);
+        m_xSpan.resize(dstWidth);
+        if (filter == ScaleFilterBox) {
+            // Integer boxes of at least one pixel, the same for every row.
+            for (unsigned int x = 0; x < dstWidth; x++) {
+                unsigned int x0 = (uint64_t)x * srcWidth / dstWidth;
+                unsigned int x1 = (uint64_t)(x + 1) * srcWidth / dstWidth;
+                m_x0[x] = x0;
+                m_xSpan[x] = max(1u, x1 - x0);
+            }
+            // Rows span either boxHeight or boxHeight + 1 pixels.
+            unsigned int boxHeight = max(1u, srcHeight / dstHeight);
+            for (unsigned int i = 0; i < 2; i++) {
+                m_reciprocal[i].resize(dstWidth);
+                for (unsigned int x = 0; x < dstWidth; x++) {
+                    unsigned int area = m_xSpan[x] * (boxHeight + i);
+                    m_reciprocal[i][x] = (65536 + area / 2) / area;
+                }
+            }
+            m_boxHeight = boxHeight;
+            m_acc.resize((size_t)srcWidth * channels);
+        } else {
+            // Pixel centers are aligned, m_xSpan holds the weight of the
+            // right neighbour in 1/256.
+            for (unsigned int x = 0; x < dstWidth; x++) {
+                unsigned int x0;
+                unsigned int f;
+                position(x, srcWidth, dstWidth, x0, f);
+                m_x0[x] = x0;
+                m_xSpan[x] = f;
+            }
+        }
+        m_row.resize((size_t)srcWidth * channels);
+    }
+
+    void run(const ScaleKernels &k, const uint8_t *src, unsigned int srcStride,
+             uint8_t *dst, unsigned int dstStride)
+    {
+        for (unsigned int y = 0; y < m_dstHeight; y++) {
+            if (m_filter == ScaleFilterBox) {
+                boxRow(k, src, srcStride, y, dst + (size_t)y * dstStride);
+            } else {
+                bilinearRow(k, src, srcStride, y, dst + (size_t)y * dstStride);
+            }
+        }
+    }
+
+private:
+    static void position(unsigned int dst, unsigned int srcSize, unsigned int dstSize,
+                         unsigned int &index, unsigned int &fraction)
+    {
+        // Source position of the destination pixel center in 1/256.
+        int64_t pos = ((2 * (int64_t)dst + 1) * srcSize * 256) / (2 * dstSize) - 128;
+        if (pos < 0) {
+            pos = 0;
+        }
+        index = pos >> 8;
+        fraction = pos & 0xff;
+        if (index >= srcSize - 1) {
+            index = srcSize - 1;
+            fraction = 0;
+        }
+    }
+
+    void boxRow(const ScaleKernels &k, const uint8_t *src, unsigned int srcStride,
+                unsigned int y, uint8_t *out)
+    {
+        unsigned int y0 = (uint64_t)y * m_srcHeight / m_dstHeight;
+        unsigned int y1 = (uint64_t)(y + 1) * m_srcHeight / m_dstHeight;
+        unsigned int boxHeight = max(1u, y1 - y0);
+        size_t rowSize = (size_t)m_srcWidth * m_channels;
+
+        if (boxHeight == 2 && m_channels == 1 && m_srcWidth == 2 * m_dstWidth) {
+            const uint8_t *row = src + (size_t)y0 * srcStride;
+            k.quarterRows(row, row + srcStride, out, m_dstWidth);
+            return;
+        }
+
+        memset(m_acc.data(), 0, rowSize * sizeof(uint16_t));
+        for (unsigned int i = 0; i < boxHeight; i++) {
+            k.addRow(src + (size_t)(y0 + i) * srcStride, m_acc.data(), rowSize);
+        }
+
+        const uint32_t *reciprocal = m_reciprocal[boxHeight > m_boxHeight].data();
+        if (m_channels == 1) {
+            boxColumns<1>(reciprocal, out);
+        } else {
+            boxColumns<2>(reciprocal, out);
+        }
+    }
+
+    template <unsigned int C>
+    void boxColumns(const uint32_t *reciprocal, uint8_t *out) const
+    {
+        for (unsigned int x = 0; x < m_dstWidth; x++) {
+            const uint16_t *acc = m_acc.data() + (size_t)m_x0[x] * C;
+            const unsigned int span = m_xSpan[x];
+            for (unsigned int ch = 0; ch < C; ch++) {
+                uint32_t sum = 0;
+                for (unsigned int i = 0; i < span; i++) {
+                    sum += acc[i * C + ch];
+                }
+                out[x * C + ch] = min(255u, (sum * reciprocal[x] + 32768) >> 16);
+            }
+        }
+    }
+
+    void bilinearRow(const ScaleKernels &k, const uint8_t *src, unsigned int srcStride,
+                     unsigned int y, uint8_t *out)
+    {
+        unsigned int y0;
+        unsigned int f;
+        position(y, m_srcHeight, m_dstHeight, y0, f);
+        size_t rowSize = (size_t)m_srcWidth * m_channels;
+        const uint8_t *row = src + (size_t)y0 * srcStride;
+
+        if (f) {
+            k.blendRows(row, row + srcStride, m_row.data(), rowSize, f);
+            row = m_row.data();
+        }
+
+        if (m_srcWidth == m_dstWidth) {
+            memcpy(out, row, rowSize);
+        } else if (m_channels == 1 && m_srcWidth == 2 * m_dstWidth) {
+            k.halveRow(row, out, m_dstWidth);
+        } else if (m_channels == 1) {
+            bilinearColumns<1>(row, out);
+        } else {
+            bilinearColumns<2>(row, out);
+        }
+    }
+
+    template <unsigned int C>
+    void bilinearColumns(const uint8_t *row, uint8_t *out) const
+    {
+        for (unsigned int x = 0; x < m_dstWidth; x++) {
+            const uint8_t *p = row + (size_t)m_x0[x] * C;
+            const unsigned int fx = m_xSpan[x];
+            // The right neighbour is only read when it has a weight.
+            const uint8_t *q = fx ? p + C : p;
+            for (unsigned int ch = 0; ch < C; ch++) {
+                out[x * C + ch] = (p[ch] * (256 - fx) + q[ch] * fx + 128) >> 8;
+            }
+        }
+    }
+
+    ScaleFilter m_filter = ScaleFilterBox;
+    unsigned int m_srcWidth = 0;
+    unsigned int m_srcHeight = 0;
+    unsigned int m_dstWidth = 0;
+    unsigned int m_dstHeight = 0;
+    unsigned int m_channels = 0;
+    unsigned int m_boxHeight = 0;
+    vector<unsigned int> m_x0;
+    vector<unsigned int> m_xSpan;
+    vector<uint32_t> m_reciprocal[2];
+    vector<uint16_t> m_acc;
+    vector<uint8_t> m_row;
+};
+
+} // namespace
+
+class YCbCrScaler
+{
+public:
+    explicit YCbCrScaler(ScaleFilter filter)
+        : m_filter(filter)
+    {
+    }
+
+    bool scale(const YCbCrFrame &src, const YCbCrFrame &dst);
+
+private:
+    void configure(PlaneScaler &scaler, unsigned int srcWidth, unsigned int srcHeight,
+                   unsigned int dstWidth, unsigned int dstHeight, unsigned int channels)
+    {
+        if (!scaler.configured(m_filter, srcWidth, srcHeight, dstWidth, dstHeight, channels)) {
+            scaler.configure(m_filter, srcWidth, srcHeight, dstWidth, dstHeight, channels);
+        }
+    }
+
+    uint8_t *scratch(size_t size)
+    {
+        if (m_scratch.size() < size) {
+            m_scratch.resize(size);
+        }
+        return m_scratch.data();
+    }
+
+    ScaleFilter m_filter;
+    PlaneScaler m_luma;
+    PlaneScaler m_chroma;
+    // Chroma planes when the source and destination layouts differ
+    vector<uint8_t> m_scratch;
+};
+
+bool YCbCrScaler::scale(const YCbCrFrame &src, const YCbCrFrame &dst)
+{
+    if (!src.y || !src.cb || !src.cr || !dst.y || !dst.cb || !dst.cr
+            || !src.width || !src.height || !dst.width || !dst.height) {
+        LOGE("Invalid frame");
+        return false;
+    }
+    // The box sums are 16 bits wide.
+    if (src.height / dst.height > 256) {
+        LOGE("Cannot scale " << src.height << " rows down to " << dst.height);
+        return false;
+    }
+
+    const bool srcPlanar = src.chromaStep == 1;
+    const bool dstPlanar = dst.chromaStep == 1;
+    const bool srcCbFirst = src.chromaStep == 2 && src.cr == src.cb + 1;
+    const bool srcCrFirst = src.chromaStep == 2 && src.cb == src.cr + 1;
+    const bool dstCbFirst = dst.chromaStep == 2 && dst.cr == dst.cb + 1;
+    const bool dstCrFirst = dst.chromaStep == 2 && dst.cb == dst.cr + 1;
+    if (!(srcPlanar || srcCbFirst || srcCrFirst) || !(dstPlanar || dstCbFirst || dstCrFirst)) {
+        LOGE("Unsupported chroma layout");
+        return false;
+    }
+
+    const ScaleKernels &k = kernels();
+    const unsigned int srcCWidth = (src.width + 1) / 2;
+    const unsigned int srcCHeight = (src.height + 1) / 2;
+    const unsigned int dstCWidth = (dst.width + 1) / 2;
+    const unsigned int dstCHeight = (dst.height + 1) / 2;
+    uint8_t *dstY = const_cast<uint8_t *>(dst.y);
+    uint8_t *dstCb = const_cast<uint8_t *>(dst.cb);
+    uint8_t *dstCr = const_cast<uint8_t *>(dst.cr);
+
+    configure(m_luma, src.width, src.height, dst.width, dst.height, 1);
+    m_luma.run(k, src.y, src.yStride, dstY, dst.yStride);
+
+    if (srcPlanar) {
+        configure(m_chroma, srcCWidth, srcCHeight, dstCWidth, dstCHeight, 1);
+        if (dstPlanar) {
+            m_chroma.run(k, src.cb, src.cStride, dstCb, dst.cStride);
+            m_chroma.run(k, src.cr, src.cStride, dstCr, dst.cStride);
+        } else {
+            uint8_t *cb = scratch((size_t)dstCWidth * dstCHeight * 2);
+            uint8_t *cr = cb + (size_t)dstCWidth * dstCHeight;
+            m_chroma.run(k, src.cb, src.cStride, cb, dstCWidth);
+            m_chroma.run(k, src.cr, src.cStride, cr, dstCWidth);
+            if (dstCbFirst) {
+                interleavePlanes(cb, dstCWidth, cr, dstCWidth, dstCb, dst.cStride,
+                                 dstCWidth, dstCHeight);
+            } else {
+                interleavePlanes(cr, dstCWidth, cb, dstCWidth, dstCr, dst.cStride,
+                                 dstCWidth, dstCHeight);
+            }
+        }
+        return true;
+    }
+
+    // Both interleaved channels are scaled in one go.
+    configure(m_chroma, srcCWidth, srcCHeight, dstCWidth, dstCHeight, 2);
+    const uint8_t *srcC = min(src.cb, src.cr);
+    if ((srcCbFirst && dstCbFirst) || (srcCrFirst && dstCrFirst)) {
+        m_chroma.run(k, srcC, src.cStride, min(dstCb, dstCr), dst.cStride);
+        return true;
+    }
+
+    unsigned int stride = dstCWidth * 2;
+    uint8_t *c = scratch((size_t)stride * dstCHeight);
+    m_chroma.run(k, srcC, src.cStride, c, stride);
+    uint8_t *first = srcCbFirst ? dstCb : dstCr;
+    uint8_t *second = srcCbFirst ? dstCr : dstCb;
+    if (dstPlanar) {
+        deinterleavePlane(c, stride, first, dst.cStride, second, dst.cStride,
+                          dstCWidth, dstCHeight);
+    } else {
+        copyPlaneStep(c, stride, 2, first, dst.cStride, 2, dstCWidth, dstCHeight);
+        copyPlaneStep(c + 1, stride, 2, second, dst.cStride, 2, dstCWidth, dstCHeight);
+    }
+    return true;
+}
+
+bool scaleYCbCrFrame(const YCbCrFrame &src, const YCbCrFrame &dst, ScaleFilter filter)
+{
+    YCbCrScaler scaler(filter);
+    return scaler.scale(src, dst);
+}
+
+namespace {
+
+// A scaled frame holding its pooled buffer
+struct ScaledFrame : public YCbCrFrame {
+    ScaledFrame(const YCbCrFrame &layout, BufferPool::Buffer *buffer)
+        : YCbCrFrame(layout)
+        , buffer(buffer)
+    {
+    }
+
+    ~ScaledFrame()
+    {
+        BufferPool::Buffer::release(buffer);
+    }
+
+    BufferPool::Buffer *buffer;
+};
+
+// Scaled frames in flight before the pool grows
+const unsigned int SCALER_POOL_BUFFERS = 3;
+
+} // namespace
+
+FrameScaler::FrameScaler(unsigned int width, unsigned int height,
+                         ScaleFormat format, ScaleFilter filter)
+    : m_width(width)
+    , m_height(height)
+    , m_format(format)
+    , m_frameSize(yuv420BufferSize(width, height))
+    , m_scaler(make_shared<YCbCrScaler>(filter))
+    , m_bufferPool(BufferPool::create(m_frameSize, SCALER_POOL_BUFFERS))
+    , m_framePool(ObjectPool::create())
+{
+}
+
+shared_ptr<const YCbCrFrame> FrameScaler::scale(const YCbCrFrame &src)
+{
+    BufferPool::Buffer *buffer = m_bufferPool->acquire(m_frameSize);
+    YCbCrFrame layout = m_format == ScaleToNV12
+                        ? makeNV12Layout(buffer->data(), m_width, m_height)
+                        : makeI420Layout(buffer->data(), m_width, m_height);
+    if (!m_scaler->scale(src, layout)) {
+        BufferPool::Buffer::release(buffer);
+        return nullptr;
+    }
+    layout.timestampUs = src.timestampUs;
+    return allocateShared<ScaledFrame>(m_framePool, layout, buffer);
+}
+
+BufferPoolStats FrameScaler::poolStats()
+{
+    return m_bufferPool->stats();
+}
+
+} // namespace camera
+
+namespace codec {
+
+using namespace std;
+using namespace gecko::camera;
+
+ScalingVideoEncoder::ScalingVideoEncoder(shared_ptr<VideoEncoder> encoder, ScaleFilter filter)
+    : m_encoder(move(encoder))
+    , m_filter(filter)
+{
+    m_encoder->setListener(this);
+}
+
+bool ScalingVideoEncoder::init(VideoEncoderMetadata metadata)
+{
+    // Ask again whether to pass references, now that our listener is known.
+    m_encoder->setListener(this);
+    if (!m_encoder->init(metadata)) {
+        return false;
+    }
+    m_scaler = make_unique<FrameScaler>(metadata.width, metadata.height,
+                                        ScaleToI420, m_filter);
+    return true;
+}
+
+bool ScalingVideoEncoder::encode(shared_ptr<const YCbCrFrame> frame, bool forceSync)
+{
+    if (!m_scaler) {
+        LOGE("Encoder is not initialized");
+        return false;
+    }
+    if (frame->width == m_scaler->width() && frame->height == m_scaler->height()) {
+        return m_encoder->encode(move(frame), forceSync);
+    }
+    shared_ptr<const YCbCrFrame> scaled = m_scaler->scale(*frame);
+    // Release the source, e.g. a camera buffer, as early as possible.
+    frame.reset();
+    return scaled && m_encoder->encode(move(scaled), forceSync);
+}
+
+bool ScalingVideoEncoder::getStats(VideoEncoderStats &stats)
+{
+    return m_encoder->getStats(stats);
+}
+
+RateUpdate ScalingVideoEncoder::setRates(int bitrate, int framerate)
+{
+    return m_encoder->setRates(bitrate, framerate);
+}
+
+void ScalingVideoEncoder::requestKeyFrame()
+{
+    m_encoder->requestKeyFrame();
+}
+
+// The inner encoder decided in init() whether to pass references, our
+// listener may have been set or changed since. Frames are copied into
+// references or passed as data as the current listener wants them.
+void ScalingVideoEncoder::onEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs,
+                                         FrameType frameType)
+{
+    deliverEncodedFrame(data, size, timestampUs, frameType);
+}
+
+bool ScalingVideoEncoder::wantsEncodedFrameRefs()
+{
+    return m_encoderListener && m_encoderListener->wantsEncodedFrameRefs();
+}
+
+void ScalingVideoEncoder::onEncodedFrameRef(shared_ptr<const EncodedFrame> frame)
+{
+    VideoEncoderListener *listener = m_encoderListener;
+    if (!listener) {
+        return;
+    }
+    if (listener->wantsEncodedFrameRefs()) {
+        listener->onEncodedFrameRef(move(frame));
+    } else {
+        listener->onEncodedFrame(const_cast<uint8_t *>(frame->data), frame->size,
+                                 frame->timestampUs, frame->frameType);
+    }
+}
+
+void ScalingVideoEncoder::onEncoderError(string errorDescription)
+{
+    if (m_encoderListener) {
+        m_encoderListener->onEncoderError(errorDescription);
+    }
+}
+
+} // namespace codec
+} // namespace gecko
+
+/* vim: set ts=4 et sw=4 tw=80: */
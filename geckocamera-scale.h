@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GECKOCAMERA_SCALE__
+#define __GECKOCAMERA_SCALE__
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <memory>
+
+#include "geckocamera.h"
+#include "geckocamera-codec.h"
+#include "geckocamera-pool.h"
+
+namespace gecko {
+namespace camera {
+
+enum ScaleFilter {
+    // Averages all source pixels covered by the destination pixel. The
+    // better choice for downscaling by more than 2.
+    ScaleFilterBox = 0,
+    // Interpolates the nearest 2x2 source pixels.
+    ScaleFilterBilinear
+};
+
+enum ScaleFormat {
+    ScaleToI420 = 0,
+    ScaleToNV12
+};
+
+class YCbCrScaler;
+
+// Scale src into the memory described by dst, which may have any size.
+// Accepts the same layouts as convertYCbCrFrame() and uses the kernels
+// picked with convertSetImplementation(). Allocates scratch memory on
+// every call, use FrameScaler on the frame path.
+bool scaleYCbCrFrame(const YCbCrFrame &src, const YCbCrFrame &dst,
+                     ScaleFilter filter = ScaleFilterBox);
+
+// Scales frames into pooled frames of a fixed size and format. Doesn't
+// allocate once the pools are warm and the source size is stable. Not
+// thread safe, the returned frames can be used from any thread.
+class FrameScaler
+{
+public:
+    FrameScaler(unsigned int width, unsigned int height,
+                ScaleFormat format = ScaleToI420,
+                ScaleFilter filter = ScaleFilterBox);
+
+    unsigned int width() const
+    {
+        return m_width;
+    }
+
+    unsigned int height() const
+    {
+        return m_height;
+    }
+
+    // Returns nullptr if the source layout is not supported.
+    std::shared_ptr<const YCbCrFrame> scale(const YCbCrFrame &src);
+
+    BufferPoolStats poolStats();
+
+private:
+    unsigned int m_width;
+    unsigned int m_height;
+    ScaleFormat m_format;
+    size_t m_frameSize;
+    std::shared_ptr<YCbCrScaler> m_scaler;
+    std::shared_ptr<BufferPool> m_bufferPool;
+    std::shared_ptr<ObjectPool> m_framePool;
+};
+
+} // namespace camera
+
+namespace codec {
+
+// Encodes at the size given to init() whatever the size of the frames
+// passed to encode(), by scaling them on the calling thread first. Wraps
+// the encoder of a CodecManager, e.g. to send 480x270 from a 1280x720
+// capture. The listener is to be set before init().
+class ScalingVideoEncoder : public VideoEncoder, private VideoEncoderListener
+{
+public:
+    ScalingVideoEncoder(std::shared_ptr<VideoEncoder> encoder,
+                        gecko::camera::ScaleFilter filter = gecko::camera::ScaleFilterBox);
+
+    bool init(VideoEncoderMetadata metadata) override;
+    bool encode(std::shared_ptr<const gecko::camera::YCbCrFrame> frame,
+                bool forceSync) override;
+    bool getStats(VideoEncoderStats &stats) override;
+    RateUpdate setRates(int bitrate, int framerate) override;
+    void requestKeyFrame() override;
+
+private:
+    void onEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs,
+                        FrameType frameType) override;
+    void onEncoderError(std::string errorDescription) override;
+    bool wantsEncodedFrameRefs() override;
+    void onEncodedFrameRef(std::shared_ptr<const EncodedFrame> frame) override;
+
+    std::shared_ptr<VideoEncoder> m_encoder;
+    gecko::camera::ScaleFilter m_filter;
+    std::unique_ptr<gecko::camera::FrameScaler> m_scaler;
+};
+
+} // namespace codec
+} // namespace gecko
+
+#endif // __GECKOCAMERA_SCALE__
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "geckocamera-simulcast.h"
+
+#define LOG_TOPIC "simulcast"
+#include "geckocamera-utils.h"
+
+namespace gecko {
+namespace codec {
+
+using namespace std;
+using namespace gecko::camera;
+
+class SimulcastLayerEncoder : private VideoEncoderListener
+{
+public:
+    SimulcastLayerEncoder(SimulcastEncoder *owner, unsigned int index,
+                          const SimulcastLayer &layer)
+        : m_owner(owner)
+        , m_index(index)
+        , m_layer(layer)
+        , m_frameIntervalUs(layer.framerate > 0 ? 1000000 / layer.framerate : 0)
+    {
+    }
+
+    ~SimulcastLayerEncoder()
+    {
+        stop();
+    }
+
+    bool start(CodecType codecType, int framerate, ScaleFilter filter);
+    void stop();
+    RateUpdate setRates(int bitrate, int framerate);
+    void requestKeyFrame()
+    {
+        if (m_encoder) {
+            m_encoder->requestKeyFrame();
+        }
+    }
+
+    bool active() const
+    {
+        return (bool)m_encoder;
+    }
+
+    unsigned int width() const
+    {
+        return m_layer.width;
+    }
+
+    unsigned int height() const
+    {
+        return m_layer.height;
+    }
+
+    // Called for every input frame to keep the layer frame rate. A key
+    // frame requested on a skipped frame goes to the next one.
+    bool accept(uint64_t timestampUs, bool forceSync);
+    bool accepted() const
+    {
+        return m_accepted;
+    }
+    shared_ptr<const YCbCrFrame> scale(const YCbCrFrame &frame)
+    {
+        return m_scaler->scale(frame);
+    }
+    void push(shared_ptr<const YCbCrFrame> frame);
+
+    void getStats(SimulcastLayerStats &stats) const;
+
+private:
+    void loop();
+
+    void onEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs,
+                        FrameType frameType) override;
+    void onEncoderError(string errorDescription) override;
+    bool wantsEncodedFrameRefs() override;
+    void onEncodedFrameRef(shared_ptr<const EncodedFrame> frame) override;
+
+    SimulcastEncoder *m_owner;
+    unsigned int m_index;
+    SimulcastLayer m_layer;
+    shared_ptr<VideoEncoder> m_encoder;
+    // Only used by the thread calling encode()
+    unique_ptr<FrameScaler> m_scaler;
+    int m_inputFramerate = 0;
+    atomic<uint64_t> m_frameIntervalUs;
+    uint64_t m_nextTimestampUs = 0;
+    bool m_syncRequested = false;
+    bool m_accepted = false;
+
+    atomic<uint64_t> m_framesEncoded = 0;
+    atomic<uint64_t> m_bytesEncoded = 0;
+    atomic<uint64_t> m_framesDropped = 0;
+    atomic<uint64_t> m_framesSkipped = 0;
+
+    mutex m_mutex;
+    condition_variable m_cond;
+    shared_ptr<const YCbCrFrame> m_pending;
+    bool m_pendingSync = false;
+    bool m_quit = false;
+    thread m_thread;
+};
+
+bool SimulcastLayerEncoder::start(CodecType codecType, int framerate, ScaleFilter filter)
+{
+    shared_ptr<VideoEncoder> encoder;
+    if (!m_owner->m_codecManager->createVideoEncoder(codecType, encoder)) {
+        return false;
+    }
+
+    VideoEncoderMetadata meta;
+    meta.codecType = codecType;
+    meta.width = m_layer.width;
+    meta.height = m_layer.height;
+    meta.stride = m_layer.width;
+    meta.sliceHeight = m_layer.height;
+    meta.bitrate = m_layer.bitrate;
+    meta.framerate = m_layer.framerate > 0 ? min(m_layer.framerate, framerate) : framerate;
+    meta.keyFrameIntervalMs = m_layer.keyFrameIntervalMs;
+    meta.intraRefreshFrames = m_layer.intraRefreshFrames;
+    encoder->setListener(this);
+    if (!encoder->init(meta)) {
+        return false;
+    }
+
+    m_encoder = encoder;
+    m_inputFramerate = framerate;
+    m_scaler = make_unique<FrameScaler>(m_layer.width, m_layer.height, ScaleToI420, filter);
+    m_quit = false;
+    m_thread = thread(&SimulcastLayerEncoder::loop, this);
+    return true;
+}
+
+void SimulcastLayerEncoder::stop()
+{
+    if (m_thread.joinable()) {
+        {
+            scoped_lock lock(m_mutex);
+            m_quit = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    }
+    m_pending.reset();
+    // Stops the encoder thread, nothing is reported after this.
+    m_encoder.reset();
+}
+
+RateUpdate SimulcastLayerEncoder::setRates(int bitrate, int framerate)
+{
+    if (!m_encoder || framerate < 0) {
+        return RateUpdateFailed;
+    }
+    RateUpdate result = m_encoder->setRates(bitrate, framerate > 0
+                                            ? min(framerate, m_inputFramerate)
+                                            : m_inputFramerate);
+    if (result != RateUpdateFailed) {
+        m_frameIntervalUs = framerate > 0 ? 1000000 / framerate : 0;
+    }
+    return result;
+}
+
+bool SimulcastLayerEncoder::accept(uint64_t timestampUs, bool forceSync)
+{
+    const uint64_t frameIntervalUs = m_frameIntervalUs;
+    m_syncRequested |= forceSync;
+    m_accepted = true;
+    if (!frameIntervalUs) {
+        return true;
+    }
+    // Allow some jitter, e.g. to take every other frame of 30 fps for 15.
+    if (m_nextTimestampUs && timestampUs + frameIntervalUs / 4 < m_nextTimestampUs) {
+        m_framesSkipped++;
+        m_accepted = false;
+    } else if (timestampUs < m_nextTimestampUs + frameIntervalUs) {
+        m_nextTimestampUs += frameIntervalUs;
+    } else {
+        m_nextTimestampUs = timestampUs + frameIntervalUs;
+    }
+    return m_accepted;
+}
+
+void SimulcastLayerEncoder::push(shared_ptr<const YCbCrFrame> frame)
+{
+    bool sync = m_syncRequested;
+    m_syncRequested = false;
+    {
+        scoped_lock lock(m_mutex);
+        if (m_pending) {
+            m_framesDropped++;
+        }
+        // The replaced frame goes back to its pool outside of the lock.
+        m_pending.swap(frame);
+        m_pendingSync |= sync;
+    }
+    m_cond.notify_one();
+}
+
+void SimulcastLayerEncoder::loop()
+{
+    for (;;) {
+        shared_ptr<const YCbCrFrame> frame;
+        bool sync;
+        {
+            unique_lock lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_pending || m_quit; });
+            if (m_quit) {
+                return;
+            }
+            frame.swap(m_pending);
+            sync = m_pendingSync;
+            m_pendingSync = false;
+        }
+        // May block while the encoder queue is full, newer frames replace
+        // the pending one meanwhile.
+        if (!m_encoder->encode(move(frame), sync)) {
+            m_framesDropped++;
+        }
+    }
+}
+
+void SimulcastLayerEncoder::getStats(SimulcastLayerStats &stats) const
+{
+    stats.width = m_layer.width;
+    stats.height = m_layer.height;
+    stats.active = active();
+    stats.framesEncoded = m_framesEncoded;
+    stats.bytesEncoded = m_bytesEncoded;
+    stats.framesDropped = m_framesDropped;
+    stats.framesSkipped = m_framesSkipped;
+}
+
+void SimulcastLayerEncoder::onEncodedFrame(uint8_t *data, size_t size, uint64_t timestampUs,
+                                           FrameType frameType)
+{
+    m_framesEncoded++;
+    m_bytesEncoded += size;
+    SimulcastEncoderListener *listener = m_owner->m_listener;
+    if (listener) {
+        listener->onEncodedFrame(m_index, data, size, timestampUs, frameType);
+    }
+}
+
+bool SimulcastLayerEncoder::wantsEncodedFrameRefs()
+{
+    return m_owner->m_listener && m_owner->m_listener->wantsEncodedFrameRefs();
+}
+
+void SimulcastLayerEncoder::onEncodedFrameRef(shared_ptr<const EncodedFrame> frame)
+{
+    m_framesEncoded++;
+    m_bytesEncoded += frame->size;
+    SimulcastEncoderListener *listener = m_owner->m_listener;
+    if (listener) {
+        listener->onEncodedFrameRef(m_index, move(frame));
+    }
+}
+
+void SimulcastLayerEncoder::onEncoderError(string errorDescription)
+{
+    SimulcastEncoderListener *listener = m_owner->m_listener;
+    if (listener) {
+        listener->onEncoderError(m_index, errorDescription);
+    }
+}
+
+SimulcastEncoder::SimulcastEncoder(CodecManager *codecManager, ScaleFilter filter)
+    : m_codecManager(codecManager)
+    , m_filter(filter)
+{
+}
+
+SimulcastEncoder::~SimulcastEncoder()
+{
+    stop();
+}
+
+void SimulcastEncoder::stop()
+{
+    for (auto &layer : m_layers) {
+        layer->stop();
+    }
+    m_pyramid.clear();
+}
+
+unsigned int SimulcastEncoder::init(CodecType codecType, const vector<SimulcastLayer> &layers)
+{
+    stop();
+    m_layers.clear();
+
+    int framerate = 0;
+    for (unsigned int i = 0; i < layers.size(); i++) {
+        if (layers[i].width <= 0 || layers[i].height <= 0) {
+            LOGE("Invalid layer " << i);
+            return 0;
+        }
+        m_layers.push_back(make_shared<SimulcastLayerEncoder>(this, i, layers[i]));
+        framerate = max(framerate, layers[i].framerate);
+    }
+    if (!framerate) {
+        framerate = 30;
+    }
+
+    vector<SimulcastLayerEncoder *> bySize;
+    for (auto &layer : m_layers) {
+        bySize.push_back(layer.get());
+    }
+    stable_sort(bySize.begin(), bySize.end(),
+    [](const SimulcastLayerEncoder * a, const SimulcastLayerEncoder * b) {
+        return a->width() * a->height() > b->width() * b->height();
+    });
+
+    // The smallest layers are the ones every receiver can take, so they
+    // get the encoder instances first. Once the codec refuses one, the
+    // larger layers won't fit either.
+    for (auto it = bySize.rbegin(); it != bySize.rend(); it++) {
+        if (!(*it)->start(codecType, framerate, m_filter)) {
+            LOGI("Cannot create an encoder for " << (*it)->width() << "x" << (*it)->height()
+                 << ", leaving out " << (bySize.rend() - it) << " layers");
+            break;
+        }
+    }
+    for (SimulcastLayerEncoder *layer : bySize) {
+        if (layer->active()) {
+            m_pyramid.push_back(layer);
+        }
+    }
+    LOGI("Encoding " << m_pyramid.size() << " of " << m_layers.size() << " layers");
+    return m_pyramid.size();
+}
+
+bool SimulcastEncoder::encode(shared_ptr<const YCbCrFrame> frame, bool forceSync)
+{
+    if (m_pyramid.empty()) {
+        LOGE("Encoder is not initialized");
+        return false;
+    }
+
+    // Frame rate decisions first, the smallest layer taking the frame is
+    // where the scaling can stop.
+    int last = -1;
+    for (unsigned int i = 0; i < m_pyramid.size(); i++) {
+        if (m_pyramid[i]->accept(frame->timestampUs, forceSync)) {
+            last = i;
+        }
+    }
+
+    // Each layer is scaled from the previous one, which is no smaller.
+    bool queued = false;
+    shared_ptr<const YCbCrFrame> source = move(frame);
+    for (int i = 0; i <= last; i++) {
+        SimulcastLayerEncoder *layer = m_pyramid[i];
+        if (source->width != layer->width() || source->height != layer->height()) {
+            shared_ptr<const YCbCrFrame> scaled = layer->scale(*source);
+            if (!scaled) {
+                break;
+            }
+            source = move(scaled);
+        }
+        if (layer->accepted()) {
+            layer->push(source);
+            queued = true;
+        }
+    }
+    return queued;
+}
+
+RateUpdate SimulcastEncoder::setLayerRates(unsigned int layer, int bitrate, int framerate)
+{
+    if (layer >= m_layers.size()) {
+        LOGE("No layer " << layer);
+        return RateUpdateFailed;
+    }
+    return m_layers[layer]->setRates(bitrate, framerate);
+}
+
+void SimulcastEncoder::requestKeyFrame(int layer)
+{
+    for (unsigned int i = 0; i < m_layers.size(); i++) {
+        if (layer < 0 || (unsigned int)layer == i) {
+            m_layers[i]->requestKeyFrame();
+        }
+    }
+}
+
+vector<SimulcastLayerStats> SimulcastEncoder::getStats()
+{
+    vector<SimulcastLayerStats> stats(m_layers.size());
+    for (unsigned int i = 0; i < m_layers.size(); i++) {
+        m_layers[i]->getStats(stats[i]);
+    }
+    return stats;
+}
+
+} // namespace codec
+} // namespace gecko
+
+/* vim: set ts=4 et sw=4 tw=80: */
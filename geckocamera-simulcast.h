@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GECKOCAMERA_SIMULCAST__
+#define __GECKOCAMERA_SIMULCAST__
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "geckocamera-codec.h"
+#include "geckocamera-scale.h"
+
+namespace gecko {
+namespace codec {
+
+struct SimulcastLayer {
+    int width;
+    int height;
+    int bitrate;
+    // 0 encodes every input frame, lower rates skip frames.
+    int framerate;
+    // See VideoEncoderMetadata
+    int keyFrameIntervalMs = 0;
+    int intraRefreshFrames = 0;
+};
+
+struct SimulcastLayerStats {
+    int width;
+    int height;
+    // False if no encoder could be created for the layer
+    bool active;
+    uint64_t framesEncoded;
+    uint64_t bytesEncoded;
+    // Frames replaced by a newer one before the encoder took them, or
+    // refused by the encoder
+    uint64_t framesDropped;
+    // Frames left out to reach the layer frame rate
+    uint64_t framesSkipped;
+};
+
+class SimulcastEncoderListener
+{
+public:
+    virtual ~SimulcastEncoderListener() = default;
+    // Called from the encoder threads, the layer is an index into the
+    // list given to init().
+    virtual void onEncodedFrame(unsigned int layer,
+                                uint8_t *data,
+                                size_t size,
+                                uint64_t timestampUs,
+                                FrameType frameType) = 0;
+    virtual void onEncoderError(unsigned int layer, std::string errorDescription) = 0;
+
+    // See VideoEncoderListener, asked by SimulcastEncoder::init().
+    virtual bool wantsEncodedFrameRefs()
+    {
+        return false;
+    }
+    virtual void onEncodedFrameRef(unsigned int layer, std::shared_ptr<const EncodedFrame> frame)
+    {
+        (void)layer;
+        (void)frame;
+    }
+};
+
+class SimulcastLayerEncoder;
+
+// Encodes one frame stream into several layers of different sizes. The
+// frames are scaled once per layer, each layer from the next larger one,
+// on the thread calling encode(). Every layer then has its own thread
+// handing the latest frame to its encoder, so a slow layer drops frames
+// instead of holding back the others. Layers for which no encoder can be
+// created are left out, largest first.
+class SimulcastEncoder
+{
+public:
+    SimulcastEncoder(CodecManager *codecManager,
+                     gecko::camera::ScaleFilter filter = gecko::camera::ScaleFilterBox);
+    ~SimulcastEncoder();
+
+    void setListener(SimulcastEncoderListener *listener)
+    {
+        m_listener = listener;
+    }
+
+    // Returns the number of active layers, 0 if none could be created.
+    unsigned int init(CodecType codecType, const std::vector<SimulcastLayer> &layers);
+    // Returns false if the frame was not queued to any layer.
+    bool encode(std::shared_ptr<const gecko::camera::YCbCrFrame> frame, bool forceSync);
+    // Changes the rates of one layer, see VideoEncoder::setRates(). A
+    // framerate of 0 encodes every input frame again.
+    RateUpdate setLayerRates(unsigned int layer, int bitrate, int framerate);
+    // Requests a key frame on one layer, or on all of them with -1.
+    void requestKeyFrame(int layer = -1);
+    std::vector<SimulcastLayerStats> getStats();
+
+private:
+    friend class SimulcastLayerEncoder;
+
+    void stop();
+
+    CodecManager *m_codecManager;
+    gecko::camera::ScaleFilter m_filter;
+    SimulcastEncoderListener *m_listener = nullptr;
+    // In the order given to init()
+    std::vector<std::shared_ptr<SimulcastLayerEncoder>> m_layers;
+    // Active layers from the largest to the smallest
+    std::vector<SimulcastLayerEncoder *> m_pyramid;
+};
+
+} // namespace codec
+} // namespace gecko
+
+#endif // __GECKOCAMERA_SIMULCAST__
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -20,6 +20,7 @@
 #define __GECKO_CAMERA_UTILS_H__
 
 #include <iostream>
+#include <string>
 
 namespace gecko {
 namespace camera {
@@ -32,6 +33,11 @@ enum LogLevel {
 
 void LogInit(std::string logTag, enum LogLevel logLevel);
 
+// Path of a file in the per-user cache directory, empty if there is none.
+std::string cacheFilePath(const std::string &name);
+// Replaces the file atomically, other processes may be reading it.
+bool writeCacheFile(const std::string &path, const std::string &contents);
+
 #ifndef LOG_TOPIC
 #define LOG_TOPIC "main"
 #endif /* LOG_TOPIC */
@@ -17,12 +17,17 @@
  */
 
 #include <dlfcn.h>
+#include <algorithm>
+#include <atomic>
 #include <vector>
 #include <cstring>
 #include <map>
+#include <thread>
 
 #include "geckocamera.h"
 #include "geckocamera-plugins.h"
+
+#define LOG_TOPIC "camera"
 #include "geckocamera-utils.h"
 
 namespace gecko {
@@ -34,15 +39,27 @@ class RootCameraManager : public CameraManager
 {
 public:
     RootCameraManager() {}
-    ~RootCameraManager() {}
+    ~RootCameraManager();
 
     bool init() override;
     int getNumberOfCameras() override;
     bool getCameraInfo(unsigned int num, CameraInfo &info) override;
     bool queryCapabilities(const string &cameraId, vector<CameraCapability> &caps) override;
     bool openCamera(const string &cameraId, shared_ptr<Camera> &camera) override;
+    bool queryAllCapabilities(CapabilityListener *listener) override;
+    bool setStandbyCameras(unsigned int count) override;
+    bool switchCamera(shared_ptr<Camera> &camera, const string &cameraId,
+                      const CameraCapability &cap) override;
 
 private:
+    // The cameras of one plugin waiting to be probed
+    struct CapabilityProbe {
+        shared_ptr<CameraManager> plugin;
+        vector<string> cameraIds;
+        atomic<unsigned int> next = 0;
+    };
+
+    void loadPlugins();
     void findCameras();
     shared_ptr<CameraManager> loadPlugin(Plugin &plugin);
 
@@ -51,21 +68,48 @@ private:
     vector<CameraInfo> m_cameraInfoList;
     map<const string, shared_ptr<CameraManager>> m_cameraIdMap;
     map<const string, shared_ptr<CameraManager>> m_plugins;
+
+    mutex m_probeMutex;
+    vector<thread> m_probeThreads;
 };
 
+RootCameraManager::~RootCameraManager()
+{
+    for (thread &probeThread : m_probeThreads) {
+        probeThread.join();
+    }
+}
+
 bool RootCameraManager::init()
 {
-    scoped_lock lock(m_mutex);
+    // Camera plugins are loaded when the cameras are first listed, so
+    // that codec only users don't initialize the camera HAL.
+    PluginManager::get()->listPlugins();
+    return true;
+}
+
+// Called with m_mutex held
+void RootCameraManager::loadPlugins()
+{
     if (!m_initialized) {
         for (auto plugin : PluginManager::get()->listPlugins()) {
+            if (!plugin.manifest.camera) {
+                continue;
+            }
+            // The library load is timed on its own, whatever the factory
+            // of the manager does counts as init.
+            PluginManager::get()->load(plugin.path);
+            uint64_t startUs = PluginManager::nowUs();
             auto manager = loadPlugin(plugin);
             if (manager && manager->init()) {
+                uint64_t initUs = PluginManager::nowUs() - startUs;
+                PluginManager::get()->recordInit(plugin.path, PluginInitCamera, initUs);
+                LOGI("Initialized camera plugin at " << plugin.path << " in " << initUs << "us");
                 m_plugins.emplace(plugin.path, manager);
             }
         }
         m_initialized = true;
     }
-    return true;
 }
 
 int RootCameraManager::getNumberOfCameras()
@@ -106,9 +150,114 @@ bool RootCameraManager::openCamera(const string &cameraId, shared_ptr<Camera> &c
     return false;
 }
 
+bool RootCameraManager::queryAllCapabilities(CapabilityListener *listener)
+{
+    getNumberOfCameras();
+
+    map<CameraManager *, shared_ptr<CapabilityProbe>> probes;
+    unsigned int cameraCount = 0;
+    {
+        scoped_lock lock(m_mutex);
+        for (const CameraInfo &info : m_cameraInfoList) {
+            shared_ptr<CameraManager> &plugin = m_cameraIdMap[info.id];
+            shared_ptr<CapabilityProbe> &probe = probes[plugin.get()];
+            if (!probe) {
+                probe = make_shared<CapabilityProbe>();
+                probe->plugin = plugin;
+            }
+            probe->cameraIds.push_back(info.id);
+            cameraCount++;
+        }
+    }
+
+    scoped_lock lock(m_probeMutex);
+    // Wait for the previous query.
+    for (thread &probeThread : m_probeThreads) {
+        probeThread.join();
+    }
+    m_probeThreads.clear();
+
+    if (!cameraCount) {
+        listener->onCapabilitiesComplete();
+        return true;
+    }
+
+    // Plugins are probed in parallel, and the cameras of a plugin as far
+    // as its HAL allows.
+    auto remaining = make_shared<atomic<unsigned int>>(cameraCount);
+    for (auto const& [manager, probe] : probes) {
+        unsigned int threads = max(1u, min<unsigned int>(probe->plugin->maxConcurrentProbes(),
+                                                         probe->cameraIds.size()));
+        LOGD("Probing " << probe->cameraIds.size() << " cameras on " << threads << " threads");
+        for (unsigned int i = 0; i < threads; i++) {
+            m_probeThreads.emplace_back([probe = probe, remaining, listener]() {
+                unsigned int next;
+                while ((next = probe->next++) < probe->cameraIds.size()) {
+                    const string &cameraId = probe->cameraIds[next];
+                    vector<CameraCapability> caps;
+                    bool success = probe->plugin->queryCapabilities(cameraId, caps);
+                    listener->onCameraCapabilities(cameraId, success, caps);
+                    if (!--*remaining) {
+                        listener->onCapabilitiesComplete();
+                    }
+                }
+            });
+        }
+    }
+    return true;
+}
+
+bool RootCameraManager::setStandbyCameras(unsigned int count)
+{
+    getNumberOfCameras();
+
+    scoped_lock lock(m_mutex);
+    bool supported = false;
+    for (auto const& [path, plugin] : m_plugins) {
+        supported |= plugin->setStandbyCameras(count);
+    }
+    return supported;
+}
+
+bool RootCameraManager::switchCamera(shared_ptr<Camera> &camera, const string &cameraId,
+                                     const CameraCapability &cap)
+{
+    uint64_t startUs = PluginManager::nowUs();
+    shared_ptr<Camera> next;
+    if (!camera || !openCamera(cameraId, next)) {
+        return false;
+    }
+
+    next->setListener(camera->cameraListener);
+    next->m_switchFirstFrameUs = 0;
+    next->m_switchStartUs = startUs;
+
+    // Tear the old camera down while the new one comes up. HALs which
+    // can't run both have stopped it already when the new one connected.
+    shared_ptr<Camera> previous = camera;
+    thread teardown([previous]() {
+        previous->stopCapture();
+    });
+    bool started = next->startCapture(cap);
+    uint64_t readyUs = PluginManager::nowUs() - startUs;
+    teardown.join();
+    previous->setListener(nullptr);
+
+    if (!started) {
+        LOGE("Cannot switch to " << cameraId);
+        next->setListener(nullptr);
+        return false;
+    }
+    next->m_switchReadyUs = readyUs;
+    LOGI("Switched to " << cameraId << " in " << readyUs << "us");
+    camera = next;
+    return true;
+}
+
 void RootCameraManager::findCameras()
 {
     scoped_lock lock(m_mutex);
+    loadPlugins();
     m_cameraInfoList.clear();
     m_cameraIdMap.clear();
     for (auto const& [path, plugin] : m_plugins) {
@@ -124,8 +273,9 @@ void RootCameraManager::findCameras()
 
 shared_ptr<CameraManager> RootCameraManager::loadPlugin(Plugin &plugin)
 {
-    if (plugin.handle) {
-        CameraManager* (*_manager)() = (CameraManager * (*)())dlsym(plugin.handle, "gecko_camera_plugin_manager");
+    void *handle = PluginManager::get()->load(plugin.path);
+    if (handle) {
+        CameraManager* (*_manager)() = (CameraManager * (*)())dlsym(handle, "gecko_camera_plugin_manager");
         if (_manager) {
             CameraManager *manager = _manager();
             if (manager) {
@@ -140,6 +290,26 @@ shared_ptr<CameraManager> RootCameraManager::loadPlugin(Plugin &plugin)
 
 static RootCameraManager cameraRootManager;
 
+static atomic<uint64_t> mapCalls(0);
+static atomic<uint64_t> mapLocksSaved(0);
+
+// static
+void GraphicBuffer::recordMapping(bool shared)
+{
+    mapCalls.fetch_add(1, memory_order_relaxed);
+    if (shared) {
+        mapLocksSaved.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+GraphicBufferMapStats graphicBufferMapStats()
+{
+    GraphicBufferMapStats stats;
+    stats.mapCalls = mapCalls.load(memory_order_relaxed);
+    stats.locksSaved = mapLocksSaved.load(memory_order_relaxed);
+    return stats;
+}
+
 } // namespace camera
 } // namespace gecko
 
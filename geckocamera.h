@@ -21,6 +21,7 @@
 
 #include <sys/types.h>
 
+#include <atomic>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -34,10 +35,40 @@ enum CameraFacing {
     GECKO_CAMERA_FACING_REAR
 };
 
+enum CameraFocusMode {
+    CameraFocusAuto = 0,
+    CameraFocusContinuousVideo,
+    CameraFocusInfinity,
+    CameraFocusFixed
+};
+
+// Which cameras keep capturing when the HAL can't stream all of them
+enum CapturePriority {
+    CapturePriorityLow = 0,
+    CapturePriorityNormal,
+    CapturePriorityHigh
+};
+
+// Changes of a capture made to share the HAL with other cameras
+enum CaptureState {
+    // Capturing as requested, after having been queued or preempted
+    CaptureStarted,
+    // Capturing in a smaller mode than requested
+    CaptureDowngraded,
+    // Waiting for other cameras to stop
+    CaptureQueued,
+    // Stopped for a camera of higher priority, queued until it stops
+    CapturePreempted
+};
+
 struct CameraCapability {
     unsigned int width;
     unsigned int height;
+    // The frame rate range of the mode: the camera delivers up to fps and
+    // may slow down to minFps, e.g. in low light. startCapture() takes any
+    // range within it. A minFps of 0 means a fixed rate.
     unsigned int fps;
+    unsigned int minFps = 0;
 };
 
 struct CameraInfo {
@@ -73,6 +104,16 @@ struct RawImageFrame {
     uint64_t timestampUs;
 };
 
+struct GraphicBufferMapStats {
+    // mapYCbCr() and map() calls
+    uint64_t mapCalls;
+    // Calls which shared an existing mapping instead of locking the buffer
+    uint64_t locksSaved;
+};
+
+// Process wide, over all plugins.
+GraphicBufferMapStats graphicBufferMapStats();
+
 class GraphicBuffer {
 public:
     virtual ~GraphicBuffer() = default;
@@ -85,34 +126,193 @@ public:
     // A hardware-specific handle for the underlying media buffer.
     const void *handle;
 
+    // Concurrent callers may get the same mapping. The buffer stays
+    // locked until the last one is released.
     virtual std::shared_ptr<const YCbCrFrame> mapYCbCr() = 0;
     virtual std::shared_ptr<const RawImageFrame> map() = 0;
+
+protected:
+    // For graphicBufferMapStats(), called by the plugins on every map.
+    static void recordMapping(bool shared);
+};
+
+// What to do with a new frame when the delivery queue is full
+enum FrameDropPolicy {
+    DropOldest = 0,
+    DropNewest,
+    // Block the producer until there is space. Stalls the HAL if the
+    // consumer is slow.
+    BlockProducer
+};
+
+struct FrameDeliveryStats {
+    uint64_t delivered;
+    uint64_t dropped;
+    unsigned int queued;
+    unsigned int queueDepth;
+    // The largest number of frames seen waiting in the queue
+    unsigned int maxQueued;
 };
 
+// Timing of CameraManager::switchCamera(), from the call on
+struct CameraSwitchStats {
+    // Until the new camera was capturing
+    uint64_t startUs;
+    // Until its first frame was delivered, 0 before that
+    uint64_t firstFrameUs;
+};
+
+class FrameDispatcher;
+class CameraListenerSet;
+class LatencyStream;
+class RootCameraManager;
+
 class CameraListener
 {
 public:
     virtual ~CameraListener() = default;
     virtual void onCameraFrame(std::shared_ptr<GraphicBuffer> buffer) = 0;
     virtual void onCameraError(std::string errorDescription) = 0;
+    // Called from the thread of the startCapture() or stopCapture() of
+    // whichever camera caused the change, cap is the mode captured in or
+    // waited for.
+    virtual void onCaptureStateChanged(CaptureState state, const CameraCapability &cap) {}
 };
 
 class Camera
 {
 public:
-    virtual ~Camera() = default;
+    Camera();
+    virtual ~Camera();
     virtual bool getInfo(CameraInfo &info) = 0;
     virtual bool startCapture(const CameraCapability &cap) = 0;
     virtual bool stopCapture() = 0;
     virtual bool captureStarted() const = 0;
 
+    // Switches a running capture to another mode or frame rate range,
+    // changing only what differs. Returns false if that isn't supported,
+    // the capture then goes on as before.
+    virtual bool changeCapture(const CameraCapability &cap)
+    {
+        return false;
+    }
+    // Applied at once while capturing, otherwise by startCapture().
+    virtual bool setFocusMode(CameraFocusMode mode)
+    {
+        return false;
+    }
+
     virtual void setListener(CameraListener *listener)
     {
         cameraListener = listener;
     }
 
+    // By default the listener is called on the thread which produced the
+    // frame. With a non-zero queue depth frames are passed through a
+    // bounded lock-free queue to a dedicated delivery thread instead. The
+    // depth is rounded up to a power of two. Can only be changed while
+    // capture is stopped.
+    bool setFrameDelivery(unsigned int queueDepth, FrameDropPolicy policy = DropOldest);
+    bool getFrameDeliveryStats(FrameDeliveryStats &stats) const;
+
+    // Additional listeners, up to MAX_LISTENERS. They get the same buffers
+    // as the main listener, each through its own queue like with
+    // setFrameDelivery(), so they can consume frames at their own rate.
+    // Can be called while capturing, but not from the listener's own
+    // callbacks.
+    static const unsigned int MAX_LISTENERS = 8;
+    bool addListener(CameraListener *listener, unsigned int queueDepth = 0,
+                     FrameDropPolicy policy = DropOldest);
+    bool removeListener(CameraListener *listener);
+    bool getFrameDeliveryStats(CameraListener *listener, FrameDeliveryStats &stats) const;
+
+    // Returns false if the camera wasn't started by switchCamera().
+    bool getSwitchStats(CameraSwitchStats &stats) const;
+
+    // Used by plugins which can't stream all cameras at once to decide
+    // which one captures. startCapture() of a camera which has to wait
+    // returns true, and the listener is told about it with
+    // onCaptureStateChanged(). To be set before startCapture().
+    void setCapturePriority(CapturePriority priority)
+    {
+        m_capturePriority = priority;
+    }
+    CapturePriority capturePriority() const
+    {
+        return m_capturePriority;
+    }
+
 protected:
+    // Pass a captured frame to the listeners, used by the plugins.
+    void deliverFrame(std::shared_ptr<GraphicBuffer> buffer);
+    void deliverError(const std::string &errorDescription);
+    void deliverCaptureState(CaptureState state, const CameraCapability &cap);
+    // Drop the frames waiting for delivery.
+    void flushFrames();
+    // Forgets the listeners, frame delivery, switch stats and priority of
+    // the previous owner, for plugins handing out a stopped camera again.
+    void resetOwnerState();
+
     CameraListener *cameraListener = nullptr;
+    // Set by the plugin to record delivery latencies
+    LatencyStream *latencyStream = nullptr;
+
+private:
+    friend class FrameDispatcher;
+    friend class CameraListenerSet;
+    friend class RootCameraManager;
+
+    bool dispatchFrame(CameraListener *listener, std::shared_ptr<GraphicBuffer> buffer);
+
+    std::shared_ptr<FrameDispatcher> m_dispatcher;
+    std::shared_ptr<CameraListenerSet> m_listeners;
+    std::atomic<uint64_t> m_framesDelivered{0};
+    // Set by switchCamera()
+    std::atomic<uint64_t> m_switchStartUs{0};
+    uint64_t m_switchReadyUs = 0;
+    std::atomic<uint64_t> m_switchFirstFrameUs{0};
+    std::atomic<CapturePriority> m_capturePriority{CapturePriorityNormal};
+};
+
+// Plugins export this as gecko_camera_plugin_manifest so that the library
+// only loads them once something they provide is requested. The manifest
+// is cached, so unused plugins are not even dlopen()ed. Plugins without a
+// manifest are loaded on the first request of any kind.
+static const uint32_t PLUGIN_MANIFEST_VERSION = 1;
+
+struct PluginManifest {
+    uint32_t version;
+    bool camera;
+    // Bitmasks of gecko::codec::codecMask()
+    uint32_t videoEncoders;
+    uint32_t videoDecoders;
+};
+
+struct PluginLoadStats {
+    std::string path;
+    // The manifest came from the cache instead of loading the plugin
+    bool manifestCached;
+    bool loaded;
+    uint64_t loadUs;
+    // Zero if the plugin hasn't been initialized for that purpose
+    uint64_t cameraInitUs;
+    uint64_t codecInitUs;
+};
+
+// Startup costs of the plugins found so far.
+std::vector<PluginLoadStats> pluginLoadStats();
+
+class CapabilityListener
+{
+public:
+    virtual ~CapabilityListener() = default;
+    // Called as soon as the capabilities of a camera are known, possibly
+    // from several threads at the same time.
+    virtual void onCameraCapabilities(const std::string &cameraId,
+                                      bool success,
+                                      const std::vector<CameraCapability> &caps) = 0;
+    // Called once, after the last camera.
+    virtual void onCapabilitiesComplete() = 0;
 };
 
 class CameraManager
@@ -125,6 +325,52 @@ public:
     virtual bool queryCapabilities(const std::string &cameraId,
                                    std::vector<CameraCapability> &caps) = 0;
     virtual bool openCamera(const std::string &cameraId, std::shared_ptr<Camera> &camera) = 0;
+
+    // Queries the capabilities of all cameras. The root manager probes
+    // them concurrently and returns at once, the listener is to stay
+    // valid until onCapabilitiesComplete() and must not start another
+    // query from its callbacks. Plugins needn't implement it.
+    virtual bool queryAllCapabilities(CapabilityListener *listener)
+    {
+        for (int i = 0; i < getNumberOfCameras(); i++) {
+            CameraInfo info;
+            if (getCameraInfo(i, info)) {
+                std::vector<CameraCapability> caps;
+                bool success = queryCapabilities(info.id, caps);
+                listener->onCameraCapabilities(info.id, success, caps);
+            }
+        }
+        listener->onCapabilitiesComplete();
+        return true;
+    }
+
+    // How many cameras of the plugin queryCapabilities() can probe at the
+    // same time. HALs which can't open several cameras keep the default.
+    virtual unsigned int maxConcurrentProbes()
+    {
+        return 1;
+    }
+
+    // Keeps up to count recently stopped cameras connected, with the
+    // parameters of their last capture applied, so that opening and
+    // starting them again is quick. Only cameras the application no
+    // longer holds are reused. Returns false if the HAL can't keep
+    // several cameras open. Plugins needn't implement it.
+    virtual bool setStandbyCameras(unsigned int count)
+    {
+        return false;
+    }
+
+    // Replaces a capturing camera with cameraId, capturing in cap. The new
+    // one is brought up while the old one is torn down, and gets its
+    // listener. Frame delivery queues and additional listeners are to be
+    // set up again. If it fails, the old camera is left stopped. The
+    // latency is reported by Camera::getSwitchStats() of the new camera.
+    virtual bool switchCamera(std::shared_ptr<Camera> &camera, const std::string &cameraId,
+                              const CameraCapability &cap)
+    {
+        return false;
+    }
 };
 
 }
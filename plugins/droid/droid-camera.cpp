@@ -16,20 +16,32 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <deque>
+#include <functional>
 #include <map>
 #include <cstring>
+#include <fstream>
 #include <sstream>
 #include <iostream>
 #include <mutex>
+#include <shared_mutex>
+#include <thread>
 
 #include <droidmedia.h>
 #include <droidmediacamera.h>
 
 #include "geckocamera.h"
 #include "droid-common.h"
+#include "droid-params.h"
 
 #define LOG_TOPIC "droid-camera"
 #include "geckocamera-utils.h"
+#include "geckocamera-arbiter.h"
 
 using namespace std;
 using namespace gecko::camera;
@@ -48,7 +60,7 @@ class DroidCameraManager : public CameraManager
 {
 public:
     explicit DroidCameraManager() {}
-    ~DroidCameraManager() {}
+    ~DroidCameraManager();
 
     bool init();
     int getNumberOfCameras();
@@ -56,15 +68,67 @@ public:
     bool queryCapabilities(const string &cameraId,
                            vector<CameraCapability> &caps);
     bool openCamera(const string &cameraId, shared_ptr<Camera> &camera);
+    unsigned int maxConcurrentProbes();
+    bool setStandbyCameras(unsigned int count);
 
     bool getCaptureAccess(shared_ptr<DroidCamera>, bool exclusive);
+    // Called by stopCapture(), keeps the camera connected or closes it
+    void enterStandby(shared_ptr<DroidCamera> camera);
+    void leaveStandby(DroidCamera *camera);
+    bool keepsStandby();
+    // Without querying the camera, empty if it hasn't been queried yet
+    vector<CameraCapability> knownCapabilities(int num);
+
+    CaptureArbiter &captureArbiter()
+    {
+        return arbiter;
+    }
 
 private:
     bool initialized = false;
     vector<DroidCameraItem> cameraList;
     bool findCameras();
+    static vector<CameraInfo> enumerateCameras();
+    bool probeCapabilities(int num, vector<CameraCapability> &caps);
     int cameraIndexById(const string &cameraId) const;
+    shared_ptr<DroidCamera> takeStandby(int num);
+    bool otherCameraOpen(int num);
+    // Called with managerLock held once the HAL turned out to open only
+    // one camera at a time. The standby cameras are moved to closing, to
+    // be released after managerLock.
+    void setSingleCameraUnlocked(deque<shared_ptr<DroidCamera>> &closing);
+    // Taken after the lock of a camera, so no camera lock is taken while
+    // holding it.
     mutex managerLock;
+
+    // Starts with the limits from GECKO_CAMERA_DROID_MAX_CAMERAS and
+    // GECKO_CAMERA_DROID_MAX_PIXELS, HAL1 doesn't tell them. Limited to one
+    // camera if connecting fails with another one open.
+    CaptureArbiter arbiter;
+
+    // Stopped cameras kept connected, the most recently used first.
+    // Protected by managerLock.
+    unsigned int standbyCount = 0;
+    deque<shared_ptr<DroidCamera>> standbyCameras;
+
+    // Cameras and capabilities are cached on disk, as querying the
+    // capabilities connects to the HAL and takes up to a second per
+    // camera. The cache is served at startup and then revalidated
+    // against the HAL in the background.
+    bool readCache();
+    void writeCache(const vector<DroidCameraItem> &cameras);
+    void revalidateCache();
+    // Protects the capabilities in cameraList and the cache file
+    mutex cacheLock;
+    // Held while probing cameras, shared if the HAL can open several at
+    // once, so that the application never opens a camera at the same time.
+    shared_mutex probeLock;
+    // Cleared once connecting failed with another camera open. Probes
+    // then run one at a time and no cameras are kept in standby.
+    atomic<bool> multiCamera = true;
+    atomic<bool> cameraOpened = false;
+    atomic<bool> quit = false;
+    thread revalidateThread;
 };
 
 class DroidCameraYCbCrFrame : public YCbCrFrame
@@ -94,9 +158,14 @@ public:
 private:
     shared_ptr<DroidCamera> camera;
     DroidMediaCameraRecordingData *recordingData;
+    mutex mapLock;
+    weak_ptr<const YCbCrFrame> ycbcrFrame;
 };
 
-class DroidCamera : public Camera, public enable_shared_from_this<DroidCamera>
+class DroidCamera
+    : public Camera
+    , public CaptureArbiter::Client
+    , public enable_shared_from_this<DroidCamera>
 {
 public:
     static shared_ptr<DroidCamera> create(DroidCameraManager *manager, int num)
@@ -106,32 +175,73 @@ public:
     explicit DroidCamera(DroidCameraManager *manager, int cameraNumber);
     ~DroidCamera()
     {
-        stopCapture();
+        {
+            scoped_lock lock(cameraLock);
+            closeUnlocked();
+        }
+        manager->captureArbiter().release(this);
     };
 
     int getNumber();
     bool getInfo(CameraInfo &info);
     bool startCapture(const CameraCapability &cap);
     bool stopCapture();
+    // Disconnects, unless the capture was started again
+    void close(bool onlyStopped);
+    // Another camera took the HAL, which closed this one.
+    void lostCamera();
+    // Taken out of standby by a new owner
+    void reuse()
+    {
+        resetOwnerState();
+    }
+    // Connects without closing other cameras. Returns false if connecting
+    // failed.
+    bool openShared();
+    bool changeCapture(const CameraCapability &cap);
+    bool setFocusMode(CameraFocusMode mode);
     bool captureStarted() const;
 
     bool queryCapabilities(vector<CameraCapability> &caps);
     bool open();
 
+    void capturePreempted();
+    void captureGranted(const CameraCapability &cap);
+    void captureChanged(const CameraCapability &cap);
+    // Opens and queries the camera without stopping other cameras if the
+    // HAL can't open several.
+    bool probe(vector<CameraCapability> &caps);
+
 private:
     int cameraNumber;
     DroidCameraManager *manager;
     DroidMediaCamera *handle;
     mutex cameraLock;
     DroidGraphicBufferPool m_bufferPool;
+    // Recycled wrappers of the recording frames
+    shared_ptr<ObjectPool> m_recordingBufferPool = ObjectPool::create();
+    shared_ptr<ObjectPool> m_recordingFramePool = ObjectPool::create();
 
     bool started;
     bool exclusiveAccess;
+    bool allowExclusiveAccess = true;
 
     bool openUnlocked();
     void closeUnlocked();
+    void stopStreamsUnlocked();
+    bool startGranted(const CameraCapability &cap);
+    // Switches the running streams to cap
+    bool changeCaptureUnlocked(const CameraCapability &cap);
+    // The last mode given to startCapture(), for the arbitration
+    CameraCapability requestedCapability = {};
 
     shared_ptr<DroidCameraParams> currentParameters;
+    // Whether the HAL of this connection got the parameters
+    bool parametersApplied = false;
+    // Reused for every applyParameters()
+    string parameterString;
+    bool focusModeSet = false;
+    CameraFocusMode focusMode = CameraFocusAuto;
     bool getParameters(shared_ptr<DroidCameraParams> &params);
     bool applyParameters();
 
@@ -160,28 +270,117 @@ std::ostream &operator<<(std::ostream &os, DroidCamera *camera)
 class DroidCameraParams
 {
 public:
-    static shared_ptr<DroidCameraParams> createFromString(string params)
+    static shared_ptr<DroidCameraParams> createFromString(const char *params)
     {
         return make_shared<DroidCameraParams>(params);
     }
-    explicit DroidCameraParams(string inp);
+    explicit DroidCameraParams(const char *params);
     ~DroidCameraParams() {};
-    string getValue(const string &key);
-    vector<string> getValues(const string &key);
-    bool setValue(const string &key, const string &value);
+    string_view getValue(string_view key) const;
+    vector<string> getValues(string_view key) const;
+    // Frame rate ranges in fps
+    vector<pair<unsigned int, unsigned int>> getFpsRanges() const;
+    bool setValue(string_view key, string_view value);
     bool setCapability(CameraCapability cap);
-    string toString() const;
+    // Only the frame rate range of the capability
+    void setFpsRange(const CameraCapability &cap);
+    bool setFocusMode(CameraFocusMode mode);
+
+    // Changes since the last markApplied()
+    bool changed() const
+    {
+        return store.changed();
+    }
+    string changes() const
+    {
+        return store.changedKeys();
+    }
+    void markApplied()
+    {
+        store.markApplied();
+    }
+    void serialize(string &out) const
+    {
+        store.serialize(out);
+    }
+
     CameraCapability currentCapability;
     DroidMediaBufferYCbCr ycbcrTemplate;
 
 private:
-    map<string, string> params;
+    DroidParameterStore store;
 };
 
+// Bump when the format of the cache file changes.
+static const unsigned int CAMERA_CACHE_VERSION = 2;
+static const char *CAMERA_CACHE_HEADER = "gecko-camera-droid";
+
+// The cache is valid for one system build and one build of this plugin.
+static string cacheFingerprint()
+{
+    string fingerprint = DroidSystemInfo::get().buildFingerprint;
+    Dl_info dlInfo;
+    struct stat st;
+    if (dladdr(reinterpret_cast<void *>(&cacheFingerprint), &dlInfo)
+            && dlInfo.dli_fname && !stat(dlInfo.dli_fname, &st)) {
+        fingerprint += " " + to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec)
+                       + " " + to_string(st.st_size);
+    }
+    return fingerprint;
+}
+
+static bool sameCapabilities(const vector<CameraCapability> &a,
+                             const vector<CameraCapability> &b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < a.size(); i++) {
+        if (a[i].width != b[i].width || a[i].height != b[i].height || a[i].fps != b[i].fps
+                || a[i].minFps != b[i].minFps) {
+            return false;
+        }
+    }
+    return true;
+}
+
+DroidCameraManager::~DroidCameraManager()
+{
+    setStandbyCameras(0);
+    quit = true;
+    if (revalidateThread.joinable()) {
+        revalidateThread.join();
+    }
+}
+
 bool DroidCameraManager::init()
 {
-    if (!initialized) {
-        initialized = droid_media_init() && findCameras();
+    if (!initialized && droid_media_init()) {
+        CaptureLimits limits;
+        const char *maxCameras = getenv("GECKO_CAMERA_DROID_MAX_CAMERAS");
+        if (maxCameras) {
+            limits.maxCameras = strtoul(maxCameras, nullptr, 10);
+            multiCamera = limits.maxCameras != 1;
+        }
+        const char *maxPixels = getenv("GECKO_CAMERA_DROID_MAX_PIXELS");
+        if (maxPixels) {
+            // Either a count or a size like 3840x2160
+            unsigned long width, height;
+            if (sscanf(maxPixels, "%lux%lu", &width, &height) == 2) {
+                limits.maxPixels = (uint64_t)width * height;
+            } else {
+                limits.maxPixels = strtoull(maxPixels, nullptr, 10);
+            }
+        }
+        arbiter.setLimits(limits);
+
+        if (readCache()) {
+            LOGI("Using cached capabilities of " << cameraList.size() << " cameras");
+            revalidateThread = thread(&DroidCameraManager::revalidateCache, this);
+            initialized = true;
+        } else {
+            initialized = findCameras();
+        }
     }
     return initialized;
 }
@@ -189,28 +388,171 @@ bool DroidCameraManager::init()
 bool DroidCameraManager::findCameras()
 {
     if (!cameraList.size()) {
-        for (int i = 0; i < droid_media_camera_get_number_of_cameras(); i++) {
-            CameraInfo info;
-            DroidMediaCameraInfo droidInfo;
-            if (droid_media_camera_get_info(&droidInfo, i)) {
-                if (droidInfo.facing == DROID_MEDIA_CAMERA_FACING_FRONT) {
-                    info.name = "Droid front camera";
-                    info.id = "droid:front:" + to_string(i);
-                    info.facing = GECKO_CAMERA_FACING_FRONT;
-                } else {
-                    info.name = "Droid rear camera";
-                    info.id = "droid:rear:" + to_string(i);
-                    info.facing = GECKO_CAMERA_FACING_REAR;
-                }
-                info.provider = "droid";
-                info.mountAngle = droidInfo.orientation;
-                cameraList.push_back(DroidCameraItem{info});
+        for (const CameraInfo &info : enumerateCameras()) {
+            cameraList.push_back(DroidCameraItem{info});
+        }
+        // Capabilities are added as they are queried.
+        scoped_lock lock(cacheLock);
+        writeCache(cameraList);
+    }
+    return cameraList.size() != 0;
+}
+
+// static
+vector<CameraInfo> DroidCameraManager::enumerateCameras()
+{
+    vector<CameraInfo> cameras;
+    for (int i = 0; i < droid_media_camera_get_number_of_cameras(); i++) {
+        CameraInfo info;
+        DroidMediaCameraInfo droidInfo;
+        if (droid_media_camera_get_info(&droidInfo, i)) {
+            if (droidInfo.facing == DROID_MEDIA_CAMERA_FACING_FRONT) {
+                info.name = "Droid front camera";
+                info.id = "droid:front:" + to_string(i);
+                info.facing = GECKO_CAMERA_FACING_FRONT;
+            } else {
+                info.name = "Droid rear camera";
+                info.id = "droid:rear:" + to_string(i);
+                info.facing = GECKO_CAMERA_FACING_REAR;
+            }
+            info.provider = "droid";
+            info.mountAngle = droidInfo.orientation;
+            cameras.push_back(info);
+        }
+    }
+    return cameras;
+}
+
+bool DroidCameraManager::readCache()
+{
+    string path = cacheFilePath("droid-cameras");
+    if (path.empty()) {
+        return false;
+    }
+
+    ifstream in(path);
+    string header;
+    unsigned int version = 0;
+    if (!(in >> header >> version) || header != CAMERA_CACHE_HEADER
+            || version != CAMERA_CACHE_VERSION) {
+        return false;
+    }
+
+    string fingerprint;
+    in >> ws;
+    if (!getline(in, fingerprint) || fingerprint != cacheFingerprint()) {
+        LOGI("Camera cache is stale, querying the cameras");
+        return false;
+    }
+
+    // Each camera is a line of facing, mount angle, id, the capabilities
+    // as a count followed by width, height, minFps and fps each, and the
+    // name.
+    unsigned int count;
+    if (!(in >> count)) {
+        return false;
+    }
+    vector<DroidCameraItem> cameras;
+    for (unsigned int i = 0; i < count; i++) {
+        DroidCameraItem item;
+        int facing;
+        unsigned int capCount;
+        if (!(in >> facing >> item.info.mountAngle >> item.info.id >> capCount)) {
+            return false;
+        }
+        for (unsigned int j = 0; j < capCount; j++) {
+            CameraCapability cap;
+            if (!(in >> cap.width >> cap.height >> cap.minFps >> cap.fps)) {
+                return false;
             }
+            item.caps.push_back(cap);
+        }
+        in >> ws;
+        if (!getline(in, item.info.name)) {
+            return false;
         }
+        item.info.facing = static_cast<CameraFacing>(facing);
+        item.info.provider = "droid";
+        cameras.push_back(move(item));
     }
+
+    cameraList = move(cameras);
     return cameraList.size() != 0;
 }
 
+void DroidCameraManager::writeCache(const vector<DroidCameraItem> &cameras)
+{
+    string path = cacheFilePath("droid-cameras");
+    if (path.empty()) {
+        return;
+    }
+
+    ostringstream out;
+    out << CAMERA_CACHE_HEADER << " " << CAMERA_CACHE_VERSION << "\n"
+        << cacheFingerprint() << "\n"
+        << cameras.size() << "\n";
+    for (const DroidCameraItem &item : cameras) {
+        out << item.info.facing << " " << item.info.mountAngle << " " << item.info.id
+            << " " << item.caps.size();
+        for (const CameraCapability &cap : item.caps) {
+            out << " " << cap.width << " " << cap.height << " " << cap.minFps << " " << cap.fps;
+        }
+        out << " " << item.info.name << "\n";
+    }
+    writeCacheFile(path, out.str());
+}
+
+void DroidCameraManager::revalidateCache()
+{
+    vector<CameraInfo> cameras = enumerateCameras();
+    bool changed = cameras.size() != cameraList.size();
+    for (unsigned int i = 0; !changed && i < cameras.size(); i++) {
+        const CameraInfo &info = cameraList[i].info;
+        changed = cameras[i].id != info.id || cameras[i].facing != info.facing
+                  || cameras[i].mountAngle != info.mountAngle;
+    }
+    if (changed) {
+        // The list can't change under the application, use the new one
+        // from the next start.
+        LOGI("Cameras have changed, dropping the cached capabilities");
+        vector<DroidCameraItem> items;
+        for (const CameraInfo &info : cameras) {
+            items.push_back(DroidCameraItem{info});
+        }
+        scoped_lock lock(cacheLock);
+        writeCache(items);
+        return;
+    }
+
+    bool dirty = false;
+    for (unsigned int i = 0; i < cameraList.size() && !quit; i++) {
+        vector<CameraCapability> caps;
+        {
+            scoped_lock lock(probeLock);
+            // Probing could stop the capture of the application on HALs
+            // without multi camera support. Revalidate on the next start.
+            if (cameraOpened) {
+                LOGD("A camera has been opened, revalidation postponed");
+                break;
+            }
+            if (!DroidCamera::create(this, i)->queryCapabilities(caps)) {
+                continue;
+            }
+        }
+        scoped_lock lock(cacheLock);
+        if (!sameCapabilities(caps, cameraList[i].caps)) {
+            LOGI("Capabilities of " << cameraList[i].info.id << " have changed");
+            cameraList[i].caps = caps;
+            dirty = true;
+        }
+    }
+    if (dirty) {
+        scoped_lock lock(cacheLock);
+        writeCache(cameraList);
+    }
+    LOGD("Camera cache revalidated");
+}
+
 int DroidCameraManager::getNumberOfCameras()
 {
     return cameraList.size();
@@ -244,26 +586,74 @@ bool DroidCameraManager::queryCapabilities(
     int num = cameraIndexById(cameraId);
     if (num >= 0) {
         DroidCameraItem &entry = cameraList.at(num);
-        if (entry.caps.size()) {
-            caps = entry.caps;
-            return true;
-        } else {
-            auto droidCamera = DroidCamera::create(this, num);
-            if (droidCamera->open() && droidCamera->queryCapabilities(caps)) {
-                entry.caps = caps;
+        {
+            scoped_lock lock(cacheLock);
+            if (entry.caps.size()) {
+                caps = entry.caps;
                 return true;
             }
         }
+        if (probeCapabilities(num, caps)) {
+            scoped_lock lock(cacheLock);
+            entry.caps = caps;
+            writeCache(cameraList);
+            return true;
+        }
     }
     return false;
 }
 
+bool DroidCameraManager::probeCapabilities(int num, vector<CameraCapability> &caps)
+{
+    if (multiCamera) {
+        shared_lock lock(probeLock);
+        if (DroidCamera::create(this, num)->probe(caps)) {
+            return true;
+        }
+        // Most likely the HAL can't open several cameras.
+        if (multiCamera.exchange(false)) {
+            LOGI("Probing the cameras one at a time");
+        }
+        caps.clear();
+    }
+    scoped_lock lock(probeLock);
+    auto droidCamera = DroidCamera::create(this, num);
+    return droidCamera->open() && droidCamera->queryCapabilities(caps);
+}
+
+unsigned int DroidCameraManager::maxConcurrentProbes()
+{
+    return multiCamera ? cameraList.size() : 1;
+}
+
 bool DroidCameraManager::openCamera(const string &cameraId, shared_ptr<Camera> &camera)
 {
     int num = cameraIndexById(cameraId);
     if (num >= 0) {
-        auto droidCamera = DroidCamera::create(this, num);
-        if (droidCamera->open()) {
+        // Stops the revalidation, waiting for a probe in progress.
+        cameraOpened = true;
+        scoped_lock lock(probeLock);
+        shared_ptr<DroidCamera> droidCamera = takeStandby(num);
+        if (droidCamera) {
+            LOGD("Reusing the connection of " << cameraId);
+            droidCamera->reuse();
+            camera = static_pointer_cast<Camera>(droidCamera);
+            return true;
+        }
+        droidCamera = DroidCamera::create(this, num);
+        // HALs opening one camera at a time connect in startCapture(),
+        // once the arbiter lets the camera capture.
+        if (!multiCamera || droidCamera->openShared()) {
+            camera = static_pointer_cast<Camera>(droidCamera);
+            return true;
+        }
+        if (otherCameraOpen(num)) {
+            LOGI("Cannot open several cameras, " << cameraId << " connects when started");
+            deque<shared_ptr<DroidCamera>> closing;
+            {
+                scoped_lock lock(managerLock);
+                setSingleCameraUnlocked(closing);
+            }
             camera = static_pointer_cast<Camera>(droidCamera);
             return true;
         }
@@ -271,33 +661,163 @@ bool DroidCameraManager::openCamera(const string &cameraId, shared_ptr<Camera> &
     return false;
 }
 
-bool DroidCameraManager::getCaptureAccess(shared_ptr<DroidCamera> camera, bool exclusive)
+bool DroidCameraManager::otherCameraOpen(int num)
+{
+    scoped_lock lock(managerLock);
+    for (unsigned int i = 0; i < cameraList.size(); i++) {
+        if ((int)i != num && !cameraList[i].runningInstance.expired()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DroidCameraManager::setSingleCameraUnlocked(deque<shared_ptr<DroidCamera>> &closing)
+{
+    if (multiCamera.exchange(false)) {
+        LOGI("No more cameras kept in standby");
+    }
+    standbyCount = 0;
+    closing = move(standbyCameras);
+    standbyCameras.clear();
+
+    CaptureLimits limits = arbiter.limits();
+    limits.maxCameras = 1;
+    arbiter.setLimits(limits);
+}
+
+vector<CameraCapability> DroidCameraManager::knownCapabilities(int num)
+{
+    scoped_lock lock(cacheLock);
+    if (num >= 0 && num < (int)cameraList.size()) {
+        return cameraList[num].caps;
+    }
+    return vector<CameraCapability>();
+}
+
+bool DroidCameraManager::keepsStandby()
+{
+    scoped_lock lock(managerLock);
+    return standbyCount && multiCamera;
+}
+
+bool DroidCameraManager::setStandbyCameras(unsigned int count)
+{
+    deque<shared_ptr<DroidCamera>> closing;
+    {
+        scoped_lock lock(managerLock);
+        standbyCount = multiCamera ? count : 0;
+        while (standbyCameras.size() > standbyCount) {
+            closing.push_back(move(standbyCameras.back()));
+            standbyCameras.pop_back();
+        }
+    }
+    for (auto &camera : closing) {
+        camera->close(true);
+    }
+    return count == 0 || standbyCount != 0;
+}
+
+void DroidCameraManager::enterStandby(shared_ptr<DroidCamera> camera)
+{
+    shared_ptr<DroidCamera> closing = camera;
+    {
+        scoped_lock lock(managerLock);
+        if (standbyCount && multiCamera) {
+            auto it = find(standbyCameras.begin(), standbyCameras.end(), camera);
+            if (it != standbyCameras.end()) {
+                standbyCameras.erase(it);
+            }
+            standbyCameras.push_front(move(camera));
+            closing.reset();
+            if (standbyCameras.size() > standbyCount) {
+                closing = move(standbyCameras.back());
+                standbyCameras.pop_back();
+            }
+        }
+    }
+    // Not under managerLock, closing takes the camera lock.
+    if (closing) {
+        closing->close(true);
+    }
+}
+
+void DroidCameraManager::leaveStandby(DroidCamera *camera)
+{
+    scoped_lock lock(managerLock);
+    auto it = find_if(standbyCameras.begin(), standbyCameras.end(),
+                      [camera](const shared_ptr<DroidCamera> &c) {
+                          return c.get() == camera;
+                      });
+    if (it != standbyCameras.end()) {
+        standbyCameras.erase(it);
+    }
+}
+
+// Only cameras no longer held by the application, which could still
+// start them again.
+shared_ptr<DroidCamera> DroidCameraManager::takeStandby(int num)
 {
     scoped_lock lock(managerLock);
+    for (auto it = standbyCameras.begin(); it != standbyCameras.end(); ++it) {
+        if ((*it)->getNumber() == num && it->use_count() == 1) {
+            shared_ptr<DroidCamera> camera = move(*it);
+            standbyCameras.erase(it);
+            return camera;
+        }
+    }
+    return nullptr;
+}
+
+bool DroidCameraManager::getCaptureAccess(shared_ptr<DroidCamera> camera, bool exclusive)
+{
+    // The caller holds the lock of camera, and the cameras below are
+    // closed after managerLock, which is taken after the camera locks.
+    vector<shared_ptr<DroidCamera>> lost;
+    deque<shared_ptr<DroidCamera>> closing;
+    shared_ptr<DroidCamera> replaced;
+    bool access = false;
+    {
+        scoped_lock lock(managerLock);
+
+        if (exclusive) {
+            // The HAL can't keep several cameras open.
+            setSingleCameraUnlocked(closing);
+
+            // Stop all other cameras
+            for (unsigned int i = 0; i < cameraList.size(); i++) {
+                DroidCameraItem &entry = cameraList.at(i);
+                shared_ptr<DroidCamera> runningCamera = entry.runningInstance.lock();
+                if (runningCamera && runningCamera != camera) {
+                    lost.push_back(runningCamera);
+                }
+                entry.runningInstance.reset();
+            }
+        }
 
-    if (exclusive) {
-        // Stop all other cameras
-        for (unsigned int i = 0; i < cameraList.size(); i++) {
-            DroidCameraItem &entry = cameraList.at(i);
+        int num = camera->getNumber();
+        if (num >= 0 && num < (int)cameraList.size()) {
+            DroidCameraItem &entry = cameraList.at(num);
             shared_ptr<DroidCamera> runningCamera = entry.runningInstance.lock();
             if (runningCamera && runningCamera != camera) {
-                runningCamera->stopCapture();
+                replaced = move(runningCamera);
             }
-            entry.runningInstance.reset();
+            entry.runningInstance = weak_ptr<DroidCamera>(camera);
+            access = true;
         }
     }
 
-    int num = camera->getNumber();
-    if (num >= 0 && num < (int)cameraList.size()) {
-        DroidCameraItem &entry = cameraList.at(num);
-        shared_ptr<DroidCamera> runningCamera = entry.runningInstance.lock();
-        if (runningCamera && runningCamera != camera) {
-            runningCamera->stopCapture();
-        }
-        entry.runningInstance = weak_ptr<DroidCamera>(camera);
-        return true;
+    if (replaced) {
+        replaced->close(false);
     }
-    return false;
+    for (auto &standbyCamera : closing) {
+        standbyCamera->close(true);
+    }
+    // Not silently: they are told and resume once this one stops.
+    for (auto &lostCamera : lost) {
+        lostCamera->lostCamera();
+    }
+    return access;
 }
 
 DroidCamera::DroidCamera(DroidCameraManager *manager, int cameraNumber)
@@ -307,6 +827,10 @@ DroidCamera::DroidCamera(DroidCameraManager *manager, int cameraNumber)
     , started(false)
     , exclusiveAccess(false)
 {
+    CameraInfo info;
+    manager->getCameraInfo(cameraNumber, info);
+    latencyStream = LatencyStream::get(info.id);
+    m_bufferPool.setLatencyStream(latencyStream);
 }
 
 int DroidCamera::getNumber()
@@ -339,6 +863,7 @@ bool DroidCamera::openUnlocked()
 
     handle = droid_media_camera_connect(cameraNumber);
     if (handle) {
+        parametersApplied = false;
         DroidMediaCameraCallbacks camera_cb;
         DroidMediaBufferQueue *queue;
 
@@ -377,7 +902,7 @@ bool DroidCamera::openUnlocked()
 
     // HAL may not support multi camera feature. Let's close other cameras
     // and try again.
-    if (!exclusiveAccess) {
+    if (!exclusiveAccess && allowExclusiveAccess) {
         exclusiveAccess = true;
         return openUnlocked();
     }
@@ -405,9 +930,21 @@ bool DroidCamera::getParameters(shared_ptr<DroidCameraParams> &params)
 bool DroidCamera::applyParameters(void)
 {
     if (currentParameters.get()) {
-        string applyParams = currentParameters->toString();
-        LOGD(applyParams);
-        return droid_media_camera_set_parameters(handle, applyParams.c_str());
+        // A new connection starts from the HAL defaults.
+        if (parametersApplied && !currentParameters->changed()) {
+            LOGD(this << "parameters unchanged");
+            return true;
+        }
+        LOGD(this << "changed " << currentParameters->changes());
+        // HAL1 resets what is missing from the string, so it always gets
+        // all parameters.
+        currentParameters->serialize(parameterString);
+        if (!droid_media_camera_set_parameters(handle, parameterString.c_str())) {
+            return false;
+        }
+        currentParameters->markApplied();
+        parametersApplied = true;
+        return true;
     }
     return false;
 }
@@ -417,8 +954,17 @@ bool DroidCamera::queryCapabilities(vector<CameraCapability> &caps)
     if (open()) {
         shared_ptr<DroidCameraParams> params;
         if (getParameters(params)) {
+            // HAL1 doesn't tell which rates each size supports, assume all.
+            // Report every maximum rate once, with its widest range.
+            map<unsigned int, unsigned int, greater<unsigned int>> fpsRanges;
+            for (auto const& [minFps, maxFps] : params->getFpsRanges()) {
+                auto it = fpsRanges.find(maxFps);
+                if (it == fpsRanges.end() || minFps < it->second) {
+                    fpsRanges[maxFps] = minFps;
+                }
+            }
+
             for (string res : params->getValues("video-size-values")) {
-                CameraCapability cap;
                 int width, height;
 
                 if (2 != sscanf(res.c_str(), "%dx%d", &width, &height)) {
@@ -427,11 +973,14 @@ bool DroidCamera::queryCapabilities(vector<CameraCapability> &caps)
 
                 LOGD(this << "supports pixel mode " << width << "x" << height);
 
-                cap.width = width;
-                cap.height = height;
-                // FIXME: Is fps fixed?
-                cap.fps = 30;
-                caps.push_back(cap);
+                for (auto const& [maxFps, minFps] : fpsRanges) {
+                    CameraCapability cap;
+                    cap.width = width;
+                    cap.height = height;
+                    cap.fps = maxFps;
+                    cap.minFps = minFps;
+                    caps.push_back(cap);
+                }
             }
             return true;
         }
@@ -440,22 +989,136 @@ bool DroidCamera::queryCapabilities(vector<CameraCapability> &caps)
     return false;
 }
 
+bool DroidCamera::openShared()
+{
+    scoped_lock lock(cameraLock);
+    allowExclusiveAccess = false;
+    bool opened = openUnlocked();
+    allowExclusiveAccess = true;
+    return opened;
+}
+
+bool DroidCamera::probe(vector<CameraCapability> &caps)
+{
+    {
+        scoped_lock lock(cameraLock);
+        allowExclusiveAccess = false;
+        if (!openUnlocked()) {
+            return false;
+        }
+    }
+    return queryCapabilities(caps);
+}
+
 void DroidCamera::closeUnlocked()
 {
     LOGI(this);
 
     if (handle) {
-        if (started) {
-            droid_media_camera_stop_recording(handle);
-            droid_media_camera_stop_preview(handle);
-            started = false;
-        }
+        stopStreamsUnlocked();
         droid_media_camera_disconnect(handle);
         handle = nullptr;
     }
 }
 
+void DroidCamera::stopStreamsUnlocked()
+{
+    if (started) {
+        // Queued frames must be returned while the handle is valid.
+        flushFrames();
+        droid_media_camera_stop_recording(handle);
+        droid_media_camera_stop_preview(handle);
+        started = false;
+    }
+}
+
+void DroidCamera::close(bool onlyStopped)
+{
+    scoped_lock lock(cameraLock);
+    if (!onlyStopped || !started) {
+        closeUnlocked();
+    }
+}
+
 bool DroidCamera::startCapture(const CameraCapability &cap)
+{
+    manager->leaveStandby(this);
+    if (captureStarted()) {
+        return true;
+    }
+
+    // The modes to downgrade to. Querying them could connect another
+    // instance of the camera.
+    vector<CameraCapability> modes = manager->knownCapabilities(cameraNumber);
+    {
+        scoped_lock lock(cameraLock);
+        requestedCapability = cap;
+    }
+
+    CameraCapability granted = cap;
+    switch (manager->captureArbiter().request(shared_from_this(), capturePriority(),
+                                               granted, modes)) {
+    case CaptureArbiter::Queued:
+        deliverCaptureState(CaptureQueued, cap);
+        return true;
+    case CaptureArbiter::Downgraded:
+        deliverCaptureState(CaptureDowngraded, granted);
+        break;
+    case CaptureArbiter::Granted:
+        break;
+    }
+    if (!startGranted(granted)) {
+        manager->captureArbiter().release(this);
+        return false;
+    }
+    return true;
+}
+
+void DroidCamera::captureGranted(const CameraCapability &cap)
+{
+    if (!startGranted(cap)) {
+        manager->captureArbiter().release(this);
+        deliverError("Cannot start the capture");
+        return;
+    }
+    CameraCapability requested;
+    {
+        scoped_lock lock(cameraLock);
+        requested = requestedCapability;
+    }
+    bool downgraded = cap.width != requested.width || cap.height != requested.height;
+    deliverCaptureState(downgraded ? CaptureDowngraded : CaptureStarted, cap);
+}
+
+void DroidCamera::capturePreempted()
+{
+    CameraCapability requested;
+    {
+        scoped_lock lock(cameraLock);
+        // Disconnect, the HAL may need the sensor for the other camera.
+        closeUnlocked();
+        requested = requestedCapability;
+    }
+    deliverCaptureState(CapturePreempted, requested);
+}
+
+void DroidCamera::lostCamera()
+{
+    CameraCapability requested;
+    {
+        scoped_lock lock(cameraLock);
+        if (!started) {
+            closeUnlocked();
+            return;
+        }
+        closeUnlocked();
+        requested = requestedCapability;
+    }
+    manager->captureArbiter().requeue(this);
+    deliverCaptureState(CapturePreempted, requested);
+}
+
+bool DroidCamera::startGranted(const CameraCapability &cap)
 {
     scoped_lock lock(cameraLock);
 
@@ -472,6 +1135,9 @@ bool DroidCamera::startCapture(const CameraCapability &cap)
             if (!getParameters(params) || !params->setCapability(cap)) {
                 goto err_unlock;
             }
+            if (focusModeSet) {
+                params->setFocusMode(focusMode);
+            }
 
             if (!applyParameters()) {
                 goto err_unlock;
@@ -496,12 +1162,139 @@ err_unlock:
     return false;
 }
 
-bool DroidCamera::stopCapture()
+bool DroidCamera::changeCapture(const CameraCapability &cap)
 {
-    scoped_lock lock(cameraLock);
+    bool changed = false;
+    bool closed = false;
+    {
+        scoped_lock lock(cameraLock);
+        shared_ptr<DroidCameraParams> params;
+        if (!started || !getParameters(params)) {
+            return false;
+        }
+        CameraCapability previous = params->currentCapability;
+
+        // The arbiter only learns about the mode once the camera runs it.
+        changed = changeCaptureUnlocked(cap);
+        if (changed && !manager->captureArbiter().update(this, cap)) {
+            LOGI(this << cap.width << "x" << cap.height << " doesn't fit next to the other cameras");
+            changed = false;
+            changeCaptureUnlocked(previous);
+        }
+        if (changed) {
+            requestedCapability = cap;
+        }
+        closed = !started;
+    }
+    // A failed restart closed the camera. Not under cameraLock, other
+    // cameras may be granted.
+    if (closed) {
+        manager->captureArbiter().release(this);
+    }
+    return changed;
+}
 
-    LOGI(this);
+void DroidCamera::captureChanged(const CameraCapability &cap)
+{
+    CameraCapability requested;
+    bool changed;
+    bool closed;
+    {
+        scoped_lock lock(cameraLock);
+        if (!started) {
+            return;
+        }
+        changed = changeCaptureUnlocked(cap);
+        closed = !started;
+        requested = requestedCapability;
+    }
+    if (closed) {
+        manager->captureArbiter().release(this);
+    }
+    if (!changed) {
+        return;
+    }
+    bool downgraded = cap.width != requested.width || cap.height != requested.height;
+    deliverCaptureState(downgraded ? CaptureDowngraded : CaptureStarted, cap);
+}
+
+bool DroidCamera::changeCaptureUnlocked(const CameraCapability &cap)
+{
+    shared_ptr<DroidCameraParams> params;
+    if (!getParameters(params)) {
+        return false;
+    }
+
+    CameraCapability current = params->currentCapability;
+    if (cap.width == current.width && cap.height == current.height) {
+        // The frame rate can change while streaming.
+        params->setFpsRange(cap);
+        if (applyParameters()) {
+            return true;
+        }
+        params->setFpsRange(current);
+        return false;
+    }
+
+    // A new size needs the streams to be restarted.
+    LOGI(this << "restarting for " << cap.width << "x" << cap.height);
+    flushFrames();
+    droid_media_camera_stop_recording(handle);
+    droid_media_camera_stop_preview(handle);
+    if (!params->setCapability(cap) || !applyParameters()) {
+        params->setCapability(current);
+        applyParameters();
+    }
+    if (droid_media_camera_start_preview(handle)) {
+        if (droid_media_camera_start_recording(handle)) {
+            return params->currentCapability.width == cap.width
+                   && params->currentCapability.height == cap.height;
+        }
+        droid_media_camera_stop_preview(handle);
+    }
+    LOGE(this << "Failed to restart capture");
     closeUnlocked();
+    deliverError("Cannot restart the capture");
+    return false;
+}
+
+bool DroidCamera::setFocusMode(CameraFocusMode mode)
+{
+    scoped_lock lock(cameraLock);
+    focusMode = mode;
+    focusModeSet = true;
+
+    shared_ptr<DroidCameraParams> params;
+    if (!started || !getParameters(params)) {
+        // Applied by startCapture()
+        return true;
+    }
+    return params->setFocusMode(mode) && applyParameters();
+}
+
+bool DroidCamera::stopCapture()
+{
+    // Asked before taking cameraLock.
+    bool keepsStandby = manager->keepsStandby();
+    bool standby;
+    {
+        scoped_lock lock(cameraLock);
+        LOGI(this);
+        // The connection of a camera which captured is worth keeping, it
+        // has the parameters applied.
+        standby = started && !exclusiveAccess && keepsStandby;
+        if (standby) {
+            stopStreamsUnlocked();
+        } else {
+            closeUnlocked();
+        }
+    }
+    // Also gives up a queued request. The cameras granted now may need
+    // this one closed already.
+    manager->captureArbiter().release(this);
+    if (standby) {
+        manager->enterStandby(shared_from_this());
+    }
     return true;
 }
 
@@ -513,17 +1306,16 @@ bool DroidCamera::captureStarted() const
 void DroidCamera::error_cb(void *user, int arg)
 {
     DroidCamera *camera = (DroidCamera *)user;
-    camera->cameraListener->onCameraError(to_string(arg));
+    camera->deliverError(to_string(arg));
 }
 
 void DroidCamera::video_frame_cb(void *user, DroidMediaCameraRecordingData *data)
 {
     DroidCamera *camera = (DroidCamera *)user;
     // Always create the buffer even if the listener is not set
-    shared_ptr<DroidCameraGraphicBuffer> buffer = make_shared<DroidCameraGraphicBuffer>(camera, data);
-    if (camera->cameraListener) {
-        camera->cameraListener->onCameraFrame(buffer);
-    }
+    shared_ptr<DroidCameraGraphicBuffer> buffer =
+        allocateShared<DroidCameraGraphicBuffer>(camera->m_recordingBufferPool, camera, data);
+    camera->deliverFrame(move(buffer));
 }
 
 void DroidCamera::buffers_released_cb(void *user)
@@ -542,10 +1334,12 @@ bool DroidCamera::frame_available_cb(void *user, DroidMediaBuffer *droidBuffer)
 {
     DroidCamera *camera = (DroidCamera *)user;
 
-    if (droidBuffer && camera->cameraListener) {
+    if (droidBuffer) {
         shared_ptr<GraphicBuffer> buffer = camera->m_bufferPool.acquire(droidBuffer);
-        camera->cameraListener->onCameraFrame(buffer);
-        return true;
+        if (buffer) {
+            camera->deliverFrame(move(buffer));
+            return true;
+        }
     }
     // Tell droidmedia to release the buffer.
     return false;
@@ -611,13 +1405,27 @@ DroidCameraYCbCrFrame::DroidCameraYCbCrFrame()
 
 shared_ptr<const YCbCrFrame> DroidCameraGraphicBuffer::mapYCbCr()
 {
-    shared_ptr<DroidCameraYCbCrFrame> ptr = make_shared<DroidCameraYCbCrFrame>();
+    scoped_lock lock(mapLock);
+    shared_ptr<const YCbCrFrame> frame = ycbcrFrame.lock();
+    if (frame) {
+        recordMapping(true);
+        return frame;
+    }
+
+    shared_ptr<DroidCameraYCbCrFrame> ptr =
+        allocateShared<DroidCameraYCbCrFrame>(camera->m_recordingFramePool);
     bool success = false;
 
     success = ptr->map(this, camera->currentParameters->ycbcrTemplate,
         static_cast<const uint8_t *>(droid_media_camera_recording_frame_get_data(recordingData)));
 
-    return success ? static_pointer_cast<YCbCrFrame>(ptr) : nullptr;
+    if (!success) {
+        return nullptr;
+    }
+    camera->latencyStream->record(LatencyMapped, timestampUs);
+    recordMapping(false);
+    ycbcrFrame = ptr;
+    return ptr;
 }
 
 shared_ptr<const RawImageFrame> DroidCameraGraphicBuffer::map()
@@ -631,72 +1439,108 @@ DroidCameraGraphicBuffer::~DroidCameraGraphicBuffer()
     droid_media_camera_release_recording_frame(camera->handle, recordingData);
 }
 
-DroidCameraParams::DroidCameraParams(string inp)
+DroidCameraParams::DroidCameraParams(const char *params)
 {
-    size_t pos = 0, nextPos;
-    const string delimiter = ";";
-
-    LOGD(inp);
-
-    while ((nextPos = inp.find(delimiter, pos)) != string::npos) {
-        string token = inp.substr(pos, nextPos - pos);
-        size_t eqsPos = token.find("=");
-        string key = token.substr(0, eqsPos);
-        string value = token.substr(eqsPos + 1);
-        params.insert_or_assign(key, value);
-        // skip delimiter
-        pos = nextPos + 1;
-    }
+    LOGD(params);
+    store.parse(params);
 }
 
-string DroidCameraParams::getValue(const string &key)
+string_view DroidCameraParams::getValue(string_view key) const
 {
-    auto val = params.find(key);
-    if (val == params.end()) {
-        return string();
-    } else {
-        return val->second;
-    }
+    return store.get(key);
 }
 
-vector<string> DroidCameraParams::getValues(const string &key)
+vector<string> DroidCameraParams::getValues(string_view key) const
 {
-    string valStr = getValue(key);
+    string valStr(getValue(key));
     vector<string> vals;
     size_t pos = 0, nextPos;
     string delimiter = ",";
 
+    if (valStr.empty()) {
+        return vals;
+    }
     while ((nextPos = valStr.find(delimiter, pos)) != string::npos) {
         string token = valStr.substr(pos, nextPos - pos);
         vals.push_back(token);
         pos = nextPos + 1;
     }
+    vals.push_back(valStr.substr(pos));
     return vals;
 }
 
-string DroidCameraParams::toString() const
+vector<pair<unsigned int, unsigned int>> DroidCameraParams::getFpsRanges() const
 {
-    ostringstream buffer;
-    for (auto const& [key, val] : params) {
-        buffer << key << "=" << val << ";";
+    vector<pair<unsigned int, unsigned int>> ranges;
+
+    // "(15000,30000),(30000,30000)" in thousandths of fps
+    string valStr(getValue("preview-fps-range-values"));
+    const char *str = valStr.c_str();
+    unsigned int minFps, maxFps;
+    while ((str = strchr(str, '('))) {
+        if (2 == sscanf(str, "(%u,%u)", &minFps, &maxFps) && minFps <= maxFps && maxFps) {
+            ranges.emplace_back(minFps / 1000, (maxFps + 500) / 1000);
+        }
+        str++;
+    }
+
+    // Older HALs only list fixed rates.
+    if (ranges.empty()) {
+        vector<string> rates = getValues("video-fps-values");
+        if (rates.empty()) {
+            rates = getValues("preview-frame-rate-values");
+        }
+        for (const string &rate : rates) {
+            if (1 == sscanf(rate.c_str(), "%u", &maxFps) && maxFps) {
+                ranges.emplace_back(maxFps, maxFps);
+            }
+        }
+    }
+
+    if (ranges.empty()) {
+        ranges.emplace_back(30, 30);
     }
-    return buffer.str();
+    return ranges;
 }
 
-bool DroidCameraParams::setValue(const string &key, const string &value)
+bool DroidCameraParams::setValue(string_view key, string_view value)
 {
-    auto it = params.find(key);
-    if (it != params.end()) {
-        it->second = value;
+    if (store.set(key, value)) {
         LOGD(key << "=" << value);
         return true;
     }
     return false;
 }
 
+bool DroidCameraParams::setFocusMode(CameraFocusMode mode)
+{
+    const char *value;
+    switch (mode) {
+    case CameraFocusAuto:
+        value = "auto";
+        break;
+    case CameraFocusContinuousVideo:
+        value = "continuous-video";
+        break;
+    case CameraFocusInfinity:
+        value = "infinity";
+        break;
+    default:
+        value = "fixed";
+        break;
+    }
+    for (const string &supported : getValues("focus-mode-values")) {
+        if (supported == value) {
+            return setValue("focus-mode", value);
+        }
+    }
+    LOGD("Focus mode " << value << " is not supported");
+    return false;
+}
+
 bool DroidCameraParams::setCapability(CameraCapability cap)
 {
-    string videoFormat = getValue("video-frame-format");
+    string_view videoFormat = getValue("video-frame-format");
 
 #define _ALIGN_SIZE(sz, align) (((sz) + (align) - 1) & ~((align) - 1))
 
@@ -723,10 +1567,41 @@ bool DroidCameraParams::setCapability(CameraCapability cap)
 
 #undef _ALIGN_SIZE
 
-    ostringstream buffer;
+    setFpsRange(cap);
     currentCapability = cap;
-    buffer << cap.width << "x" << cap.height;
-    return setValue("video-size", buffer.str());
+    return setValue("video-size", to_string(cap.width) + "x" + to_string(cap.height));
+}
+
+void DroidCameraParams::setFpsRange(const CameraCapability &cap)
+{
+    // Pick the supported range closest to the requested one, preferring
+    // ranges reaching the requested rate.
+    string range;
+    unsigned int minFps = cap.minFps && cap.minFps <= cap.fps ? cap.minFps : cap.fps;
+    unsigned int bestScore = UINT_MAX;
+    string valStr(getValue("preview-fps-range-values"));
+    const char *str = valStr.c_str();
+    while ((str = strchr(str, '('))) {
+        unsigned int rangeMin, rangeMax;
+        if (2 == sscanf(str, "(%u,%u)", &rangeMin, &rangeMax)) {
+            unsigned int maxFps = (rangeMax + 500) / 1000;
+            unsigned int score = (maxFps < cap.fps ? 1000 : 0)
+                                 + (unsigned int)abs((int)maxFps - (int)cap.fps) * 10
+                                 + (unsigned int)abs((int)(rangeMin / 1000) - (int)minFps);
+            if (score < bestScore) {
+                bestScore = score;
+                range = to_string(rangeMin) + "," + to_string(rangeMax);
+            }
+        }
+        str++;
+    }
+    if (!range.empty()) {
+        LOGD("Frame rate range " << range << " for " << minFps << "-" << cap.fps << " fps");
+        setValue("preview-fps-range", range);
+    }
+    setValue("preview-frame-rate", to_string(cap.fps));
+    currentCapability.fps = cap.fps;
+    currentCapability.minFps = cap.minFps;
 }
 
 static DroidCameraManager droidCameraManager;
@@ -20,8 +20,13 @@
 #include <sstream>
 #include <functional>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 
 #include <geckocamera-codec.h>
+#include <geckocamera-convert.h>
+#include <geckocamera-pool.h>
 #include <droidmediacodec.h>
 #include <droidmediaconstants.h>
 
@@ -51,6 +56,12 @@ static const char *codecTypeToDroidMime(CodecType codecType)
     return NULL;
 }
 
+static LatencyStream *codecLatencyStream(const char *prefix, CodecType codecType)
+{
+    const char *mime = codecTypeToDroidMime(codecType);
+    return LatencyStream::get(string(prefix) + ":" + (mime ? mime : "unknown"));
+}
+
 class DroidVideoFrameYUVMapper
 {
 public:
@@ -194,6 +205,8 @@ public:
 
     bool init(VideoEncoderMetadata metadata);
     bool encode(shared_ptr<const YCbCrFrame> frame, bool forceSync);
+    bool getStats(VideoEncoderStats &stats);
+    RateUpdate setRates(int bitrate, int framerate) override;
 
     void dataAvailable(DroidMediaCodecData *encoded);
     void error(string errorDescription);
@@ -203,12 +216,33 @@ private:
     static void signal_eos_cb(void *data);
     static void DataAvailableCallback(void *data, DroidMediaCodecData *encoded);
 
+    YCbCrFrame codecLayout(uint8_t *buffer) const;
+    bool startCodec();
+
     CodecType m_codecType;
     DroidMediaCodecEncoderMetaData m_metadata;
+    // Held while queueing and while setRates() restarts the codec
+    mutex m_codecLock;
     DroidMediaCodec *m_codec = nullptr;
     DroidMediaColourFormatConstants m_constants;
+    size_t m_frameSize = 0;
+    shared_ptr<BufferPool> m_bufferPool;
+    // Keeps input frames alive while the codec reads them directly
+    shared_ptr<RefPool<const YCbCrFrame>> m_frameRefs;
+    atomic<uint64_t> m_framesQueued = 0;
+    atomic<uint64_t> m_framesEncoded = 0;
+    atomic<uint64_t> m_framesZeroCopy = 0;
+    LatencyStream *m_latency;
 };
 
+// Number of staging buffers allocated up front. The codec holds on to
+// a few input buffers, the pool grows if it needs more.
+static const unsigned int ENCODER_STAGING_BUFFERS = 4;
+// Frames queued to the decoder and not yet consumed. droidmedia blocks
+// inside droid_media_codec_queue() instead of reporting a full queue, so
+// the decoder limits the frames in flight itself.
+static const unsigned int DECODER_INPUT_CREDITS = 4;
+
 class DroidVideoDecoder : public VideoDecoder, public DroidObject
 {
 public:
@@ -226,6 +260,12 @@ public:
                 FrameType frameType,
                 void (*release)(void *),
                 void *releaseData) override;
+    DecodeResult tryDecode(const uint8_t *data,
+                           size_t size,
+                           uint64_t timestampUs,
+                           FrameType frameType,
+                           void (*release)(void *),
+                           void *releaseData) override;
     void drain() override;
     void flush() override;
     void stop() override;
@@ -237,9 +277,23 @@ public:
     bool ProcessMediaBuffer(DroidMediaBuffer *droidBuffer);
 
 private:
+    struct Input {
+        DroidVideoDecoder *decoder;
+        void (*release)(void *);
+        void *releaseData;
+    };
+
     bool createCodec();
+    DecodeResult queueInput(const uint8_t *data,
+                            size_t size,
+                            uint64_t timestampUs,
+                            FrameType frameType,
+                            void (*release)(void *),
+                            void *releaseData,
+                            bool block);
 
     static void dummyRelease(void *);
+    static void inputReleased(void *data);
 
     static void data_available_cb(void *data, DroidMediaCodecData *decoded);
     static void error_cb(void *data, int err);
@@ -256,6 +310,13 @@ private:
     DroidMediaBufferQueue *m_buffer_queue = nullptr;
     bool m_use_media_buffers = false;
     DroidGraphicBufferPool m_bufferPool;
+    LatencyStream *m_latency;
+
+    mutex m_inputLock;
+    condition_variable m_inputCond;
+    Input m_inputs[DECODER_INPUT_CREDITS];
+    vector<Input *> m_freeInputs;
+    bool m_creditWanted = false;
 };
 
 bool DroidCodecManager::init()
@@ -305,6 +366,10 @@ bool DroidCodecManager::videoDecoderAvailable(CodecType codecType)
 bool DroidCodecManager::createVideoEncoder(CodecType codecType, shared_ptr<VideoEncoder> &encoder)
 {
     LOGD("");
+    // Lets the next plugin, e.g. libvpx, take codecs the hardware lacks.
+    if (!videoEncoderAvailable(codecType)) {
+        return false;
+    }
     encoder = DroidVideoEncoder::create(codecType);
     return true;
 }
@@ -312,6 +377,9 @@ bool DroidCodecManager::createVideoEncoder(CodecType codecType, shared_ptr<Video
 bool DroidCodecManager::createVideoDecoder(CodecType codecType, shared_ptr<VideoDecoder> &decoder)
 {
     LOGD("");
+    if (!videoDecoderAvailable(codecType)) {
+        return false;
+    }
     decoder = DroidVideoDecoder::create(codecType);
     return true;
 }
@@ -337,6 +405,7 @@ bool DroidCodecManager::optionUseMediaBuffers()
 
 DroidVideoEncoder::DroidVideoEncoder(CodecType codecType)
     : m_codecType(codecType)
+    , m_latency(codecLatencyStream("encoder", codecType))
 {
     LOGD("codecType " << codecType);
     memset(&m_metadata, 0, sizeof(m_metadata));
@@ -387,6 +456,13 @@ bool DroidVideoEncoder::init(VideoEncoderMetadata metadata)
     m_metadata.meta_data = false;
     m_metadata.bitrate_mode = DROID_MEDIA_CODEC_BITRATE_CONTROL_CBR;
 
+    // droidmedia doesn't pass on key frame or intra refresh settings, so
+    // the key frames are scheduled here by flagging the input.
+    setKeyFrameInterval(metadata.keyFrameIntervalMs);
+    if (metadata.intraRefreshFrames > 0) {
+        LOGI("Intra refresh is not supported by droidmedia");
+    }
+
     droid_media_colour_format_constants_init (&m_constants);
     m_metadata.color_format = -1;
 
@@ -421,6 +497,22 @@ bool DroidVideoEncoder::init(VideoEncoderMetadata metadata)
          << " bitrate=" << m_metadata.bitrate
          << " color_format=" << m_metadata.color_format);
 
+    scoped_lock lock(m_codecLock);
+    if (!startCodec()) {
+        return false;
+    }
+
+    // The pools outlive the encoder if the codec still holds some buffers.
+    m_frameSize = yuv420BufferSize(m_metadata.parent.width, m_metadata.parent.height,
+                                   m_metadata.stride, m_metadata.slice_height);
+    m_bufferPool = BufferPool::create(m_frameSize, ENCODER_STAGING_BUFFERS);
+    m_frameRefs = RefPool<const YCbCrFrame>::create();
+    return true;
+}
+
+// Called with m_codecLock held
+bool DroidVideoEncoder::startCodec()
+{
     m_codec = droid_media_codec_create_encoder (&m_metadata);
     if (!m_codec) {
         LOGE("Failed to create the encoder");
@@ -457,6 +549,38 @@ bool DroidVideoEncoder::init(VideoEncoderMetadata metadata)
     return true;
 }
 
+RateUpdate DroidVideoEncoder::setRates(int bitrate, int framerate)
+{
+    if (bitrate <= 0 || framerate <= 0) {
+        LOGE("Invalid rates: bitrate=" << bitrate << " fps=" << framerate);
+        return RateUpdateFailed;
+    }
+
+    scoped_lock lock(m_codecLock);
+    if (!m_codec) {
+        LOGE("Encoder is not initialized");
+        return RateUpdateFailed;
+    }
+    if (bitrate == m_metadata.bitrate && framerate == m_metadata.parent.fps) {
+        return RateUpdateInPlace;
+    }
+
+    // droidmedia can't change the parameters of a running codec, so restart
+    // it. The color format and the staging buffers are kept from init().
+    LOGI("Restarting the encoder: bitrate=" << bitrate << " fps=" << framerate);
+    droid_media_codec_stop(m_codec);
+    droid_media_codec_destroy(m_codec);
+    m_codec = nullptr;
+
+    m_metadata.bitrate = bitrate;
+    m_metadata.parent.fps = framerate;
+    if (!startCodec()) {
+        error("Cannot restart the encoder");
+        return RateUpdateFailed;
+    }
+    return RateUpdateRestarted;
+}
+
 bool DroidVideoEncoder::encode(shared_ptr<const YCbCrFrame> frame, bool forceSync)
 {
     LOGV("Encode: timestamp=" << frame->timestampUs << " forceSync=" << forceSync);
@@ -464,52 +588,83 @@ bool DroidVideoEncoder::encode(shared_ptr<const YCbCrFrame> frame, bool forceSyn
     DroidMediaCodecData data;
     DroidMediaBufferCallbacks cb;
 
+    scoped_lock lock(m_codecLock);
     if (!m_codec) {
         LOGE("Encoder is not initialized");
         return false;
     }
 
-    // Copy the frame to contiguous memory buffer, assume it's I420 frame from Gecko.
-    // TODO: Check if the input frame is already I420 and contiguous memory.
-    //       Handle other formats as well.
-    const unsigned y_size = frame->yStride * frame->height;
-    const unsigned u_size = y_size / 4;
-    const unsigned v_size = y_size / 4;
-    uint8_t *buf;
+    m_latency->record(LatencyEncodeQueued, frame->timestampUs);
 
-    LOGV("plane sizes: " << y_size
-         << " " << u_size
-         << " " << v_size
-         << " timestamp: " << frame->timestampUs
-         << " forceSync: " << forceSync);
-
-    buf = (uint8_t *)malloc (y_size + u_size + v_size);
-    data.data.data = buf;
-    data.data.size = y_size + u_size + v_size;
+    const YCbCrFrame layout = codecLayout(const_cast<uint8_t *>(frame->y));
+    if (frame->width != layout.width || frame->height != layout.height) {
+        LOGE("Frame size " << frame->width << "x" << frame->height
+             << " doesn't match the encoder size "
+             << layout.width << "x" << layout.height);
+        return false;
+    }
 
-    memcpy(buf, frame->y, y_size);
-    buf += y_size;
-    if (m_metadata.color_format == m_constants.OMX_COLOR_FormatYUV420Planar) {
-        memcpy(buf, frame->cb, u_size);
-        buf += u_size;
-        memcpy(buf, frame->cr, v_size);
+    // Padding rows past the frame height are not guaranteed to be readable.
+    if (m_metadata.slice_height <= m_metadata.parent.height
+            && frame->yStride == layout.yStride
+            && frame->cStride == layout.cStride
+            && frame->chromaStep == layout.chromaStep
+            && frame->cb == layout.cb
+            && frame->cr == layout.cr) {
+        // The frame is already laid out the way the codec wants it, keep it
+        // alive until the codec releases the input.
+        LOGV("Zero-copy input " << (const void *)frame->y);
+        data.data.data = const_cast<uint8_t *>(frame->y);
+        data.data.size = m_frameSize;
+        cb.unref = RefPool<const YCbCrFrame>::release;
+        cb.data = m_frameRefs->hold(frame);
+        m_framesZeroCopy++;
     } else {
-        const uint8_t *inpU = static_cast<const uint8_t *>(frame->cb);
-        const uint8_t *inpV = static_cast<const uint8_t *>(frame->cr);
-        for (unsigned i = 0; i < u_size + v_size; i += 2) {
-            buf[i] = *inpU++;
-            buf[i + 1] = *inpV++;
+        BufferPool::Buffer *staging = m_bufferPool->acquire(m_frameSize);
+        if (!convertYCbCrFrame(*frame, codecLayout(staging->data()))) {
+            BufferPool::Buffer::release(staging);
+            return false;
         }
+        data.data.data = staging->data();
+        data.data.size = m_frameSize;
+        cb.unref = BufferPool::Buffer::release;
+        cb.data = staging;
     }
 
     data.ts = frame->timestampUs;
-    data.sync = forceSync;
-
-    cb.unref = free;
-    cb.data = data.data.data;
+    data.sync = keyFrameDue(frame->timestampUs, forceSync);
 
     droid_media_codec_queue (m_codec, &data, &cb);
+    m_framesQueued++;
+
+    return true;
+}
+
+YCbCrFrame DroidVideoEncoder::codecLayout(uint8_t *buffer) const
+{
+    if (m_metadata.color_format == m_constants.OMX_COLOR_FormatYUV420Planar) {
+        return makeI420Layout(buffer, m_metadata.parent.width, m_metadata.parent.height,
+                              m_metadata.stride, m_metadata.slice_height);
+    } else {
+        return makeNV12Layout(buffer, m_metadata.parent.width, m_metadata.parent.height,
+                              m_metadata.stride, m_metadata.slice_height);
+    }
+}
 
+bool DroidVideoEncoder::getStats(VideoEncoderStats &stats)
+{
+    stats.framesQueued = m_framesQueued;
+    stats.framesEncoded = m_framesEncoded;
+    stats.framesZeroCopy = m_framesZeroCopy;
+    if (m_bufferPool) {
+        BufferPoolStats poolStats = m_bufferPool->stats();
+        stats.bufferPoolHits = poolStats.hits;
+        stats.bufferPoolMisses = poolStats.misses;
+    } else {
+        stats.bufferPoolHits = 0;
+        stats.bufferPoolMisses = 0;
+    }
+    stats.encodedFramesHeld = encodedFramesHeld();
     return true;
 }
 
@@ -539,11 +694,14 @@ void DroidVideoEncoder::dataAvailable(DroidMediaCodecData *encoded)
          << " timestamp " << encoded->ts / 1000
          << (encoded->sync ? " sync" : ""));
     dump((uint8_t *)encoded->data.data, encoded->data.size);
+    m_framesEncoded++;
 
     if (m_encoderListener) {
+        m_latency->record(LatencyEncoded, encoded->ts / 1000);
         FrameType ft = encoded->sync ? KeyFrame : DeltaFrame;
-        m_encoderListener->onEncodedFrame((uint8_t *)encoded->data.data,
-                                          encoded->data.size, encoded->ts / 1000, ft);
+        // The codec reuses its output buffer as soon as we return.
+        deliverEncodedFrame((uint8_t *)encoded->data.data, encoded->data.size,
+                            encoded->ts / 1000, ft);
     }
 }
 
@@ -578,8 +736,14 @@ void DroidVideoEncoder::DataAvailableCallback(void *data, DroidMediaCodecData *e
 
 DroidVideoDecoder::DroidVideoDecoder(CodecType codecType)
     : m_codecType(codecType)
+    , m_latency(codecLatencyStream("decoder", codecType))
 {
     memset(&m_metadata, 0, sizeof(m_metadata));
+    m_freeInputs.reserve(DECODER_INPUT_CREDITS);
+    for (unsigned int i = 0; i < DECODER_INPUT_CREDITS; i++) {
+        m_inputs[i].decoder = this;
+        m_freeInputs.push_back(&m_inputs[i]);
+    }
 }
 
 DroidVideoDecoder::~DroidVideoDecoder()
@@ -704,6 +868,7 @@ bool DroidVideoDecoder::ProcessMediaBuffer(DroidMediaBuffer *droidBuffer)
     if (droidBuffer && m_decoderListener) {
         shared_ptr<GraphicBuffer> buffer = m_bufferPool.acquire(droidBuffer);
         if (buffer) {
+            m_latency->decoded(buffer->timestampUs);
             m_decoderListener->onDecodedGraphicBuffer(buffer);
             return true;
         } else {
@@ -737,37 +902,100 @@ void DroidVideoDecoder::dummyRelease(void *)
 {
 }
 
-bool DroidVideoDecoder::decode(const uint8_t *data,
-                               size_t size,
-                               uint64_t timestampUs,
-                               FrameType frameType,
-                               void (*release)(void *),
-                               void *releaseData)
+// Called by droidmedia when the codec is done with an input frame.
+void DroidVideoDecoder::inputReleased(void *data)
+{
+    Input *input = static_cast<Input *>(data);
+    DroidVideoDecoder *decoder = input->decoder;
+    bool notify;
+
+    input->release(input->releaseData);
+
+    {
+        scoped_lock lock(decoder->m_inputLock);
+        decoder->m_freeInputs.push_back(input);
+        notify = decoder->m_creditWanted;
+        decoder->m_creditWanted = false;
+    }
+    decoder->m_inputCond.notify_one();
+
+    if (notify && decoder->m_decoderListener) {
+        decoder->m_decoderListener->onDecoderInputCredit();
+    }
+}
+
+DecodeResult DroidVideoDecoder::queueInput(const uint8_t *data,
+                                           size_t size,
+                                           uint64_t timestampUs,
+                                           FrameType frameType,
+                                           void (*release)(void *),
+                                           void *releaseData,
+                                           bool block)
 {
     DroidMediaBufferCallbacks cb;
     DroidMediaCodecData cdata;
+    Input *input;
 
     LOGV("Decode: timestamp=" << timestampUs << " frameType" << frameType);
 
     if (!m_codec && !createCodec()) {
         LOGE("Cannot create decoder");
-        return false;
+        return DecodeError;
     }
 
+    {
+        unique_lock lock(m_inputLock);
+        if (m_freeInputs.empty()) {
+            if (!block) {
+                m_creditWanted = true;
+                return DecodeWouldBlock;
+            }
+            m_inputCond.wait(lock, [this] { return !m_freeInputs.empty(); });
+        }
+        input = m_freeInputs.back();
+        m_freeInputs.pop_back();
+    }
+    input->release = release ? release : DroidVideoDecoder::dummyRelease;
+    input->releaseData = releaseData;
+
     cdata.ts = timestampUs;
     cdata.sync = frameType == KeyFrame;
     cdata.data.size = size;
     cdata.data.data = (void *)(data);
 
-    cb.data = releaseData;
-    cb.unref = release ? release : DroidVideoDecoder::dummyRelease;
+    cb.data = input;
+    cb.unref = DroidVideoDecoder::inputReleased;
+
+    m_latency->decodeQueued(timestampUs);
 
-    // This blocks when the input queue is full
+    // Doesn't block as long as the credits don't exceed the codec queue.
     droid_media_codec_queue (m_codec, &cdata, &cb);
 
     LOGV("Frame queued to decoder");
 
-    return true;
+    return DecodeOk;
+}
+
+bool DroidVideoDecoder::decode(const uint8_t *data,
+                               size_t size,
+                               uint64_t timestampUs,
+                               FrameType frameType,
+                               void (*release)(void *),
+                               void *releaseData)
+{
+    return queueInput(data, size, timestampUs, frameType,
+                      release, releaseData, true) == DecodeOk;
+}
+
+DecodeResult DroidVideoDecoder::tryDecode(const uint8_t *data,
+                                          size_t size,
+                                          uint64_t timestampUs,
+                                          FrameType frameType,
+                                          void (*release)(void *),
+                                          void *releaseData)
+{
+    return queueInput(data, size, timestampUs, frameType,
+                      release, releaseData, false);
 }
 
 void DroidVideoDecoder::drain()
@@ -842,6 +1070,7 @@ void DroidVideoDecoder::dataAvailable(DroidMediaCodecData *decoded)
             return;
         }
         const YCbCrFrame frame = m_mapper.mapYCbCr(decoded);
+        m_latency->decoded(frame.timestampUs);
         m_decoderListener->onDecodedYCbCrFrame(&frame);
     }
 }
@@ -887,7 +1116,20 @@ static DroidCodecManager codecManagerDroid;
 extern "C" __attribute__((visibility("default")))
 gecko::codec::CodecManager *gecko_codec_plugin_manager(void)
 {
-    gecko::codec::codecManagerDroid.init();
+    // droid_media_init() is left to init(), which is timed.
     return &gecko::codec::codecManagerDroid;
 }
+
+// The codecs are checked with droid_media_codec_is_supported() on request.
+extern "C" __attribute__((visibility("default")))
+const gecko::camera::PluginManifest gecko_camera_plugin_manifest = {
+    gecko::camera::PLUGIN_MANIFEST_VERSION,
+    true,
+    gecko::codec::codecMask(gecko::codec::VideoCodecVP8)
+    | gecko::codec::codecMask(gecko::codec::VideoCodecVP9)
+    | gecko::codec::codecMask(gecko::codec::VideoCodecH264),
+    gecko::codec::codecMask(gecko::codec::VideoCodecVP8)
+    | gecko::codec::codecMask(gecko::codec::VideoCodecVP9)
+    | gecko::codec::codecMask(gecko::codec::VideoCodecH264),
+};
 /* vim: set ts=4 et sw=4 tw=80: */
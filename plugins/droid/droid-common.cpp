@@ -95,9 +95,13 @@ bool DroidYCbCrFrame::map(DroidGraphicBuffer *buffer, DroidMediaBuffer *droidBuf
 
 DroidGraphicBuffer::DroidGraphicBuffer(
     DroidObject *parent,
-    DroidMediaBuffer *buffer)
+    DroidMediaBuffer *buffer,
+    LatencyStream *latency,
+    shared_ptr<ObjectPool> framePool)
     : DroidObject(parent)
     , m_droidBuffer(buffer)
+    , m_latency(latency)
+    , m_framePool(move(framePool))
 {
     width = droid_media_buffer_get_width(buffer);
     height = droid_media_buffer_get_height(buffer);
@@ -112,29 +116,60 @@ DroidGraphicBuffer::~DroidGraphicBuffer()
 
 shared_ptr<const YCbCrFrame> DroidGraphicBuffer::mapYCbCr()
 {
-    shared_ptr<DroidYCbCrFrame> ptr = make_shared<DroidYCbCrFrame>(this);
+    scoped_lock lock(m_mapLock);
+    shared_ptr<const YCbCrFrame> frame = m_ycbcrFrame.lock();
+    if (frame) {
+        recordMapping(true);
+        return frame;
+    }
+
+    shared_ptr<DroidYCbCrFrame> ptr = m_framePool
+        ? allocateShared<DroidYCbCrFrame>(m_framePool, this)
+        : make_shared<DroidYCbCrFrame>(this);
     bool success = false;
 
     if (m_droidBuffer && imageFormat == ImageFormat::YCbCr) {
         success = ptr->map(this, m_droidBuffer);
     }
-    return success ? static_pointer_cast<YCbCrFrame>(ptr) : nullptr;
+    if (!success) {
+        return nullptr;
+    }
+    if (m_latency) {
+        m_latency->record(LatencyMapped, timestampUs);
+    }
+    recordMapping(false);
+    m_ycbcrFrame = ptr;
+    return ptr;
 }
 
 shared_ptr<const RawImageFrame> DroidGraphicBuffer::map()
 {
+    scoped_lock lock(m_mapLock);
+    shared_ptr<const RawImageFrame> frame = m_rawFrame.lock();
+    if (frame) {
+        recordMapping(true);
+        return frame;
+    }
+
     shared_ptr<DroidRawImageFrame> ptr = make_shared<DroidRawImageFrame>(this);
     bool success = false;
 
     if (m_droidBuffer) {
         success = ptr->map(this, m_droidBuffer);
     }
-    return success ? static_pointer_cast<RawImageFrame>(ptr) : nullptr;
+    if (!success) {
+        return nullptr;
+    }
+    recordMapping(false);
+    m_rawFrame = ptr;
+    return ptr;
 }
 
-DroidGraphicBufferPool::Item::Item(DroidObject *parent, DroidMediaBuffer *buffer)
+DroidGraphicBufferPool::Item::Item(DroidObject *parent, DroidMediaBuffer *buffer,
+                                   LatencyStream *latency)
     : DroidObject(parent)
     , m_buffer(buffer)
+    , m_latency(latency)
 {
 }
 
@@ -143,15 +178,18 @@ DroidGraphicBufferPool::Item::~Item()
     droid_media_buffer_destroy(m_buffer);
 }
 
-std::shared_ptr<GraphicBuffer> DroidGraphicBufferPool::Item::acquire()
+std::shared_ptr<GraphicBuffer> DroidGraphicBufferPool::Item::acquire(
+    const shared_ptr<ObjectPool> &bufferPool,
+    const shared_ptr<ObjectPool> &framePool)
 {
-    return std::make_shared<DroidGraphicBuffer>(this, m_buffer);
+    return allocateShared<DroidGraphicBuffer>(bufferPool, this, m_buffer,
+                                              m_latency, framePool);
 }
 
 bool DroidGraphicBufferPool::bind(DroidObject *parent, DroidMediaBuffer *buffer)
 {
     // Create the new pool item and store its index+1 in buffer's user data
-    m_items.push_back(make_shared<Item>(parent, buffer));
+    m_items.push_back(make_shared<Item>(parent, buffer, m_latency));
     droid_media_buffer_set_user_data(buffer, (void*)m_items.size());
     return true;
 }
@@ -160,7 +198,7 @@ shared_ptr<GraphicBuffer> DroidGraphicBufferPool::acquire(DroidMediaBuffer *buff
 {
     size_t index = (size_t)droid_media_buffer_get_user_data(buffer);
     if (index && index <= m_items.size()) {
-        return m_items[index - 1]->acquire();
+        return m_items[index - 1]->acquire(m_bufferPool, m_framePool);
     }
     return nullptr;
 }
@@ -177,6 +215,7 @@ public:
     {
         if (!m_initialized) {
             readCpuInfo();
+            readBuildFingerprint();
             m_initialized = true;
         }
     }
@@ -227,6 +266,27 @@ private:
         return false;
     }
 
+    static string buildProperty(const char *path, const string &key)
+    {
+        string line;
+        ifstream props(path);
+        while (getline(props, line)) {
+            if (startswith(line, key + "=")) {
+                return line.substr(key.size() + 1);
+            }
+        }
+        return string();
+    }
+
+    void readBuildFingerprint()
+    {
+        string system = buildProperty("/system/build.prop", "ro.build.fingerprint");
+        string vendor = buildProperty("/vendor/build.prop", "ro.vendor.build.fingerprint");
+        if (!system.empty() || !vendor.empty()) {
+            buildFingerprint = system + ";" + vendor;
+        }
+    }
+
     bool m_initialized = false;
 };
 
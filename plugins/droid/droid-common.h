@@ -20,10 +20,13 @@
 #define __GECKOCAMERA_DROID_COMMON__
 
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <droidmedia.h>
 
 #include "geckocamera.h"
+#include "geckocamera-latency.h"
+#include "geckocamera-pool.h"
 
 namespace gecko {
 namespace camera {
@@ -82,12 +85,16 @@ class DroidGraphicBuffer : public GraphicBuffer, public DroidObject
 public:
     static std::shared_ptr<DroidGraphicBuffer> create(
         DroidObject *parent,
-        DroidMediaBuffer *buffer)
+        DroidMediaBuffer *buffer,
+        LatencyStream *latency = nullptr)
     {
-        return std::make_shared<DroidGraphicBuffer>(parent, buffer);
+        return std::make_shared<DroidGraphicBuffer>(parent, buffer, latency);
     }
 
-    explicit DroidGraphicBuffer(DroidObject *parent, DroidMediaBuffer *buffer);
+    // The YCbCr frames are allocated from framePool if it is set.
+    explicit DroidGraphicBuffer(DroidObject *parent, DroidMediaBuffer *buffer,
+                                LatencyStream *latency = nullptr,
+                                std::shared_ptr<ObjectPool> framePool = nullptr);
 
     ~DroidGraphicBuffer();
 
@@ -96,6 +103,13 @@ public:
 
 private:
     DroidMediaBuffer *m_droidBuffer;
+    LatencyStream *m_latency;
+    std::shared_ptr<ObjectPool> m_framePool;
+
+    // Mappings shared by concurrent callers, each one locks the buffer
+    std::mutex m_mapLock;
+    std::weak_ptr<const YCbCrFrame> m_ycbcrFrame;
+    std::weak_ptr<const RawImageFrame> m_rawFrame;
 };
 
 
@@ -106,19 +120,31 @@ public:
     bool bind(DroidObject *parent, DroidMediaBuffer *buffer);
     void clear();
 
+    // Record mapping latencies of the acquired buffers
+    void setLatencyStream(LatencyStream *latency)
+    {
+        m_latency = latency;
+    }
+
 private:
     class Item : public DroidObject
     {
     public:
-        Item(DroidObject *parent, DroidMediaBuffer *buffer);
+        Item(DroidObject *parent, DroidMediaBuffer *buffer, LatencyStream *latency);
         ~Item();
-        std::shared_ptr<GraphicBuffer> acquire();
+        std::shared_ptr<GraphicBuffer> acquire(const std::shared_ptr<ObjectPool> &bufferPool,
+                                               const std::shared_ptr<ObjectPool> &framePool);
 
     private:
         DroidMediaBuffer *m_buffer;
+        LatencyStream *m_latency;
     };
 
     std::vector<std::shared_ptr<Item>> m_items;
+    LatencyStream *m_latency = nullptr;
+    // The per-frame wrappers are recycled to avoid heap allocations.
+    std::shared_ptr<ObjectPool> m_bufferPool = ObjectPool::create();
+    std::shared_ptr<ObjectPool> m_framePool = ObjectPool::create();
 };
 
 struct DroidSystemInfo {
@@ -129,6 +155,8 @@ struct DroidSystemInfo {
         Unknown
     };
     CpuVendor cpuVendor = CpuVendor::Unknown;
+    // Identifies the Android system and vendor builds, empty if unknown.
+    std::string buildFingerprint;
 
     static DroidSystemInfo& get();
     static bool envIsSet(const char *env);
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+
+#include "droid-params.h"
+
+namespace gecko {
+namespace camera {
+
+using namespace std;
+
+void DroidParameterStore::parse(const char *params)
+{
+    m_params.assign(params);
+    m_entries.clear();
+    m_changes = 0;
+
+    string_view str(m_params);
+    m_entries.reserve(count(str.begin(), str.end(), ';') + 1);
+
+    size_t pos = 0;
+    while (pos < str.size()) {
+        size_t end = str.find(';', pos);
+        if (end == string_view::npos) {
+            end = str.size();
+        }
+        string_view token = str.substr(pos, end - pos);
+        size_t eq = token.find('=');
+        if (eq != string_view::npos && eq > 0) {
+            m_entries.push_back(Entry{token.substr(0, eq), token.substr(eq + 1),
+                                      (uint32_t)m_entries.size(), false, string()});
+        }
+        pos = end + 1;
+    }
+
+    sort(m_entries.begin(), m_entries.end(), [](const Entry &a, const Entry &b) {
+        return a.key < b.key || (a.key == b.key && a.position < b.position);
+    });
+    // Keep the last of duplicate keys.
+    auto last = m_entries.begin();
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+        if (it == last) {
+            continue;
+        }
+        if (last->key != it->key && ++last == it) {
+            continue;
+        }
+        *last = move(*it);
+    }
+    if (!m_entries.empty()) {
+        m_entries.erase(last + 1, m_entries.end());
+    }
+}
+
+const DroidParameterStore::Entry *DroidParameterStore::find(string_view key) const
+{
+    auto it = lower_bound(m_entries.begin(), m_entries.end(), key,
+                          [](const Entry &entry, string_view key) {
+                              return entry.key < key;
+                          });
+    return it != m_entries.end() && it->key == key ? &*it : nullptr;
+}
+
+string_view DroidParameterStore::get(string_view key) const
+{
+    const Entry *entry = find(key);
+    return entry ? entry->value : string_view();
+}
+
+bool DroidParameterStore::contains(string_view key) const
+{
+    return find(key) != nullptr;
+}
+
+bool DroidParameterStore::set(string_view key, string_view value)
+{
+    Entry *entry = const_cast<Entry *>(find(key));
+    if (!entry) {
+        return false;
+    }
+    if (entry->value != value) {
+        entry->storage.assign(value.data(), value.size());
+        entry->value = entry->storage;
+        if (!entry->changed) {
+            entry->changed = true;
+            m_changes++;
+        }
+    }
+    return true;
+}
+
+string DroidParameterStore::changedKeys() const
+{
+    string keys;
+    for (const Entry &entry : m_entries) {
+        if (entry.changed) {
+            keys.append(keys.empty() ? "" : ";").append(entry.key)
+                .append("=").append(entry.value);
+        }
+    }
+    return keys;
+}
+
+void DroidParameterStore::markApplied()
+{
+    for (Entry &entry : m_entries) {
+        entry.changed = false;
+    }
+    m_changes = 0;
+}
+
+void DroidParameterStore::serialize(string &out) const
+{
+    out.clear();
+    for (const Entry &entry : m_entries) {
+        out.append(entry.key).append(1, '=').append(entry.value).append(1, ';');
+    }
+}
+
+} // namespace camera
+} // namespace gecko
+
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GECKOCAMERA_DROID_PARAMS__
+#define __GECKOCAMERA_DROID_PARAMS__
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace gecko {
+namespace camera {
+
+// The "key=value;..." parameter string of an Android HAL1 camera. Parsing
+// keeps views into a copy of the string rather than copying every entry,
+// and reuses the storage of the previous parse. Changed keys are tracked,
+// so that applying unchanged parameters can be skipped. Not thread safe.
+class DroidParameterStore
+{
+public:
+    void parse(const char *params);
+
+    // Empty if the key doesn't exist
+    std::string_view get(std::string_view key) const;
+    bool contains(std::string_view key) const;
+    // Only changes keys the camera reported, others are unknown to the
+    // HAL. Setting the current value doesn't mark the key changed.
+    bool set(std::string_view key, std::string_view value);
+
+    size_t size() const
+    {
+        return m_entries.size();
+    }
+
+    bool changed() const
+    {
+        return m_changes != 0;
+    }
+    // Keys set since the last markApplied(), for logging
+    std::string changedKeys() const;
+    void markApplied();
+
+    // The full parameter string, written into out reusing its capacity.
+    void serialize(std::string &out) const;
+
+private:
+    struct Entry {
+        std::string_view key;
+        std::string_view value;
+        // Position in the string, so that the last duplicate wins
+        uint32_t position;
+        bool changed;
+        // Holds the value after set()
+        std::string storage;
+    };
+
+    const Entry *find(std::string_view key) const;
+
+    std::string m_params;
+    // Sorted by key
+    std::vector<Entry> m_entries;
+    unsigned int m_changes = 0;
+};
+
+} // namespace camera
+} // namespace gecko
+
+#endif // __GECKOCAMERA_DROID_PARAMS__
+/* vim: set ts=4 et sw=4 tw=80: */
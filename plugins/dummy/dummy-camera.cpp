@@ -17,38 +17,65 @@
  */
 
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <strings.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <thread>
 #include <chrono>
+#include <deque>
+#include <vector>
 
 #include "geckocamera.h"
+#include "geckocamera-arbiter.h"
+#include "geckocamera-codec.h"
+#include "geckocamera-latency.h"
+#include "geckocamera-pool.h"
 
 using namespace std;
 using namespace gecko::camera;
 
 class DummyCamera;
 
+// Default modes, the largest first like most HALs report them. Can be
+// overridden with GECKO_CAMERA_DUMMY_MODES="1280x720@15-30,3840x2160@60",
+// where a range gives the lowest and the highest frame rate.
+static const char *DEFAULT_MODES =
+    "3840x2160@60,3840x2160@30,1920x1080@60,1920x1080@15-30,"
+    "1280x720@60,1280x720@15-30,640x480@15-30,320x240@15-30";
+
+static unsigned int envValue(const char *name, unsigned int defaultValue)
+{
+    const char *value = getenv(name);
+    return value ? strtoul(value, nullptr, 10) : defaultValue;
+}
+
 class DummyCameraManager : public CameraManager
 {
 public:
     explicit DummyCameraManager() {}
     ~DummyCameraManager() {}
 
-    bool init() override
-    {
-        return true;
-    }
+    bool init() override;
 
     int getNumberOfCameras() override
     {
-        return 1;
+        return m_cameraCount;
     }
 
+    // The first camera keeps the id it had when there was only one.
     bool getCameraInfo(unsigned int num, CameraInfo &info) override
     {
-        info.name = "Dummy camera";
-        info.id = "dummy:rear";
+        if (num >= m_cameraCount) {
+            return false;
+        }
+        info.name = num ? "Dummy camera " + to_string(num) : "Dummy camera";
+        info.id = num ? "dummy:" + to_string(num) : "dummy:rear";
         info.provider = "dummy";
-        info.facing = GECKO_CAMERA_FACING_REAR;
+        info.facing = num == 1 ? GECKO_CAMERA_FACING_FRONT : GECKO_CAMERA_FACING_REAR;
+        info.mountAngle = 0;
         return true;
     }
 
@@ -56,33 +83,117 @@ public:
                            vector<CameraCapability> &caps) override;
 
     bool openCamera(const string &cameraId, shared_ptr<Camera> &camera) override;
+
+    unsigned int maxConcurrentProbes() override
+    {
+        return m_probeLimit ? m_probeLimit : m_cameraCount;
+    }
+
+    bool setStandbyCameras(unsigned int count) override;
+    void enterStandby(shared_ptr<DummyCamera> camera);
+    void leaveStandby(DummyCamera *camera);
+
+    unsigned int openUs() const
+    {
+        return m_openUs;
+    }
+
+    CaptureArbiter &arbiter()
+    {
+        return m_arbiter;
+    }
+
+    const vector<CameraCapability> &modes() const
+    {
+        return m_modes;
+    }
+
+    bool semiPlanar() const
+    {
+        return m_semiPlanar;
+    }
+
+private:
+    static vector<CameraCapability> parseModes(const char *str);
+    int cameraIndexById(const string &cameraId);
+    shared_ptr<DummyCamera> takeStandby(int num);
+
+    vector<CameraCapability> m_modes;
+    bool m_semiPlanar = false;
+    unsigned int m_cameraCount = 1;
+    // Time to connect to a camera and read its capabilities, like a HAL
+    unsigned int m_probeUs = 0;
+    // 0 probes all cameras at once
+    unsigned int m_probeLimit = 0;
+    // Time to connect to a camera and configure it for capture
+    unsigned int m_openUs = 0;
+    // Limits like those of a HAL, set by GECKO_CAMERA_DUMMY_MAX_CAMERAS
+    // and GECKO_CAMERA_DUMMY_MAX_PIXELS
+    CaptureArbiter m_arbiter;
+
+    mutex m_standbyLock;
+    unsigned int m_standbyCount = 0;
+    // The most recently used first
+    deque<shared_ptr<DummyCamera>> m_standby;
+};
+
+// Test picture for one capture mode. Frames point into it at a moving
+// offset, so producing a frame doesn't touch the pixel data.
+class DummyCameraPattern
+{
+public:
+    explicit DummyCameraPattern(unsigned int width, unsigned int height, bool semiPlanar);
+
+    // Fill a frame for the given frame number.
+    void map(YCbCrFrame &frame, unsigned int phase) const;
+
+    const unsigned int width;
+    const unsigned int height;
+
+private:
+    // Extra luma bytes at the end of each plane to allow the content to move.
+    static const unsigned int MAX_OFFSET = 64;
+
+    const bool m_semiPlanar;
+    vector<uint8_t> m_y;
+    vector<uint8_t> m_cb;
+    vector<uint8_t> m_cr;
 };
 
 class DummyCameraFrame : public YCbCrFrame
 {
 public:
-    explicit DummyCameraFrame(shared_ptr<DummyCamera> camera,
+    explicit DummyCameraFrame(shared_ptr<const DummyCameraPattern> pattern,
                               unsigned int phase, uint64_t timestamp);
     ~DummyCameraFrame()
     {
     }
 
 private:
-    shared_ptr<DummyCamera> m_camera;
+    shared_ptr<const DummyCameraPattern> m_pattern;
 };
 
 class DummyCameraGraphicBuffer : public GraphicBuffer
 {
 public:
-    explicit DummyCameraGraphicBuffer(shared_ptr<DummyCamera> camera, unsigned int phase);
+    explicit DummyCameraGraphicBuffer(shared_ptr<const DummyCameraPattern> pattern,
+                                      unsigned int phase, uint64_t timestamp,
+                                      LatencyStream *latency,
+                                      shared_ptr<ObjectPool> framePool);
     ~DummyCameraGraphicBuffer()
     {
     }
 
     virtual std::shared_ptr<const YCbCrFrame> mapYCbCr() override
     {
-        if (!m_frame) {
-            m_frame = make_shared<DummyCameraFrame>(m_camera, m_phase, timestampUs);
+        scoped_lock lock(m_mapLock);
+        if (m_frame) {
+            recordMapping(true);
+        } else {
+            m_frame = allocateShared<DummyCameraFrame>(m_framePool, m_pattern,
+                                                       m_phase, timestampUs);
+            m_latency->record(LatencyMapped, timestampUs);
+            recordMapping(false);
         }
         return m_frame;
     }
@@ -93,55 +204,137 @@ public:
     }
 
 private:
-    shared_ptr<DummyCamera> m_camera;
+    shared_ptr<const DummyCameraPattern> m_pattern;
     unsigned int m_phase;
+    mutex m_mapLock;
     shared_ptr<YCbCrFrame> m_frame;
+    LatencyStream *m_latency;
+    shared_ptr<ObjectPool> m_framePool;
 };
 
-class DummyCamera : public Camera, public enable_shared_from_this<DummyCamera>
+class DummyCamera
+    : public Camera
+    , public CaptureArbiter::Client
+    , public enable_shared_from_this<DummyCamera>
 {
 public:
-    static shared_ptr<DummyCamera> create(CameraManager *manager)
+    static shared_ptr<DummyCamera> create(DummyCameraManager *manager, unsigned int num)
     {
-        return make_shared<DummyCamera>(manager);
+        return make_shared<DummyCamera>(manager, num);
     }
 
-    explicit DummyCamera(CameraManager *manager)
+    explicit DummyCamera(DummyCameraManager *manager, unsigned int num)
         : m_manager(manager)
+        , m_number(num)
         , m_started(false)
     {
-        // Fill video frame with garbage.
-        memset(m_frameData, 128, sizeof(m_frameData));
-        uint8_t val = 0;
-        for (size_t i = 0; i < sizeof(m_frameData); i += m_width / 10) {
-            m_frameData[i] = val++;
-        }
+        CameraInfo info;
+        manager->getCameraInfo(num, info);
+        latencyStream = LatencyStream::get(info.id);
     }
 
     ~DummyCamera()
     {
-        stopCapture();
+        stopThread();
+        m_manager->arbiter().release(this);
+    }
+
+    unsigned int number() const
+    {
+        return m_number;
     }
 
     bool getInfo(CameraInfo &info)
     {
-        return m_manager->getCameraInfo(0, info);
+        return m_manager->getCameraInfo(m_number, info);
     }
 
     bool startCapture(const CameraCapability &cap)
     {
-        if (!m_started) {
-            m_cameraThread = thread(&cameraLoop, this);
-            m_started = true;
+        m_manager->leaveStandby(this);
+        if (m_started) {
+            return true;
+        }
+        if (!findMode(cap) || !open()) {
+            return false;
         }
+        {
+            scoped_lock lock(m_captureLock);
+            m_requested = cap;
+        }
+
+        CameraCapability granted = cap;
+        switch (m_manager->arbiter().request(shared_from_this(), capturePriority(),
+                                             granted, m_manager->modes())) {
+        case CaptureArbiter::Queued:
+            deliverCaptureState(CaptureQueued, cap);
+            return true;
+        case CaptureArbiter::Downgraded:
+            deliverCaptureState(CaptureDowngraded, granted);
+            break;
+        case CaptureArbiter::Granted:
+            break;
+        }
+        startThread(granted);
+        return true;
+    }
+
+    // Frames in flight keep the previous pattern, so only the capture
+    // thread has to be restarted.
+    bool changeCapture(const CameraCapability &cap)
+    {
+        scoped_lock lock(m_captureLock);
+        if (!m_started || !findMode(cap) || !m_manager->arbiter().update(this, cap)) {
+            return false;
+        }
+        m_requested = cap;
+        restartThreadUnlocked(cap);
+        return true;
+    }
+
+    void capturePreempted()
+    {
+        stopThread();
+        deliverCaptureState(CapturePreempted, requested());
+    }
+
+    void captureGranted(const CameraCapability &cap)
+    {
+        startThread(cap);
+        CameraCapability asked = requested();
+        bool downgraded = cap.width != asked.width || cap.height != asked.height;
+        deliverCaptureState(downgraded ? CaptureDowngraded : CaptureStarted, cap);
+    }
+
+    void captureChanged(const CameraCapability &cap)
+    {
+        CameraCapability asked;
+        {
+            scoped_lock lock(m_captureLock);
+            if (!m_started) {
+                return;
+            }
+            restartThreadUnlocked(cap);
+            asked = m_requested;
+        }
+        bool downgraded = cap.width != asked.width || cap.height != asked.height;
+        deliverCaptureState(downgraded ? CaptureDowngraded : CaptureStarted, cap);
+    }
+
+    // The test picture is always in focus.
+    bool setFocusMode(CameraFocusMode mode)
+    {
         return true;
     }
 
     bool stopCapture()
     {
-        if (m_started) {
-            m_started = false;
-            m_cameraThread.join();
+        bool started = m_started;
+        stopThread();
+        // Also gives up a queued request
+        m_manager->arbiter().release(this);
+        if (started) {
+            m_manager->enterStandby(shared_from_this());
         }
         return true;
     }
@@ -151,40 +344,135 @@ public:
         return m_started;
     }
 
-    bool queryCapabilities(vector<CameraCapability> &caps)
+    // Taken out of standby by a new owner
+    void reuse()
     {
-        CameraCapability cap;
-
-        cap.width = 320;
-        cap.height = 240;
-        cap.fps = 30;
-        caps.push_back(cap);
+        resetOwnerState();
+    }
 
+    bool queryCapabilities(vector<CameraCapability> &caps)
+    {
+        caps = m_manager->modes();
         return true;
     }
 
+    // Connecting takes GECKO_CAMERA_DUMMY_OPEN_MS, unless the camera is
+    // still connected from standby.
     bool open()
     {
+        if (!m_connected) {
+            this_thread::sleep_for(chrono::microseconds(m_manager->openUs()));
+            m_connected = true;
+        }
         return true;
     }
 
-    friend class DummyCameraGraphicBuffer;
-    friend class DummyCameraFrame;
+    void close()
+    {
+        if (!m_started) {
+            m_connected = false;
+        }
+    }
 
 private:
-    CameraManager *m_manager;
-    volatile bool m_started;
+    DummyCameraManager *m_manager;
+    unsigned int m_number;
+    atomic<bool> m_started;
+    atomic<bool> m_connected = false;
+    // Held while starting and stopping the capture thread
+    mutex m_captureLock;
+    CameraCapability m_requested = {};
+    unsigned int m_fps = 30;
+    shared_ptr<const DummyCameraPattern> m_pattern;
+    // Keep the capture loop free of heap allocations.
+    shared_ptr<ObjectPool> m_bufferPool = ObjectPool::create();
+    shared_ptr<ObjectPool> m_framePool = ObjectPool::create();
+
+    CameraCapability requested()
+    {
+        scoped_lock lock(m_captureLock);
+        return m_requested;
+    }
+
+    void startThread(const CameraCapability &cap)
+    {
+        scoped_lock lock(m_captureLock);
+        if (!m_started) {
+            configure(cap);
+            m_started = true;
+            m_cameraThread = thread(&cameraLoop, this);
+        }
+    }
+
+    void stopThread()
+    {
+        scoped_lock lock(m_captureLock);
+        if (m_started) {
+            m_started = false;
+            m_cameraThread.join();
+            flushFrames();
+        }
+    }
+
+    // Called with m_captureLock held and the thread running
+    void restartThreadUnlocked(const CameraCapability &cap)
+    {
+        m_started = false;
+        m_cameraThread.join();
+        configure(cap);
+        m_started = true;
+        m_cameraThread = thread(&cameraLoop, this);
+    }
+
+    void configure(const CameraCapability &cap)
+    {
+        if (!m_pattern || m_pattern->width != cap.width
+                || m_pattern->height != cap.height) {
+            m_pattern = make_shared<DummyCameraPattern>(
+                cap.width, cap.height, m_manager->semiPlanar());
+        }
+        m_fps = cap.fps;
+    }
+
+    // The requested range has to be within the range of a mode.
+    bool findMode(const CameraCapability &cap) const
+    {
+        unsigned int minFps = cap.minFps ? cap.minFps : cap.fps;
+        if (!cap.fps || minFps > cap.fps) {
+            return false;
+        }
+        for (const CameraCapability &mode : m_manager->modes()) {
+            if (mode.width == cap.width && mode.height == cap.height
+                    && cap.fps <= mode.fps && minFps >= mode.minFps) {
+                return true;
+            }
+        }
+        return false;
+    }
 
     void loop()
     {
+        const chrono::nanoseconds period(1000000000 / m_fps);
+        auto deadline = chrono::steady_clock::now();
         unsigned int phase = 0;
+
         while (m_started) {
-            auto frame = make_shared<DummyCameraGraphicBuffer>(shared_from_this(), phase++);
-            if (cameraListener) {
-                cameraListener->onCameraFrame(frame);
+            uint64_t timestampUs = chrono::duration_cast<chrono::microseconds>(
+                deadline.time_since_epoch()).count();
+            auto frame = allocateShared<DummyCameraGraphicBuffer>(
+                m_bufferPool, m_pattern, phase++, timestampUs, latencyStream,
+                m_framePool);
+            deliverFrame(move(frame));
+
+            // Schedule against absolute deadlines so that the time spent in
+            // the listener doesn't lower the frame rate. If the consumer is
+            // too slow, skip the missed frames instead of bursting.
+            deadline += period;
+            auto now = chrono::steady_clock::now();
+            if (now > deadline + period) {
+                deadline = now;
             }
-            // Sleep 1000/30 milliseconds to produce ~30 fps.
-            this_thread::sleep_for(std::chrono::milliseconds(1000 / 30));
+            this_thread::sleep_until(deadline);
         }
     }
 
@@ -194,18 +482,92 @@ private:
     }
 
     thread m_cameraThread;
-
-    static const int m_width = 320;
-    static const int m_height = 240;
-    static const int m_maxOffset = m_width / 10;
-    uint8_t m_frameData[m_width * m_height + m_maxOffset];
 };
 
+bool DummyCameraManager::init()
+{
+    if (m_modes.empty()) {
+        const char *modes = getenv("GECKO_CAMERA_DUMMY_MODES");
+        if (modes) {
+            m_modes = parseModes(modes);
+        }
+        if (m_modes.empty()) {
+            m_modes = parseModes(DEFAULT_MODES);
+        }
+
+        const char *format = getenv("GECKO_CAMERA_DUMMY_FORMAT");
+        m_semiPlanar = format && !strcasecmp(format, "nv12");
+
+        m_cameraCount = max(1u, envValue("GECKO_CAMERA_DUMMY_CAMERAS", 1));
+        m_probeUs = envValue("GECKO_CAMERA_DUMMY_PROBE_MS", 0) * 1000;
+        m_probeLimit = envValue("GECKO_CAMERA_DUMMY_PROBE_LIMIT", 0);
+        m_openUs = envValue("GECKO_CAMERA_DUMMY_OPEN_MS", 0) * 1000;
+
+        CaptureLimits limits;
+        limits.maxCameras = envValue("GECKO_CAMERA_DUMMY_MAX_CAMERAS", 0);
+        const char *maxPixels = getenv("GECKO_CAMERA_DUMMY_MAX_PIXELS");
+        if (maxPixels) {
+            // Either a count or a size like 3840x2160
+            unsigned long width, height;
+            if (sscanf(maxPixels, "%lux%lu", &width, &height) == 2) {
+                limits.maxPixels = (uint64_t)width * height;
+            } else {
+                limits.maxPixels = strtoull(maxPixels, nullptr, 10);
+            }
+        }
+        m_arbiter.setLimits(limits);
+    }
+    return true;
+}
+
+int DummyCameraManager::cameraIndexById(const string &cameraId)
+{
+    for (unsigned int i = 0; i < m_cameraCount; i++) {
+        CameraInfo info;
+        if (getCameraInfo(i, info) && info.id == cameraId) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// static
+vector<CameraCapability> DummyCameraManager::parseModes(const char *str)
+{
+    vector<CameraCapability> modes;
+    while (str && *str) {
+        unsigned int width, height, minFps, fps;
+        int count = sscanf(str, "%ux%u@%u-%u", &width, &height, &minFps, &fps);
+        if (count == 3) {
+            fps = minFps;
+        }
+        if (count >= 3 && width && height && fps && minFps <= fps
+                && width <= UINT16_MAX && height <= UINT16_MAX) {
+            CameraCapability cap;
+            cap.width = width;
+            cap.height = height;
+            cap.fps = fps;
+            cap.minFps = minFps;
+            modes.push_back(cap);
+        }
+        str = strchr(str, ',');
+        if (str) {
+            str++;
+        }
+    }
+    return modes;
+}
+
 bool DummyCameraManager::queryCapabilities(const string &cameraId,
                                            vector<CameraCapability> &caps)
 {
-    auto camera = DummyCamera::create(this);
+    int num = cameraIndexById(cameraId);
+    if (num < 0) {
+        return false;
+    }
+    auto camera = DummyCamera::create(this, num);
     if (camera->open()) {
+        this_thread::sleep_for(chrono::microseconds(m_probeUs));
         return camera->queryCapabilities(caps);
     }
     return false;
@@ -213,7 +575,17 @@ bool DummyCameraManager::queryCapabilities(const string &cameraId,
 
 bool DummyCameraManager::openCamera(const string &cameraId, shared_ptr<Camera> &camera)
 {
-    auto dummyCamera = DummyCamera::create(this);
+    int num = cameraIndexById(cameraId);
+    if (num < 0) {
+        return false;
+    }
+    shared_ptr<DummyCamera> dummyCamera = takeStandby(num);
+    if (dummyCamera) {
+        dummyCamera->reuse();
+        camera = static_pointer_cast<Camera>(dummyCamera);
+        return true;
+    }
+    dummyCamera = DummyCamera::create(this, num);
     if (dummyCamera->open()) {
         camera = static_pointer_cast<Camera>(dummyCamera);
         return true;
@@ -221,33 +593,150 @@ bool DummyCameraManager::openCamera(const string &cameraId, shared_ptr<Camera> &
     return false;
 }
 
+bool DummyCameraManager::setStandbyCameras(unsigned int count)
+{
+    scoped_lock lock(m_standbyLock);
+    m_standbyCount = count;
+    while (m_standby.size() > m_standbyCount) {
+        m_standby.back()->close();
+        m_standby.pop_back();
+    }
+    return true;
+}
+
+void DummyCameraManager::enterStandby(shared_ptr<DummyCamera> camera)
+{
+    scoped_lock lock(m_standbyLock);
+    auto it = find(m_standby.begin(), m_standby.end(), camera);
+    if (it != m_standby.end()) {
+        m_standby.erase(it);
+    }
+    m_standby.push_front(move(camera));
+    while (m_standby.size() > m_standbyCount) {
+        m_standby.back()->close();
+        m_standby.pop_back();
+    }
+}
+
+void DummyCameraManager::leaveStandby(DummyCamera *camera)
+{
+    scoped_lock lock(m_standbyLock);
+    auto it = find_if(m_standby.begin(), m_standby.end(),
+                      [camera](const shared_ptr<DummyCamera> &c) {
+                          return c.get() == camera;
+                      });
+    if (it != m_standby.end()) {
+        m_standby.erase(it);
+    }
+}
+
+// Like a HAL, only cameras the application has released are reused.
+shared_ptr<DummyCamera> DummyCameraManager::takeStandby(int num)
+{
+    scoped_lock lock(m_standbyLock);
+    for (auto it = m_standby.begin(); it != m_standby.end(); ++it) {
+        if ((*it)->number() == (unsigned int)num && it->use_count() == 1) {
+            shared_ptr<DummyCamera> camera = move(*it);
+            m_standby.erase(it);
+            return camera;
+        }
+    }
+    return nullptr;
+}
+
+DummyCameraPattern::DummyCameraPattern(
+        unsigned int width, unsigned int height, bool semiPlanar)
+    : width(width)
+    , height(height)
+    , m_semiPlanar(semiPlanar)
+{
+    const unsigned int cWidth = (width + 1) / 2;
+    const unsigned int cHeight = (height + 1) / 2;
+
+    // Diagonal luma bars over a horizontal gradient.
+    m_y.resize(width * height + MAX_OFFSET);
+    for (unsigned int row = 0; row < height; row++) {
+        uint8_t *line = m_y.data() + row * width;
+        for (unsigned int col = 0; col < width; col++) {
+            bool bar = ((col + row) / 32) & 1;
+            line[col] = bar ? 235 : 16 + (col * 128) / width;
+        }
+    }
+    for (unsigned int i = 0; i < MAX_OFFSET; i++) {
+        m_y[width * height + i] = m_y[i];
+    }
+
+    // Chroma changes across the frame so that the planes are distinguishable.
+    vector<uint8_t> cb(cWidth * cHeight + MAX_OFFSET / 2);
+    vector<uint8_t> cr(cWidth * cHeight + MAX_OFFSET / 2);
+    for (unsigned int row = 0; row < cHeight; row++) {
+        for (unsigned int col = 0; col < cWidth; col++) {
+            cb[row * cWidth + col] = 64 + (col * 128) / cWidth;
+            cr[row * cWidth + col] = 64 + (row * 128) / cHeight;
+        }
+    }
+    for (unsigned int i = 0; i < MAX_OFFSET / 2; i++) {
+        cb[cWidth * cHeight + i] = cb[i];
+        cr[cWidth * cHeight + i] = cr[i];
+    }
+
+    if (m_semiPlanar) {
+        m_cb.resize(cb.size() * 2);
+        for (size_t i = 0; i < cb.size(); i++) {
+            m_cb[2 * i] = cb[i];
+            m_cb[2 * i + 1] = cr[i];
+        }
+    } else {
+        m_cb = move(cb);
+        m_cr = move(cr);
+    }
+}
+
+void DummyCameraPattern::map(YCbCrFrame &frame, unsigned int phase) const
+{
+    // Move by two luma pixels per frame to keep chroma in step.
+    const unsigned int offset = phase % (MAX_OFFSET / 2);
+
+    frame.width = width;
+    frame.height = height;
+    frame.yStride = width;
+    frame.y = m_y.data() + 2 * offset;
+    if (m_semiPlanar) {
+        frame.cStride = 2 * ((width + 1) / 2);
+        frame.chromaStep = 2;
+        frame.cb = m_cb.data() + 2 * offset;
+        frame.cr = frame.cb + 1;
+    } else {
+        frame.cStride = (width + 1) / 2;
+        frame.chromaStep = 1;
+        frame.cb = m_cb.data() + offset;
+        frame.cr = m_cr.data() + offset;
+    }
+}
+
 DummyCameraGraphicBuffer::DummyCameraGraphicBuffer(
-        shared_ptr<DummyCamera> camera, unsigned int phase)
-    : m_camera(camera)
+        shared_ptr<const DummyCameraPattern> pattern,
+        unsigned int phase, uint64_t timestamp,
+        LatencyStream *latency,
+        shared_ptr<ObjectPool> framePool)
+    : m_pattern(pattern)
     , m_phase(phase)
     , m_frame(nullptr)
+    , m_latency(latency)
+    , m_framePool(move(framePool))
 {
-    width = camera->m_width;
-    height = camera->m_height;
+    width = pattern->width;
+    height = pattern->height;
     handle = nullptr;
-    timestampUs = chrono::duration_cast<std::chrono::microseconds>(
-            chrono::high_resolution_clock::now().time_since_epoch()).count();
+    timestampUs = timestamp;
 }
 
 DummyCameraFrame::DummyCameraFrame(
-        shared_ptr<DummyCamera> camera, unsigned int phase, uint64_t timestamp)
-    : m_camera(camera)
+        shared_ptr<const DummyCameraPattern> pattern,
+        unsigned int phase, uint64_t timestamp)
+    : m_pattern(pattern)
 {
-    phase %= camera->m_maxOffset;
-
-    yStride = camera->m_width;
-    cStride = (camera->m_width + 1) / 2;
-    width = camera->m_width;
-    height = camera->m_height;
-    chromaStep = 1;
-    y = camera->m_frameData + phase;
-    cb = camera->m_frameData + phase;
-    cr = camera->m_frameData + phase;
+    pattern->map(*this, phase);
     timestampUs = timestamp;
 }
 
@@ -257,4 +746,21 @@ extern "C" __attribute__((visibility("default"))) CameraManager *gecko_camera_pl
 {
     return &dummyCameraManager;
 }
+
+// The loopback codec in dummy-codec.cpp takes any codec type. It sorts
+// before the real codec plugins, so it is only advertised when asked for
+// with GECKO_CAMERA_DUMMY_CODEC.
+static const uint32_t DUMMY_CODECS = getenv("GECKO_CAMERA_DUMMY_CODEC")
+    ? gecko::codec::codecMask(gecko::codec::VideoCodecVP8)
+      | gecko::codec::codecMask(gecko::codec::VideoCodecVP9)
+      | gecko::codec::codecMask(gecko::codec::VideoCodecH264)
+    : 0;
+
+extern "C" __attribute__((visibility("default")))
+const PluginManifest gecko_camera_plugin_manifest = {
+    PLUGIN_MANIFEST_VERSION,
+    true,
+    DUMMY_CODECS,
+    DUMMY_CODECS
+};
 /* vim: set ts=4 et sw=4 tw=80: */
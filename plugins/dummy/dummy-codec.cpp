@@ -0,0 +1,535 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "geckocamera-codec.h"
+#include "geckocamera-convert.h"
+#include "geckocamera-latency.h"
+
+using namespace std;
+using namespace gecko::camera;
+using namespace gecko::codec;
+
+// A loopback "codec": the bitstream is a small header followed by the
+// frame as I420, and decoding gives the frame back. The codec threads
+// sleep for GECKO_CAMERA_DUMMY_CODEC_LATENCY_MS per frame and take up to
+// GECKO_CAMERA_DUMMY_CODEC_QUEUE frames before the input blocks. With
+// GECKO_CAMERA_DUMMY_CODEC_BLOCKING=1 tryDecode() blocks too, like
+// decoders which can't tell that their queue is full. Like hardware with
+// a fixed number of encoder instances, init() fails if there are already
+// GECKO_CAMERA_DUMMY_CODEC_MAX_ENCODERS initialized encoders.
+static const unsigned int DEFAULT_LATENCY_MS = 5;
+static const unsigned int DEFAULT_QUEUE_DEPTH = 4;
+
+static const uint32_t DUMMY_CODEC_MAGIC = 0x424c4347; // "GCLB"
+
+struct DummyCodecHeader {
+    uint32_t magic;
+    uint16_t width;
+    uint16_t height;
+    uint64_t timestampUs;
+    uint8_t keyFrame;
+    uint8_t reserved[7];
+};
+
+struct DummyCodecOptions {
+    unsigned int latencyUs;
+    unsigned int queueDepth;
+    bool blocking;
+    // 0 is unlimited
+    unsigned int maxEncoders;
+};
+
+static unsigned int envValue(const char *name, unsigned int defaultValue)
+{
+    const char *value = getenv(name);
+    return value ? strtoul(value, nullptr, 10) : defaultValue;
+}
+
+static const DummyCodecOptions &dummyCodecOptions()
+{
+    static const DummyCodecOptions options = {
+        envValue("GECKO_CAMERA_DUMMY_CODEC_LATENCY_MS", DEFAULT_LATENCY_MS) * 1000,
+        max(1u, envValue("GECKO_CAMERA_DUMMY_CODEC_QUEUE", DEFAULT_QUEUE_DEPTH)),
+        envValue("GECKO_CAMERA_DUMMY_CODEC_BLOCKING", 0) != 0,
+        envValue("GECKO_CAMERA_DUMMY_CODEC_MAX_ENCODERS", 0)
+    };
+    return options;
+}
+
+static const char *codecTypeName(CodecType codecType)
+{
+    switch (codecType) {
+    case VideoCodecVP8:
+        return "vp8";
+    case VideoCodecVP9:
+        return "vp9";
+    case VideoCodecH264:
+        return "h264";
+    case VideoCodecUnknown:
+        break;
+    }
+    return "unknown";
+}
+
+// The input queue and thread of a codec. Jobs are processed in order,
+// each taking at least the configured latency.
+class DummyCodecThread
+{
+public:
+    struct Job {
+        shared_ptr<const YCbCrFrame> frame;
+        const uint8_t *data;
+        size_t size;
+        uint64_t timestampUs;
+        FrameType frameType;
+        void (*release)(void *);
+        void *releaseData;
+    };
+
+    DummyCodecThread()
+        : m_options(dummyCodecOptions())
+        , m_jobs(m_options.queueDepth)
+    {
+    }
+
+    virtual ~DummyCodecThread()
+    {
+        stopThread();
+    }
+
+    void startThread()
+    {
+        if (!m_thread.joinable()) {
+            m_quit = false;
+            m_thread = thread(&DummyCodecThread::loop, this);
+        }
+    }
+
+    // Drops the queued jobs.
+    void stopThread()
+    {
+        if (m_thread.joinable()) {
+            {
+                scoped_lock lock(m_mutex);
+                m_quit = true;
+            }
+            m_cond.notify_all();
+            m_thread.join();
+
+            scoped_lock lock(m_mutex);
+            while (m_count) {
+                Job &job = m_jobs[m_head];
+                releaseJob(job);
+                m_head = (m_head + 1) % m_jobs.size();
+                m_count--;
+            }
+            m_creditWanted = false;
+            m_draining = false;
+        }
+        m_cond.notify_all();
+    }
+
+    DecodeResult push(Job job, bool block)
+    {
+        {
+            unique_lock lock(m_mutex);
+            if (m_count == m_jobs.size()) {
+                if (!block && !m_options.blocking) {
+                    m_creditWanted = true;
+                    return DecodeWouldBlock;
+                }
+                m_cond.wait(lock, [this] { return m_count < m_jobs.size() || m_quit; });
+            }
+            if (m_quit) {
+                return DecodeError;
+            }
+            m_jobs[(m_head + m_count) % m_jobs.size()] = move(job);
+            m_count++;
+        }
+        m_cond.notify_all();
+        return DecodeOk;
+    }
+
+    // onDrained() is called once the queued jobs are done.
+    void drain()
+    {
+        {
+            scoped_lock lock(m_mutex);
+            m_draining = true;
+        }
+        m_cond.notify_all();
+    }
+
+protected:
+    virtual void process(Job &job) = 0;
+    virtual void onCredit() {}
+    virtual void onDrained() {}
+
+    static void releaseJob(Job &job)
+    {
+        job.frame.reset();
+        if (job.release) {
+            job.release(job.releaseData);
+            job.release = nullptr;
+        }
+    }
+
+    const DummyCodecOptions &m_options;
+
+private:
+    void loop()
+    {
+        for (;;) {
+            Job job;
+            bool drained = false;
+            {
+                unique_lock lock(m_mutex);
+                m_cond.wait(lock, [this] { return m_count || m_draining || m_quit; });
+                if (m_quit) {
+                    break;
+                }
+                if (m_count) {
+                    // The job keeps its slot, and so the caller waiting,
+                    // until it is done.
+                    job = m_jobs[m_head];
+                } else {
+                    drained = true;
+                    m_draining = false;
+                }
+            }
+
+            if (drained) {
+                onDrained();
+                continue;
+            }
+
+            if (m_options.latencyUs) {
+                this_thread::sleep_for(chrono::microseconds(m_options.latencyUs));
+            }
+            process(job);
+            releaseJob(job);
+
+            bool credit;
+            {
+                scoped_lock lock(m_mutex);
+                m_jobs[m_head].frame.reset();
+                m_head = (m_head + 1) % m_jobs.size();
+                m_count--;
+                credit = m_creditWanted;
+                m_creditWanted = false;
+            }
+            m_cond.notify_all();
+            if (credit) {
+                onCredit();
+            }
+        }
+    }
+
+    mutex m_mutex;
+    condition_variable m_cond;
+    vector<Job> m_jobs;
+    unsigned int m_head = 0;
+    unsigned int m_count = 0;
+    bool m_creditWanted = false;
+    bool m_draining = false;
+    bool m_quit = false;
+    thread m_thread;
+};
+
+class DummyVideoEncoder : public VideoEncoder, DummyCodecThread
+{
+public:
+    explicit DummyVideoEncoder(CodecType codecType)
+        : m_latency(LatencyStream::get(string("dummy-encoder:") + codecTypeName(codecType)))
+    {
+    }
+
+    ~DummyVideoEncoder()
+    {
+        stopThread();
+        if (m_outputSize) {
+            s_instances--;
+        }
+    }
+
+    bool init(VideoEncoderMetadata metadata) override
+    {
+        if (m_outputSize || metadata.width <= 0 || metadata.height <= 0) {
+            return false;
+        }
+        unsigned int maxEncoders = dummyCodecOptions().maxEncoders;
+        if (++s_instances > maxEncoders && maxEncoders) {
+            s_instances--;
+            return false;
+        }
+        setKeyFrameInterval(metadata.keyFrameIntervalMs);
+        m_width = metadata.width;
+        m_height = metadata.height;
+        m_outputSize = sizeof(DummyCodecHeader) + yuv420BufferSize(m_width, m_height);
+        startThread();
+        return true;
+    }
+
+    bool encode(shared_ptr<const YCbCrFrame> frame, bool forceSync) override
+    {
+        if (!m_outputSize || frame->width != m_width || frame->height != m_height) {
+            return false;
+        }
+        m_latency->record(LatencyEncodeQueued, frame->timestampUs);
+
+        Job job;
+        job.timestampUs = frame->timestampUs;
+        job.frame = move(frame);
+        job.data = nullptr;
+        job.size = 0;
+        job.frameType = keyFrameDue(job.timestampUs, forceSync) ? KeyFrame : DeltaFrame;
+        job.release = nullptr;
+        job.releaseData = nullptr;
+        if (push(move(job), true) != DecodeOk) {
+            return false;
+        }
+        m_framesQueued++;
+        return true;
+    }
+
+    bool getStats(VideoEncoderStats &stats) override
+    {
+        stats.framesQueued = m_framesQueued;
+        stats.framesEncoded = m_framesEncoded;
+        stats.framesZeroCopy = 0;
+        stats.bufferPoolHits = 0;
+        stats.bufferPoolMisses = 0;
+        stats.encodedFramesHeld = encodedFramesHeld();
+        return true;
+    }
+
+    // The loopback output doesn't depend on the rates.
+    RateUpdate setRates(int bitrate, int framerate) override
+    {
+        if (!m_outputSize || bitrate <= 0 || framerate <= 0) {
+            return RateUpdateFailed;
+        }
+        return RateUpdateInPlace;
+    }
+
+protected:
+    void process(Job &job) override
+    {
+        // Written in place, so listeners taking references get it without
+        // a copy.
+        BufferPool::Buffer *output = acquireEncodedBuffer(m_outputSize);
+        DummyCodecHeader *header = reinterpret_cast<DummyCodecHeader *>(output->data());
+        uint8_t *payload = output->data() + sizeof(DummyCodecHeader);
+
+        memset(header, 0, sizeof(*header));
+        header->magic = DUMMY_CODEC_MAGIC;
+        header->width = m_width;
+        header->height = m_height;
+        header->timestampUs = job.timestampUs;
+        // Every frame decodes on its own, but only report the requested
+        // key frames and the first one like a real encoder would.
+        header->keyFrame = job.frameType == KeyFrame || !m_framesEncoded;
+
+        if (!convertYCbCrFrame(*job.frame, makeI420Layout(payload, m_width, m_height))) {
+            BufferPool::Buffer::release(output);
+            if (m_encoderListener) {
+                m_encoderListener->onEncoderError("Cannot convert the frame");
+            }
+            return;
+        }
+        m_framesEncoded++;
+
+        if (m_encoderListener) {
+            m_latency->record(LatencyEncoded, job.timestampUs);
+        }
+        deliverEncodedBuffer(output, m_outputSize, job.timestampUs,
+                             header->keyFrame ? KeyFrame : DeltaFrame);
+    }
+
+private:
+    unsigned int m_width = 0;
+    unsigned int m_height = 0;
+    size_t m_outputSize = 0;
+    atomic<uint64_t> m_framesQueued = 0;
+    atomic<uint64_t> m_framesEncoded = 0;
+    LatencyStream *m_latency;
+
+    static atomic<unsigned int> s_instances;
+};
+
+atomic<unsigned int> DummyVideoEncoder::s_instances(0);
+
+class DummyVideoDecoder : public VideoDecoder, DummyCodecThread
+{
+public:
+    explicit DummyVideoDecoder(CodecType codecType)
+        : m_latency(LatencyStream::get(string("dummy-decoder:") + codecTypeName(codecType)))
+    {
+    }
+
+    ~DummyVideoDecoder()
+    {
+        stopThread();
+    }
+
+    bool init(VideoDecoderMetadata metadata) override
+    {
+        return true;
+    }
+
+    bool decode(const uint8_t *data, size_t size, uint64_t timestampUs, FrameType frameType,
+                void (*release)(void *), void *releaseData) override
+    {
+        return queueInput(data, size, timestampUs, frameType,
+                          release, releaseData, true) == DecodeOk;
+    }
+
+    DecodeResult tryDecode(const uint8_t *data, size_t size, uint64_t timestampUs,
+                           FrameType frameType, void (*release)(void *),
+                           void *releaseData) override
+    {
+        return queueInput(data, size, timestampUs, frameType, release, releaseData, false);
+    }
+
+    void drain() override
+    {
+        DummyCodecThread::drain();
+    }
+
+    // Like the droid decoder, flushing also stops the codec.
+    void flush() override
+    {
+        stopThread();
+    }
+
+    void stop() override
+    {
+        stopThread();
+    }
+
+protected:
+    void process(Job &job) override
+    {
+        const DummyCodecHeader *header = reinterpret_cast<const DummyCodecHeader *>(job.data);
+        if (job.size < sizeof(DummyCodecHeader) || header->magic != DUMMY_CODEC_MAGIC
+                || job.size < sizeof(DummyCodecHeader)
+                              + yuv420BufferSize(header->width, header->height)) {
+            if (m_decoderListener) {
+                m_decoderListener->onDecoderError("Invalid bitstream");
+            }
+            return;
+        }
+
+        if (m_decoderListener) {
+            uint8_t *payload = const_cast<uint8_t *>(job.data) + sizeof(DummyCodecHeader);
+            YCbCrFrame frame = makeI420Layout(payload, header->width, header->height);
+            frame.timestampUs = job.timestampUs;
+            m_latency->decoded(job.timestampUs);
+            m_decoderListener->onDecodedYCbCrFrame(&frame);
+        }
+    }
+
+    void onCredit() override
+    {
+        if (m_decoderListener) {
+            m_decoderListener->onDecoderInputCredit();
+        }
+    }
+
+    void onDrained() override
+    {
+        if (m_decoderListener) {
+            m_decoderListener->onDecoderEOS();
+        }
+    }
+
+private:
+    DecodeResult queueInput(const uint8_t *data, size_t size, uint64_t timestampUs,
+                            FrameType frameType, void (*release)(void *),
+                            void *releaseData, bool block)
+    {
+        startThread();
+
+        Job job;
+        job.data = data;
+        job.size = size;
+        job.timestampUs = timestampUs;
+        job.frameType = frameType;
+        job.release = release;
+        job.releaseData = releaseData;
+        m_latency->decodeQueued(timestampUs);
+        return push(move(job), block);
+    }
+
+    LatencyStream *m_latency;
+};
+
+class DummyCodecManager : public CodecManager
+{
+public:
+    bool init() override
+    {
+        return true;
+    }
+
+    bool videoEncoderAvailable(CodecType codecType) override
+    {
+        return codecType != VideoCodecUnknown;
+    }
+
+    bool videoDecoderAvailable(CodecType codecType) override
+    {
+        return codecType != VideoCodecUnknown;
+    }
+
+    bool createVideoEncoder(CodecType codecType, shared_ptr<VideoEncoder> &encoder) override
+    {
+        if (!videoEncoderAvailable(codecType)) {
+            return false;
+        }
+        encoder = make_shared<DummyVideoEncoder>(codecType);
+        return true;
+    }
+
+    bool createVideoDecoder(CodecType codecType, shared_ptr<VideoDecoder> &decoder) override
+    {
+        if (!videoDecoderAvailable(codecType)) {
+            return false;
+        }
+        decoder = make_shared<DummyVideoDecoder>(codecType);
+        return true;
+    }
+};
+
+static DummyCodecManager dummyCodecManager;
+
+extern "C" __attribute__((visibility("default"))) CodecManager *gecko_codec_plugin_manager(void)
+{
+    return &dummyCodecManager;
+}
+
+/* vim: set ts=4 et sw=4 tw=80: */
@@ -0,0 +1,928 @@
+/*
+ * Copyright (C) 2022 Open Mobile Platform LLC.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <geckocamera-codec.h>
+#include <geckocamera-convert.h>
+#include <geckocamera-latency.h>
+#include <geckocamera-pool.h>
+
+#include <vpx/vpx_encoder.h>
+#include <vpx/vpx_decoder.h>
+#include <vpx/vp8cx.h>
+#include <vpx/vp8dx.h>
+
+#define LOG_TOPIC "vpx-codec"
+#include <geckocamera-utils.h>
+
+namespace gecko {
+namespace codec {
+
+using namespace std;
+using namespace gecko::camera;
+
+// Frames waiting for the encoder thread. encode() blocks when it is full,
+// like the droid encoder does when the codec input queue is full.
+static const unsigned int ENCODER_QUEUE_DEPTH = 2;
+// Frames queued to the decoder thread, see VideoDecoder::tryDecode().
+static const unsigned int DECODER_INPUT_CREDITS = 4;
+
+// Encoder speed presets, mapped to the codec's realtime cpu-used values.
+enum VpxSpeedPreset {
+    VpxSpeedBalanced,
+    VpxSpeedFast,
+    VpxSpeedFastest
+};
+
+static const char *codecTypeName(CodecType codecType)
+{
+    switch (codecType) {
+    case VideoCodecVP8:
+        return "vp8";
+    case VideoCodecVP9:
+        return "vp9";
+    case VideoCodecH264:
+    case VideoCodecUnknown:
+        break;
+    }
+    return nullptr;
+}
+
+static LatencyStream *codecLatencyStream(const char *prefix, CodecType codecType)
+{
+    const char *name = codecTypeName(codecType);
+    return LatencyStream::get(string(prefix) + ":" + (name ? name : "unknown"));
+}
+
+static string codecError(vpx_codec_ctx_t *codec)
+{
+    const char *detail = vpx_codec_error_detail(codec);
+    return string(vpx_codec_error(codec)) + (detail ? string(": ") + detail : "");
+}
+
+// GECKO_CAMERA_VPX_THREADS=<n>, the default depends on the frame size.
+static unsigned int optionThreads(unsigned int width, unsigned int height)
+{
+    const char *value = getenv("GECKO_CAMERA_VPX_THREADS");
+    if (value && atoi(value) > 0) {
+        return atoi(value);
+    }
+
+    unsigned int pixels = width * height;
+    unsigned int threads = 1;
+    if (pixels >= 1920 * 1080) {
+        threads = 8;
+    } else if (pixels >= 1280 * 720) {
+        threads = 4;
+    } else if (pixels >= 640 * 480) {
+        threads = 2;
+    }
+    return max(1u, min(threads, thread::hardware_concurrency()));
+}
+
+// GECKO_CAMERA_VPX_SPEED=balanced|fast|fastest
+static VpxSpeedPreset optionSpeed()
+{
+    const char *value = getenv("GECKO_CAMERA_VPX_SPEED");
+    if (value) {
+        if (!strcmp(value, "balanced")) {
+            return VpxSpeedBalanced;
+        } else if (!strcmp(value, "fastest")) {
+            return VpxSpeedFastest;
+        } else if (strcmp(value, "fast")) {
+            LOGE("Unknown speed preset " << value);
+        }
+    }
+    return VpxSpeedFast;
+}
+
+// GECKO_CAMERA_VPX_ROW_MT=0 disables VP9 row based multithreading.
+static bool optionRowMT()
+{
+    const char *value = getenv("GECKO_CAMERA_VPX_ROW_MT");
+    return !value || atoi(value) != 0;
+}
+
+static int speedToCpuUsed(CodecType codecType, VpxSpeedPreset speed)
+{
+    // Negative VP8 values let the encoder adapt the speed to the deadline.
+    static const int vp8[] = { -6, -8, -12 };
+    static const int vp9[] = { 6, 7, 8 };
+    return codecType == VideoCodecVP8 ? vp8[speed] : vp9[speed];
+}
+
+static unsigned int log2Floor(unsigned int value)
+{
+    unsigned int result = 0;
+    while (value > 1) {
+        value >>= 1;
+        result++;
+    }
+    return result;
+}
+
+class VpxCodecManager : public CodecManager
+{
+public:
+    VpxCodecManager() {};
+    ~VpxCodecManager() {};
+    bool init() override;
+
+    bool videoEncoderAvailable(CodecType codecType) override;
+    bool videoDecoderAvailable(CodecType codecType) override;
+
+    bool createVideoEncoder(CodecType codecType, shared_ptr<VideoEncoder> &encoder) override;
+    bool createVideoDecoder(CodecType codecType, shared_ptr<VideoDecoder> &decoder) override;
+};
+
+class VpxVideoEncoder : public VideoEncoder
+{
+public:
+    static shared_ptr<VpxVideoEncoder> create(CodecType codecType)
+    {
+        return make_shared<VpxVideoEncoder>(codecType);
+    }
+    explicit VpxVideoEncoder(CodecType codecType);
+    ~VpxVideoEncoder();
+
+    bool init(VideoEncoderMetadata metadata) override;
+    bool encode(shared_ptr<const YCbCrFrame> frame, bool forceSync) override;
+    bool getStats(VideoEncoderStats &stats) override;
+    RateUpdate setRates(int bitrate, int framerate) override;
+
+private:
+    struct Input {
+        shared_ptr<const YCbCrFrame> frame;
+        bool forceSync;
+    };
+
+    void configure(unsigned int threads);
+    void applyRates(int bitrate, int framerate);
+    void loop();
+    void encodeFrame(const Input &input);
+    void error(string errorDescription);
+
+    CodecType m_codecType;
+    vpx_codec_ctx_t m_codec;
+    vpx_codec_enc_cfg_t m_config;
+    bool m_initialized = false;
+    bool m_intraRefresh = false;
+    unsigned long m_frameDuration = 0;
+    size_t m_frameSize = 0;
+    shared_ptr<BufferPool> m_bufferPool;
+    atomic<uint64_t> m_framesQueued = 0;
+    atomic<uint64_t> m_framesEncoded = 0;
+    atomic<uint64_t> m_framesZeroCopy = 0;
+    LatencyStream *m_latency;
+
+    mutex m_mutex;
+    condition_variable m_cond;
+    Input m_queue[ENCODER_QUEUE_DEPTH];
+    unsigned int m_queueHead = 0;
+    unsigned int m_queueCount = 0;
+    // Set by setRates(), applied by the encoder thread before the next frame
+    int m_pendingBitrate = 0;
+    int m_pendingFramerate = 0;
+    bool m_quit = false;
+    thread m_thread;
+};
+
+class VpxVideoDecoder : public VideoDecoder
+{
+public:
+    static shared_ptr<VpxVideoDecoder> create(CodecType codecType)
+    {
+        return make_shared<VpxVideoDecoder>(codecType);
+    }
+    explicit VpxVideoDecoder(CodecType codecType);
+    ~VpxVideoDecoder();
+
+    bool init(VideoDecoderMetadata metadata) override;
+    bool decode(const uint8_t *data,
+                size_t size,
+                uint64_t timestampUs,
+                FrameType frameType,
+                void (*release)(void *),
+                void *releaseData) override;
+    DecodeResult tryDecode(const uint8_t *data,
+                           size_t size,
+                           uint64_t timestampUs,
+                           FrameType frameType,
+                           void (*release)(void *),
+                           void *releaseData) override;
+    void drain() override;
+    void flush() override;
+    void stop() override;
+
+private:
+    struct Input {
+        const uint8_t *data;
+        size_t size;
+        uint64_t timestampUs;
+        void (*release)(void *);
+        void *releaseData;
+    };
+
+    bool start();
+    DecodeResult queueInput(const uint8_t *data,
+                            size_t size,
+                            uint64_t timestampUs,
+                            void (*release)(void *),
+                            void *releaseData,
+                            bool block);
+    void loop();
+    void decodeInput(const Input &input);
+    void outputFrames(uint64_t timestampUs);
+    void releaseInputs();
+    void error(string errorDescription);
+
+    CodecType m_codecType;
+    VideoDecoderMetadata m_metadata;
+    vpx_codec_ctx_t m_codec;
+    bool m_started = false;
+    LatencyStream *m_latency;
+
+    mutex m_mutex;
+    condition_variable m_cond;
+    Input m_inputs[DECODER_INPUT_CREDITS];
+    unsigned int m_inputHead = 0;
+    unsigned int m_inputCount = 0;
+    bool m_creditWanted = false;
+    bool m_draining = false;
+    bool m_quit = false;
+    thread m_thread;
+};
+
+bool VpxCodecManager::init()
+{
+    return true;
+}
+
+// libvpx is always there, even when all hardware codecs are busy.
+bool VpxCodecManager::videoEncoderAvailable(CodecType codecType)
+{
+    return codecType == VideoCodecVP8 || codecType == VideoCodecVP9;
+}
+
+bool VpxCodecManager::videoDecoderAvailable(CodecType codecType)
+{
+    return codecType == VideoCodecVP8 || codecType == VideoCodecVP9;
+}
+
+bool VpxCodecManager::createVideoEncoder(CodecType codecType, shared_ptr<VideoEncoder> &encoder)
+{
+    if (!videoEncoderAvailable(codecType)) {
+        return false;
+    }
+    LOGD("");
+    encoder = VpxVideoEncoder::create(codecType);
+    return true;
+}
+
+bool VpxCodecManager::createVideoDecoder(CodecType codecType, shared_ptr<VideoDecoder> &decoder)
+{
+    if (!videoDecoderAvailable(codecType)) {
+        return false;
+    }
+    LOGD("");
+    decoder = VpxVideoDecoder::create(codecType);
+    return true;
+}
+
+VpxVideoEncoder::VpxVideoEncoder(CodecType codecType)
+    : m_codecType(codecType)
+    , m_latency(codecLatencyStream("vpx-encoder", codecType))
+{
+    LOGD("codecType " << codecType);
+    memset(&m_codec, 0, sizeof(m_codec));
+    memset(&m_config, 0, sizeof(m_config));
+}
+
+VpxVideoEncoder::~VpxVideoEncoder()
+{
+    if (m_thread.joinable()) {
+        {
+            scoped_lock lock(m_mutex);
+            m_quit = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    }
+    if (m_initialized) {
+        LOGD("");
+        vpx_codec_destroy(&m_codec);
+    }
+}
+
+bool VpxVideoEncoder::init(VideoEncoderMetadata metadata)
+{
+    if (m_initialized) {
+        LOGE("Encoder already initialized");
+        return false;
+    }
+
+    vpx_codec_iface_t *iface = m_codecType == VideoCodecVP8 ?
+                               vpx_codec_vp8_cx() : vpx_codec_vp9_cx();
+    vpx_codec_err_t err = vpx_codec_enc_config_default(iface, &m_config, 0);
+    if (err != VPX_CODEC_OK) {
+        LOGE("Cannot get the default configuration: " << vpx_codec_err_to_string(err));
+        return false;
+    }
+
+    unsigned int threads = optionThreads(metadata.width, metadata.height);
+
+    // Realtime settings: no lookahead, constant bitrate, and timestamps in
+    // microseconds so that they can be passed through as they are.
+    m_config.g_w = metadata.width;
+    m_config.g_h = metadata.height;
+    m_config.g_threads = threads;
+    m_config.g_timebase.num = 1;
+    m_config.g_timebase.den = 1000000;
+    m_config.g_lag_in_frames = 0;
+    m_config.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+    m_config.rc_end_usage = VPX_CBR;
+    m_config.rc_target_bitrate = max(1, metadata.bitrate / 1000);
+    m_config.rc_dropframe_thresh = 0;
+    m_config.rc_resize_allowed = 0;
+    m_config.rc_min_quantizer = 2;
+    m_config.rc_max_quantizer = 56;
+    m_config.rc_undershoot_pct = 100;
+    m_config.rc_overshoot_pct = 15;
+    m_config.rc_buf_initial_sz = 500;
+    m_config.rc_buf_optimal_sz = 600;
+    m_config.rc_buf_sz = 1000;
+    m_config.kf_mode = VPX_KF_AUTO;
+    m_config.kf_max_dist = 3000;
+    // Key frames by time rather than by frame count, and none at all with
+    // intra refresh unless asked for.
+    if (metadata.keyFrameIntervalMs > 0 || metadata.intraRefreshFrames > 0) {
+        m_config.kf_mode = VPX_KF_DISABLED;
+        setKeyFrameInterval(metadata.keyFrameIntervalMs);
+    }
+    m_intraRefresh = metadata.intraRefreshFrames > 0;
+
+    err = vpx_codec_enc_init(&m_codec, iface, &m_config, 0);
+    if (err != VPX_CODEC_OK) {
+        LOGE("Failed to create the encoder: " << vpx_codec_err_to_string(err));
+        return false;
+    }
+    m_initialized = true;
+    configure(threads);
+
+    m_frameDuration = metadata.framerate > 0 ? 1000000 / metadata.framerate : 33333;
+    m_frameSize = yuv420BufferSize(metadata.width, metadata.height);
+    // Only the encoder thread converts, so one staging buffer is enough.
+    m_bufferPool = BufferPool::create(m_frameSize, 1);
+    m_thread = thread(&VpxVideoEncoder::loop, this);
+
+    LOGI("Encoder created for " << codecTypeName(m_codecType)
+         << " width=" << metadata.width
+         << " height=" << metadata.height
+         << " fps=" << metadata.framerate
+         << " bitrate=" << metadata.bitrate
+         << " threads=" << threads);
+    return true;
+}
+
+void VpxVideoEncoder::configure(unsigned int threads)
+{
+    int cpuUsed = speedToCpuUsed(m_codecType, optionSpeed());
+    vpx_codec_control(&m_codec, VP8E_SET_CPUUSED, cpuUsed);
+    vpx_codec_control(&m_codec, VP8E_SET_NOISE_SENSITIVITY, 0);
+    vpx_codec_control(&m_codec, VP8E_SET_STATIC_THRESHOLD, 1);
+
+    if (m_codecType == VideoCodecVP8) {
+        // VP8 threads always work on macroblock rows, token partitions let
+        // them write the bitstream in parallel as well.
+        unsigned int partitions = min(log2Floor(threads), 3u);
+        vpx_codec_control(&m_codec, VP8E_SET_TOKEN_PARTITIONS, (int)partitions);
+        LOGD("VP8 cpu-used " << cpuUsed << " token partitions " << (1 << partitions));
+        if (m_intraRefresh) {
+            LOGI("VP8 has no intra refresh control, only disabling periodic key frames");
+        }
+    } else {
+        // Tiles must be at least 256 pixels wide.
+        unsigned int tileColumns = min(log2Floor(threads),
+                                       log2Floor(max(1u, m_config.g_w / 256)));
+        bool rowMT = optionRowMT();
+        vpx_codec_control(&m_codec, VP9E_SET_TILE_COLUMNS, (int)tileColumns);
+        if (m_intraRefresh) {
+            // Cyclic refresh is what intraRefreshFrames maps to, libvpx
+            // picks the refresh rate. Otherwise AQ keeps its default.
+            vpx_codec_control(&m_codec, VP9E_SET_AQ_MODE, 3);
+        }
+#ifdef VPX_CTRL_VP9E_SET_ROW_MT
+        vpx_codec_control(&m_codec, VP9E_SET_ROW_MT, rowMT ? 1 : 0);
+#else
+        rowMT = false;
+#endif
+        LOGD("VP9 cpu-used " << cpuUsed << " tile columns " << (1 << tileColumns)
+             << " row-mt " << rowMT);
+    }
+}
+
+bool VpxVideoEncoder::encode(shared_ptr<const YCbCrFrame> frame, bool forceSync)
+{
+    LOGV("Encode: timestamp=" << frame->timestampUs << " forceSync=" << forceSync);
+
+    if (!m_initialized) {
+        LOGE("Encoder is not initialized");
+        return false;
+    }
+
+    if (frame->width != m_config.g_w || frame->height != m_config.g_h) {
+        LOGE("Frame size " << frame->width << "x" << frame->height
+             << " doesn't match the encoder size "
+             << m_config.g_w << "x" << m_config.g_h);
+        return false;
+    }
+
+    m_latency->record(LatencyEncodeQueued, frame->timestampUs);
+
+    {
+        unique_lock lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_queueCount < ENCODER_QUEUE_DEPTH || m_quit; });
+        if (m_quit) {
+            return false;
+        }
+        Input &input = m_queue[(m_queueHead + m_queueCount) % ENCODER_QUEUE_DEPTH];
+        input.frame = move(frame);
+        input.forceSync = forceSync;
+        m_queueCount++;
+    }
+    m_cond.notify_all();
+    m_framesQueued++;
+    return true;
+}
+
+RateUpdate VpxVideoEncoder::setRates(int bitrate, int framerate)
+{
+    if (!m_initialized || bitrate <= 0 || framerate <= 0) {
+        LOGE("Cannot set bitrate=" << bitrate << " fps=" << framerate);
+        return RateUpdateFailed;
+    }
+    scoped_lock lock(m_mutex);
+    m_pendingBitrate = bitrate;
+    m_pendingFramerate = framerate;
+    return RateUpdateInPlace;
+}
+
+// Called on the encoder thread
+void VpxVideoEncoder::applyRates(int bitrate, int framerate)
+{
+    unsigned int targetBitrate = max(1, bitrate / 1000);
+    m_frameDuration = 1000000 / framerate;
+    if (targetBitrate == m_config.rc_target_bitrate) {
+        return;
+    }
+    m_config.rc_target_bitrate = targetBitrate;
+    vpx_codec_err_t err = vpx_codec_enc_config_set(&m_codec, &m_config);
+    if (err != VPX_CODEC_OK) {
+        error("Cannot change the bitrate: " + codecError(&m_codec));
+        return;
+    }
+    LOGD("Bitrate " << bitrate << " fps " << framerate);
+}
+
+void VpxVideoEncoder::loop()
+{
+    Input input;
+    for (;;) {
+        int bitrate;
+        int framerate;
+        {
+            unique_lock lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_queueCount || m_quit; });
+            if (m_quit) {
+                break;
+            }
+            input = move(m_queue[m_queueHead]);
+            m_queueHead = (m_queueHead + 1) % ENCODER_QUEUE_DEPTH;
+            m_queueCount--;
+            bitrate = m_pendingBitrate;
+            framerate = m_pendingFramerate;
+            m_pendingBitrate = 0;
+        }
+        m_cond.notify_all();
+
+        if (bitrate) {
+            applyRates(bitrate, framerate);
+        }
+        encodeFrame(input);
+        input.frame.reset();
+    }
+}
+
+// Called on the encoder thread
+void VpxVideoEncoder::encodeFrame(const Input &input)
+{
+    const YCbCrFrame &frame = *input.frame;
+    BufferPool::Buffer *staging = nullptr;
+    vpx_image_t image;
+
+    vpx_img_wrap(&image, VPX_IMG_FMT_I420, frame.width, frame.height, 1,
+                 const_cast<uint8_t *>(frame.y));
+    if (frame.chromaStep == 1) {
+        // Planar frames are read in place, whatever their strides.
+        image.planes[VPX_PLANE_Y] = const_cast<uint8_t *>(frame.y);
+        image.planes[VPX_PLANE_U] = const_cast<uint8_t *>(frame.cb);
+        image.planes[VPX_PLANE_V] = const_cast<uint8_t *>(frame.cr);
+        image.stride[VPX_PLANE_Y] = frame.yStride;
+        image.stride[VPX_PLANE_U] = frame.cStride;
+        image.stride[VPX_PLANE_V] = frame.cStride;
+        m_framesZeroCopy++;
+    } else {
+        staging = m_bufferPool->acquire(m_frameSize);
+        YCbCrFrame layout = makeI420Layout(staging->data(), frame.width, frame.height);
+        if (!convertYCbCrFrame(frame, layout)) {
+            BufferPool::Buffer::release(staging);
+            error("Cannot convert the frame");
+            return;
+        }
+        image.planes[VPX_PLANE_Y] = const_cast<uint8_t *>(layout.y);
+        image.planes[VPX_PLANE_U] = const_cast<uint8_t *>(layout.cb);
+        image.planes[VPX_PLANE_V] = const_cast<uint8_t *>(layout.cr);
+        image.stride[VPX_PLANE_Y] = layout.yStride;
+        image.stride[VPX_PLANE_U] = layout.cStride;
+        image.stride[VPX_PLANE_V] = layout.cStride;
+    }
+
+    vpx_codec_err_t err = vpx_codec_encode(&m_codec, &image, frame.timestampUs,
+                                           m_frameDuration,
+                                           keyFrameDue(frame.timestampUs, input.forceSync)
+                                           ? VPX_EFLAG_FORCE_KF : 0,
+                                           VPX_DL_REALTIME);
+    if (staging) {
+        BufferPool::Buffer::release(staging);
+    }
+    if (err != VPX_CODEC_OK) {
+        error("Encoding failed: " + codecError(&m_codec));
+        return;
+    }
+
+    vpx_codec_iter_t iter = nullptr;
+    const vpx_codec_cx_pkt_t *packet;
+    while ((packet = vpx_codec_get_cx_data(&m_codec, &iter))) {
+        if (packet->kind != VPX_CODEC_CX_FRAME_PKT) {
+            continue;
+        }
+        uint64_t timestampUs = packet->data.frame.pts;
+        LOGV("encoded " << packet->data.frame.sz << " bytes, timestamp " << timestampUs
+             << ((packet->data.frame.flags & VPX_FRAME_IS_KEY) ? " key" : ""));
+        m_framesEncoded++;
+        if (m_encoderListener) {
+            m_latency->record(LatencyEncoded, timestampUs);
+            FrameType ft = (packet->data.frame.flags & VPX_FRAME_IS_KEY) ? KeyFrame : DeltaFrame;
+            deliverEncodedFrame(static_cast<uint8_t *>(packet->data.frame.buf),
+                                packet->data.frame.sz, timestampUs, ft);
+        }
+    }
+}
+
+bool VpxVideoEncoder::getStats(VideoEncoderStats &stats)
+{
+    stats.framesQueued = m_framesQueued;
+    stats.framesEncoded = m_framesEncoded;
+    stats.framesZeroCopy = m_framesZeroCopy;
+    if (m_bufferPool) {
+        BufferPoolStats poolStats = m_bufferPool->stats();
+        stats.bufferPoolHits = poolStats.hits;
+        stats.bufferPoolMisses = poolStats.misses;
+    } else {
+        stats.bufferPoolHits = 0;
+        stats.bufferPoolMisses = 0;
+    }
+    stats.encodedFramesHeld = encodedFramesHeld();
+    return true;
+}
+
+void VpxVideoEncoder::error(string errorDescription)
+{
+    LOGE(errorDescription);
+
+    if (m_encoderListener) {
+        m_encoderListener->onEncoderError(errorDescription);
+    }
+}
+
+VpxVideoDecoder::VpxVideoDecoder(CodecType codecType)
+    : m_codecType(codecType)
+    , m_latency(codecLatencyStream("vpx-decoder", codecType))
+{
+    memset(&m_metadata, 0, sizeof(m_metadata));
+    memset(&m_codec, 0, sizeof(m_codec));
+}
+
+VpxVideoDecoder::~VpxVideoDecoder()
+{
+    LOGD("");
+    stop();
+}
+
+bool VpxVideoDecoder::init(VideoDecoderMetadata metadata)
+{
+    if (!codecTypeName(metadata.codecType) || metadata.codecType != m_codecType) {
+        LOGE("Unsupported codec " << metadata.codecType);
+        return false;
+    }
+    m_metadata = metadata;
+    // VP8 and VP9 carry everything in the bitstream.
+    m_metadata.codecSpecific = nullptr;
+    m_metadata.codecSpecificSize = 0;
+
+    LOGI("Codec metadata:"
+         << " type=" << codecTypeName(m_codecType)
+         << " width=" << m_metadata.width
+         << " height=" << m_metadata.height
+         << " fps=" << m_metadata.framerate);
+    return true;
+}
+
+bool VpxVideoDecoder::start()
+{
+    vpx_codec_dec_cfg_t config;
+    memset(&config, 0, sizeof(config));
+    config.threads = optionThreads(m_metadata.width, m_metadata.height);
+    config.w = m_metadata.width;
+    config.h = m_metadata.height;
+
+    vpx_codec_iface_t *iface = m_codecType == VideoCodecVP8 ?
+                               vpx_codec_vp8_dx() : vpx_codec_vp9_dx();
+    vpx_codec_err_t err = vpx_codec_dec_init(&m_codec, iface, &config, 0);
+    if (err != VPX_CODEC_OK) {
+        LOGE("Failed to create the decoder: " << vpx_codec_err_to_string(err));
+        return false;
+    }
+
+#ifdef VPX_CTRL_VP9D_SET_ROW_MT
+    if (m_codecType == VideoCodecVP9 && config.threads > 1 && optionRowMT()) {
+        vpx_codec_control(&m_codec, VP9D_SET_ROW_MT, 1);
+    }
+#endif
+
+    m_quit = false;
+    m_draining = false;
+    m_started = true;
+    m_thread = thread(&VpxVideoDecoder::loop, this);
+
+    LOGD("Decoder started for " << codecTypeName(m_codecType)
+         << " threads=" << config.threads);
+    return true;
+}
+
+DecodeResult VpxVideoDecoder::queueInput(const uint8_t *data,
+                                         size_t size,
+                                         uint64_t timestampUs,
+                                         void (*release)(void *),
+                                         void *releaseData,
+                                         bool block)
+{
+    LOGV("Decode: timestamp=" << timestampUs);
+
+    if (!m_started && !start()) {
+        LOGE("Cannot create decoder");
+        return DecodeError;
+    }
+
+    {
+        unique_lock lock(m_mutex);
+        if (m_inputCount == DECODER_INPUT_CREDITS) {
+            if (!block) {
+                m_creditWanted = true;
+                return DecodeWouldBlock;
+            }
+            m_cond.wait(lock, [this] { return m_inputCount < DECODER_INPUT_CREDITS; });
+        }
+        Input &input = m_inputs[(m_inputHead + m_inputCount) % DECODER_INPUT_CREDITS];
+        input.data = data;
+        input.size = size;
+        input.timestampUs = timestampUs;
+        input.release = release;
+        input.releaseData = releaseData;
+        m_inputCount++;
+    }
+    m_cond.notify_all();
+
+    m_latency->decodeQueued(timestampUs);
+    return DecodeOk;
+}
+
+bool VpxVideoDecoder::decode(const uint8_t *data,
+                             size_t size,
+                             uint64_t timestampUs,
+                             FrameType frameType,
+                             void (*release)(void *),
+                             void *releaseData)
+{
+    return queueInput(data, size, timestampUs, release, releaseData, true) == DecodeOk;
+}
+
+DecodeResult VpxVideoDecoder::tryDecode(const uint8_t *data,
+                                        size_t size,
+                                        uint64_t timestampUs,
+                                        FrameType frameType,
+                                        void (*release)(void *),
+                                        void *releaseData)
+{
+    return queueInput(data, size, timestampUs, release, releaseData, false);
+}
+
+void VpxVideoDecoder::loop()
+{
+    for (;;) {
+        Input input;
+        bool drain = false;
+        {
+            unique_lock lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_inputCount || m_draining || m_quit; });
+            if (m_quit) {
+                break;
+            }
+            if (m_inputCount) {
+                input = m_inputs[m_inputHead];
+            } else {
+                drain = true;
+                m_draining = false;
+            }
+        }
+
+        if (drain) {
+            vpx_codec_decode(&m_codec, nullptr, 0, nullptr, 0);
+            outputFrames(0);
+            if (m_decoderListener) {
+                m_decoderListener->onDecoderEOS();
+            }
+            continue;
+        }
+
+        decodeInput(input);
+
+        bool notify;
+        {
+            scoped_lock lock(m_mutex);
+            m_inputHead = (m_inputHead + 1) % DECODER_INPUT_CREDITS;
+            m_inputCount--;
+            notify = m_creditWanted;
+            m_creditWanted = false;
+        }
+        m_cond.notify_all();
+
+        if (notify && m_decoderListener) {
+            m_decoderListener->onDecoderInputCredit();
+        }
+    }
+}
+
+// Called on the decoder thread. The input stays queued, and so counts
+// against the credits, until it has been decoded.
+void VpxVideoDecoder::decodeInput(const Input &input)
+{
+    vpx_codec_err_t err = vpx_codec_decode(&m_codec, input.data, input.size, nullptr, 0);
+    // libvpx doesn't keep references to the input.
+    if (input.release) {
+        input.release(input.releaseData);
+    }
+    if (err != VPX_CODEC_OK) {
+        error("Decoding failed: " + codecError(&m_codec));
+        return;
+    }
+    // VP8 and VP9 don't reorder frames, so the output belongs to this input.
+    outputFrames(input.timestampUs);
+}
+
+void VpxVideoDecoder::outputFrames(uint64_t timestampUs)
+{
+    vpx_codec_iter_t iter = nullptr;
+    vpx_image_t *image;
+    while ((image = vpx_codec_get_frame(&m_codec, &iter))) {
+        if (image->fmt != VPX_IMG_FMT_I420) {
+            error("Unsupported output format " + to_string(image->fmt));
+            continue;
+        }
+        if (m_decoderListener) {
+            YCbCrFrame frame;
+            frame.y = image->planes[VPX_PLANE_Y];
+            frame.cb = image->planes[VPX_PLANE_U];
+            frame.cr = image->planes[VPX_PLANE_V];
+            frame.yStride = image->stride[VPX_PLANE_Y];
+            frame.cStride = image->stride[VPX_PLANE_U];
+            frame.chromaStep = 1;
+            frame.width = image->d_w;
+            frame.height = image->d_h;
+            frame.timestampUs = timestampUs;
+            m_latency->decoded(timestampUs);
+            m_decoderListener->onDecodedYCbCrFrame(&frame);
+        }
+    }
+}
+
+// Inputs which haven't been decoded yet are released without decoding.
+// Called with the decoder thread stopped.
+void VpxVideoDecoder::releaseInputs()
+{
+    while (m_inputCount) {
+        Input &input = m_inputs[m_inputHead];
+        if (input.release) {
+            input.release(input.releaseData);
+        }
+        m_inputHead = (m_inputHead + 1) % DECODER_INPUT_CREDITS;
+        m_inputCount--;
+    }
+}
+
+void VpxVideoDecoder::drain()
+{
+    LOGD("");
+    if (m_started) {
+        {
+            scoped_lock lock(m_mutex);
+            m_draining = true;
+        }
+        m_cond.notify_all();
+    }
+}
+
+void VpxVideoDecoder::flush()
+{
+    LOGD("");
+    if (m_started) {
+        stop();
+    }
+}
+
+void VpxVideoDecoder::stop()
+{
+    LOGD("");
+    if (m_started) {
+        {
+            scoped_lock lock(m_mutex);
+            m_quit = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+        {
+            scoped_lock lock(m_mutex);
+            releaseInputs();
+            m_creditWanted = false;
+        }
+        m_cond.notify_all();
+        vpx_codec_destroy(&m_codec);
+        m_started = false;
+    }
+}
+
+void VpxVideoDecoder::error(string errorDescription)
+{
+    LOGE(errorDescription);
+
+    if (m_decoderListener) {
+        m_decoderListener->onDecoderError(errorDescription);
+    }
+}
+
+static VpxCodecManager codecManagerVpx;
+
+} // namespace codec
+} // namespace gecko
+
+extern "C" __attribute__((visibility("default")))
+gecko::codec::CodecManager *gecko_codec_plugin_manager(void)
+{
+    gecko::codec::codecManagerVpx.init();
+    return &gecko::codec::codecManagerVpx;
+}
+
+// Codec only, so the plugin is not loaded for cameras.
+extern "C" __attribute__((visibility("default")))
+const gecko::camera::PluginManifest gecko_camera_plugin_manifest = {
+    gecko::camera::PLUGIN_MANIFEST_VERSION,
+    false,
+    gecko::codec::codecMask(gecko::codec::VideoCodecVP8)
+    | gecko::codec::codecMask(gecko::codec::VideoCodecVP9),
+    gecko::codec::codecMask(gecko::codec::VideoCodecVP8)
+    | gecko::codec::codecMask(gecko::codec::VideoCodecVP9),
+};
+/* vim: set ts=4 et sw=4 tw=80: */
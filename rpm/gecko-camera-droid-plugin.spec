@@ -18,7 +18,7 @@ A library to simplify video capture, droidmedia-based plugin.
 %autosetup
 
 %build
-%meson -Dbuild-tests=false -Dbuild-examples=false -Dbuild-devel=false -Dbuild-droid-plugin=true
+%meson -Dbuild-tests=false -Dbuild-examples=false -Dbuild-devel=false -Dbuild-droid-plugin=true -Dbuild-vpx-plugin=disabled
 meson rewrite kwargs set project / version %{version}-%{release}
 %meson_build
 
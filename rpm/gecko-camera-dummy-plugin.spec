@@ -16,7 +16,7 @@ A library to simplify video capture, dummy camera plugin.
 %autosetup
 
 %build
-%meson -Dbuild-tests=false -Dbuild-examples=false -Dbuild-devel=false -Dbuild-droid-plugin=false -Dbuild-dummy-plugin=true
+%meson -Dbuild-tests=false -Dbuild-examples=false -Dbuild-devel=false -Dbuild-droid-plugin=false -Dbuild-dummy-plugin=true -Dbuild-vpx-plugin=disabled
 meson rewrite kwargs set project / version %{version}-%{release}
 %meson_build
 
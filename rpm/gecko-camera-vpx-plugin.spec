@@ -0,0 +1,29 @@
+Name:           gecko-camera-vpx-plugin
+Summary:        A libvpx software codec plugin for gecko-camera
+Version:        0.1
+Release:        1
+License:        LGPLv2+
+URL:            https://github.com/sailfishos/gecko-camera
+Source0:        %{name}-%{version}.tar.gz
+BuildRequires:  meson
+BuildRequires:  pkgconfig(geckocamera)
+BuildRequires:  pkgconfig(vpx)
+Requires:       gecko-camera
+
+%description
+A library to simplify video capture, libvpx software codec plugin.
+
+%prep
+%autosetup
+
+%build
+%meson -Dbuild-tests=false -Dbuild-examples=false -Dbuild-devel=false -Dbuild-droid-plugin=false -Dbuild-dummy-plugin=false -Dbuild-vpx-plugin=enabled
+meson rewrite kwargs set project / version %{version}-%{release}
+%meson_build
+
+%install
+%meson_install
+
+%files
+%license LICENSE
+%{_libdir}/gecko-camera/plugins/libgeckocamera-vpx.so
@@ -29,7 +29,7 @@ Requires:       gecko-camera = %{version}-%{release}
 %autosetup
 
 %build
-%meson -Dbuild-tests=false
+%meson -Dbuild-tests=false -Dbuild-vpx-plugin=disabled
 meson rewrite kwargs set project / version %{version}
 %meson_build
 
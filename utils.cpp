@@ -17,7 +17,11 @@
  */
 
 #include <syslog.h>
+#include <unistd.h>
+#include <cstdio>
 #include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 
 #include "geckocamera-utils.h"
@@ -108,6 +112,42 @@ void LogInit(string logTag, LogLevel logLevel)
     }
 }
 
+string cacheFilePath(const string &name)
+{
+    const char *dir = getenv("XDG_CACHE_HOME");
+    if (dir && *dir) {
+        return string(dir) + "/gecko-camera/" + name;
+    }
+    dir = getenv("HOME");
+    if (dir && *dir) {
+        return string(dir) + "/.cache/gecko-camera/" + name;
+    }
+    return string();
+}
+
+bool writeCacheFile(const string &path, const string &contents)
+{
+    error_code ec;
+    filesystem::create_directories(filesystem::path(path).parent_path(), ec);
+
+    string tmpPath = path + "." + to_string(getpid());
+    {
+        ofstream out(tmpPath);
+        out << contents;
+        if (!out) {
+            LOGD("Cannot write " << tmpPath);
+            out.close();
+            remove(tmpPath.c_str());
+            return false;
+        }
+    }
+    if (rename(tmpPath.c_str(), path.c_str())) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
 } // namespace camera
 } // namespace gecko
 